@@ -16,8 +16,40 @@ TEMPLATE = app
 
 
 SOURCES += src/main.cpp \
-    src/capnsd.cpp
+    src/capnsd.cpp \
+    src/cframeencoder.cpp \
+    src/cinflightwindow.cpp \
+    src/cgatewayconnection.cpp \
+    src/cpayloaddrain.cpp \
+    src/cspool.cpp \
+    src/cingestserver.cpp \
+    src/ctokenblocklist.cpp \
+    src/cbroadcastjob.cpp \
+    src/ctimingwheel.cpp \
+    src/ccollapseindex.cpp \
+    src/config.cpp \
+    src/clogger.cpp \
+    src/stats.cpp \
+    src/cstatsserver.cpp \
+    src/ctrace.cpp
 
 HEADERS += \
     src/capnsd.h \
-    src/shared.h
+    src/shared.h \
+    src/latency.h \
+    src/cframeencoder.h \
+    src/cinflightwindow.h \
+    src/cgatewayconnection.h \
+    src/cpayloaddrain.h \
+    src/cspscqueue.h \
+    src/cspool.h \
+    src/cingestserver.h \
+    src/ctokenblocklist.h \
+    src/cbroadcastjob.h \
+    src/ctimingwheel.h \
+    src/ccollapseindex.h \
+    src/config.h \
+    src/clogger.h \
+    src/stats.h \
+    src/cstatsserver.h \
+    src/ctrace.h
@@ -0,0 +1,25 @@
+#-------------------------------------------------
+#
+# Frame encoder microbenchmark
+#
+#-------------------------------------------------
+
+QT       += core
+
+QT       -= gui
+
+TARGET = encoderbench
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += main.cpp \
+    ../../src/cframeencoder.cpp
+
+HEADERS += \
+    ../../src/cframeencoder.h \
+    ../../src/shared.h \
+    ../../src/hexdecode.h
@@ -0,0 +1,170 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QByteArray>
+#include <QString>
+#include <QDataStream>
+#include <QElapsedTimer>
+#include <iostream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "cframeencoder.h"
+#include "shared.h"
+#include "hexdecode.h"
+
+/*
+ * Compares the old per payload QDataStream encoding of checkPayloads() with
+ * CFrameEncoder, and the scalar hex token decoder with the SSE2 one.
+ * Allocations are counted by interposing malloc.
+ */
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+
+static quint64 s_iAllocs = 0;
+
+extern "C" void *malloc(size_t size)
+{
+    s_iAllocs++;
+    return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t n, size_t size)
+{
+    s_iAllocs++;
+    return __libc_calloc(n,size);
+}
+
+extern "C" void *realloc(void *ptr, size_t size)
+{
+    s_iAllocs++;
+    return __libc_realloc(ptr,size);
+}
+
+#define BATCH 4096
+#define ROUNDS 200
+
+static char s_sink[BATCH * 512];
+static char s_hex[BATCH][64];
+static char s_json[BATCH][PAYLOAD_MAX_SIZE];
+static quint64 s_iSinkBytes = 0;
+
+static void sink(const char *data, int len)
+{
+    memcpy(s_sink,data,len);
+    s_iSinkBytes += len;
+}
+
+static void fill(PayloadData *payloads)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (int i=0;i<BATCH;i++)
+    {
+        for (int c=0;c<64;c++)
+            s_hex[i][c] = hex[rand() % 16];
+        decodeHexTokenScalar(s_hex[i],payloads[i].device);
+        payloads[i].length = snprintf(s_json[i],PAYLOAD_MAX_SIZE,
+                 "{\"aps\":{\"alert\":\"Bericht %d voor \xc3\xa9\xc3\xa9n gebruiker\",\"badge\":%d,\"sound\":\"default\"}}",i,i % 100);
+    }
+}
+
+//the old path decoded the hex token of every payload while sending
+static void encodeOld(const char *hex, const char *jsonstr)
+{
+    QByteArray data;
+    QDataStream ds(&data,QIODevice::WriteOnly);
+
+    ds << (quint8)(0) << (quint16)(32);
+
+    QByteArray device = QByteArray::fromHex(QByteArray(hex,64));
+    QString json= QString::fromUtf8(jsonstr);
+
+    ds.writeRawData(device.data(),32);
+    ds << (quint16)(json.size());
+    ds.writeRawData(json.toUtf8().data(),json.size());
+    sink(data.constData(),data.size());
+}
+
+static void report(const char *name, qint64 nsecs, quint64 allocs)
+{
+    double frames = (double)BATCH * ROUNDS;
+    printf("%-16s %12.0f frames/sec %8.2f allocations/frame\n",name,frames / (nsecs / 1e9),allocs / frames);
+}
+
+static void reportDecode(const char *name, qint64 nsecs)
+{
+    double tokens = (double)BATCH * ROUNDS;
+    printf("%-16s %12.0f tokens/sec\n",name,tokens / (nsecs / 1e9));
+}
+
+int main(int, char **)
+{
+    PayloadData *payloads = new PayloadData[BATCH];
+    fill(payloads);
+
+    QElapsedTimer timer;
+    quint64 allocs;
+
+    //before: one QByteArray, QDataStream and socket write per frame
+    allocs = s_iAllocs;
+    timer.start();
+    for (int r=0;r<ROUNDS;r++)
+        for (int i=0;i<BATCH;i++)
+            encodeOld(s_hex[i],s_json[i]);
+    report("QDataStream",timer.nsecsElapsed(),s_iAllocs - allocs);
+
+    //after: one reusable buffer and one write per batch
+    CFrameEncoder encoder;
+    allocs = s_iAllocs;
+    timer.start();
+    for (int r=0;r<ROUNDS;r++)
+    {
+        encoder.clear();
+        for (int i=0;i<BATCH;i++)
+            encoder.encode(&payloads[i],s_json[i]);
+        sink(encoder.data(),encoder.size());
+    }
+    report("CFrameEncoder",timer.nsecsElapsed(),s_iAllocs - allocs);
+
+    std::cout << s_iSinkBytes << " bytes encoded\n";
+
+    //token validation and decoding at enqueue
+    uchar token[PAYLOAD_TOKEN_SIZE];
+    int valid = 0;
+    timer.start();
+    for (int r=0;r<ROUNDS;r++)
+        for (int i=0;i<BATCH;i++)
+            valid += decodeHexTokenScalar(s_hex[i],token);
+    reportDecode("hex scalar",timer.nsecsElapsed());
+
+    timer.start();
+    for (int r=0;r<ROUNDS;r++)
+        for (int i=0;i<BATCH;i++)
+            valid += decodeHexToken(s_hex[i],token);
+    reportDecode("hex decode",timer.nsecsElapsed());
+
+    std::cout << valid << " tokens decoded\n";
+
+    delete [] payloads;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,467 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "cmockgateway.h"
+#include "latency.h"
+#include <QSslSocket>
+#include <QHostAddress>
+#include <QTimer>
+#include <QFile>
+#include <QtEndian>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MOCK_MAX_FRAME (1024 * 1024)
+#define MOCK_MAX_FEEDBACK 65536
+
+//APNs error response statuses
+#define STATUS_PROCESSING_ERROR 1
+#define STATUS_MISSING_TOKEN 2
+#define STATUS_MISSING_PAYLOAD 4
+#define STATUS_INVALID_TOKEN_SIZE 5
+#define STATUS_INVALID_TOKEN 8
+
+bool MockGatewayOptions::set(const char *name, const char *value)
+{
+    if (strcmp(name,"--cert") == 0)
+        certFile = value;
+    else if (strcmp(name,"--key") == 0)
+        keyFile = value;
+    else if (strcmp(name,"--port") == 0)
+        port = atoi(value);
+    else if (strcmp(name,"--latency") == 0)
+        latency = atoi(value);
+    else if (strcmp(name,"--error-every") == 0)
+        errorEvery = atoi(value);
+    else if (strcmp(name,"--error-status") == 0)
+        errorStatus = atoi(value);
+    else if (strcmp(name,"--disconnect-every") == 0)
+        disconnectEvery = atoi(value);
+    else
+        return false;
+    return true;
+}
+
+void MockGatewayOptions::usage()
+{
+    printf("  --port <port>              gateway port, feedback on port + 1 (default 2195)\n");
+    printf("  --latency <ms>             delay before received data is processed\n");
+    printf("  --error-every <n>          answer every n-th notification with an error response\n");
+    printf("  --error-status <status>    status of those error responses (default 8, invalid token)\n");
+    printf("  --disconnect-every <n>     close a connection after n notifications\n");
+}
+
+#if QT_VERSION >= 0x050000
+void CSslServer::incomingConnection(qintptr socketDescriptor)
+#else
+void CSslServer::incomingConnection(int socketDescriptor)
+#endif
+{
+    QSslSocket *socket = new QSslSocket(this);
+    if (socket->setSocketDescriptor(socketDescriptor))
+        addPendingConnection(socket);
+    else
+        delete socket;
+}
+
+CMockGateway::CMockGateway(const MockGatewayOptions &options, QObject *parent) :
+    QObject(parent), m_options(options)
+{
+    m_pGateway = new CSslServer(this);
+    m_pFeedback = new CSslServer(this);
+    connect(m_pGateway,SIGNAL(newConnection()),this,SLOT(newGatewayConnection()));
+    connect(m_pFeedback,SIGNAL(newConnection()),this,SLOT(newFeedbackConnection()));
+
+    m_pDelayTimer = new QTimer(this);
+    m_pDelayTimer->setInterval(1);
+    connect(m_pDelayTimer,SIGNAL(timeout()),this,SLOT(processDelayed()));
+
+    m_iSeen = 0;
+    m_iReceived = 0;
+    m_iErrors = 0;
+    m_iDisconnects = 0;
+    m_iConnections = 0;
+    m_iBytes = 0;
+    m_iLastReceived = 0;
+    m_iLastReport = monotonicNs();
+}
+
+CMockGateway::~CMockGateway()
+{
+    for (int i=0;i<m_clients.size();i++)
+        delete m_clients[i];
+}
+
+bool CMockGateway::listen(QString *error)
+{
+    QList<QSslCertificate> certs = QSslCertificate::fromPath(m_options.certFile);
+    if (certs.isEmpty())
+    {
+        *error = "No certificate in " + m_options.certFile + ".";
+        return false;
+    }
+    m_cert = certs.first();
+
+    QFile keyfile(m_options.keyFile);
+    if (keyfile.open(QIODevice::ReadOnly))
+        m_key = QSslKey(keyfile.readAll(),QSsl::Rsa,QSsl::Pem,QSsl::PrivateKey);
+    if (m_key.isNull())
+    {
+        *error = "No unencrypted RSA key in " + m_options.keyFile + ".";
+        return false;
+    }
+
+    if (!m_pGateway->listen(QHostAddress::LocalHost,m_options.port))
+    {
+        *error = "Could not listen on 127.0.0.1:" + QString::number(m_options.port) + ": " + m_pGateway->errorString();
+        return false;
+    }
+    if (!m_pFeedback->listen(QHostAddress::LocalHost,m_options.port + 1))
+    {
+        *error = "Could not listen on 127.0.0.1:" + QString::number(m_options.port + 1) + ": " + m_pFeedback->errorString();
+        return false;
+    }
+    return true;
+}
+
+void CMockGateway::count(quint64 *counter, quint64 n)
+{
+    //only the gateway thread writes, others read with acquire
+    __atomic_store_n(counter,__atomic_load_n(counter,__ATOMIC_RELAXED) + n,__ATOMIC_RELEASE);
+}
+
+void CMockGateway::report()
+{
+    quint64 now = monotonicNs();
+    quint64 received = m_iReceived;
+    double rate = (received - m_iLastReceived) / ((now - m_iLastReport) / 1e9);
+    m_iLastReceived = received;
+    m_iLastReport = now;
+
+    printf("received=%llu rate=%.0f errors=%llu disconnects=%llu connections=%llu\n",
+           (unsigned long long)received,rate,(unsigned long long)m_iErrors,
+           (unsigned long long)m_iDisconnects,(unsigned long long)m_iConnections);
+    fflush(stdout);
+}
+
+void CMockGateway::notification(const uchar *, const char *, int, quint32)
+{
+}
+
+void CMockGateway::newGatewayConnection()
+{
+    QTcpSocket *pending;
+    while ((pending = m_pGateway->nextPendingConnection()) != 0)
+    {
+        QSslSocket *socket = static_cast<QSslSocket*>(pending);
+
+        Client *client = new Client;
+        client->socket = socket;
+        client->notifications = 0;
+        client->closing = false;
+        client->busy = false;
+        client->gone = false;
+        m_clients.append(client);
+        count(&m_iConnections);
+
+        connect(socket,SIGNAL(readyRead()),this,SLOT(readyRead()));
+        connect(socket,SIGNAL(disconnected()),this,SLOT(disconnected()));
+
+        socket->setLocalCertificate(m_cert);
+        socket->setPrivateKey(m_key);
+        socket->setPeerVerifyMode(QSslSocket::VerifyNone);
+        socket->startServerEncryption();
+    }
+}
+
+void CMockGateway::newFeedbackConnection()
+{
+    QTcpSocket *pending;
+    while ((pending = m_pFeedback->nextPendingConnection()) != 0)
+    {
+        QSslSocket *socket = static_cast<QSslSocket*>(pending);
+        connect(socket,SIGNAL(encrypted()),this,SLOT(feedbackEncrypted()));
+        connect(socket,SIGNAL(disconnected()),socket,SLOT(deleteLater()));
+
+        socket->setLocalCertificate(m_cert);
+        socket->setPrivateKey(m_key);
+        socket->setPeerVerifyMode(QSslSocket::VerifyNone);
+        socket->startServerEncryption();
+    }
+}
+
+/*
+ * Feedback tuples: time(4) token length(2) token(32), the service closes
+ * the connection once they are sent.
+ */
+void CMockGateway::feedbackEncrypted()
+{
+    QSslSocket *socket = qobject_cast<QSslSocket*>(sender());
+    if (!socket)
+        return;
+
+    QByteArray tuples(m_feedback.size() * 38,0);
+    uchar *p = reinterpret_cast<uchar*>(tuples.data());
+    quint32 now = ::time(0);
+    for (int i=0;i<m_feedback.size();i++,p += 38)
+    {
+        qToBigEndian<quint32>(now,p);
+        qToBigEndian<quint16>(32,p + 4);
+        memcpy(p + 6,m_feedback[i].constData(),32);
+    }
+    m_feedback.clear();
+
+    socket->write(tuples);
+    socket->disconnectFromHost();
+}
+
+CMockGateway::Client *CMockGateway::findClient(QObject *socket) const
+{
+    for (int i=0;i<m_clients.size();i++)
+        if (m_clients[i]->socket == socket)
+            return m_clients[i];
+    return 0;
+}
+
+void CMockGateway::readyRead()
+{
+    Client *client = findClient(sender());
+    if (!client)
+        return;
+
+    QByteArray data = client->socket->readAll();
+    count(&m_iBytes,data.size());
+    if (client->closing)
+        return;
+
+    if (m_options.latency > 0)
+    {
+        Chunk chunk;
+        chunk.due = monotonicNs() + (quint64)m_options.latency * 1000000ULL;
+        chunk.data = data;
+        client->delayed.append(chunk);
+        if (!m_pDelayTimer->isActive())
+            m_pDelayTimer->start();
+        return;
+    }
+
+    client->buffer.append(data);
+    process(client);
+}
+
+void CMockGateway::processDelayed()
+{
+    quint64 now = monotonicNs();
+    bool pending = false;
+
+    //process() may drop clients from m_clients
+    QList<Client*> clients = m_clients;
+    for (int i=0;i<clients.size();i++)
+    {
+        Client *client = clients[i];
+        bool due = false;
+        while (!client->delayed.isEmpty() && client->delayed.first().due <= now)
+        {
+            client->buffer.append(client->delayed.first().data);
+            client->delayed.removeFirst();
+            due = true;
+        }
+        if (!client->delayed.isEmpty())
+            pending = true;
+        if (due)
+            process(client);
+    }
+
+    if (!pending)
+        m_pDelayTimer->stop();
+}
+
+void CMockGateway::disconnected()
+{
+    Client *client = findClient(sender());
+    if (!client)
+        return;
+
+    m_clients.removeOne(client);
+    client->socket->deleteLater();
+    //may be emitted from within process(), which deletes it then
+    if (client->busy)
+        client->gone = true;
+    else
+        delete client;
+}
+
+void CMockGateway::process(Client *client)
+{
+    client->busy = true;
+
+    const uchar *d = reinterpret_cast<const uchar*>(client->buffer.constData());
+    int size = client->buffer.size();
+    int pos = 0;
+    while (!client->closing)
+    {
+        int n = parseFrame(client,d + pos,size - pos);
+        if (n <= 0)
+            break;
+        pos += n;
+    }
+
+    //like APNs, whatever followed an error or disconnect is lost
+    if (client->closing)
+        client->buffer.clear();
+    else
+        client->buffer.remove(0,pos);
+
+    client->busy = false;
+    if (client->gone)
+        delete client;
+}
+
+/*
+ * Returns the bytes consumed, 0 while the frame is incomplete.
+ *  command 0: command(1) token length(2) token payload length(2) payload
+ *  command 1: command(1) identifier(4) expiry(4) token length(2) token payload length(2) payload
+ *  command 2: command(1) frame length(4) items, see CFrameEncoder
+ */
+int CMockGateway::parseFrame(Client *client, const uchar *d, int size)
+{
+    if (size < 1)
+        return 0;
+
+    if (d[0] == 0 || d[0] == 1)
+    {
+        bool hasIdent = d[0] == 1;
+        int header = hasIdent ? 11 : 3;
+        if (size < header)
+            return 0;
+        quint32 ident = hasIdent ? qFromBigEndian<quint32>(d + 1) : 0;
+        int toklen = qFromBigEndian<quint16>(d + header - 2);
+        if (size < header + toklen + 2)
+            return 0;
+        int len = qFromBigEndian<quint16>(d + header + toklen);
+        int total = header + toklen + 2 + len;
+        if (size < total)
+            return 0;
+
+        if (toklen != 32)
+            errorResponse(client,STATUS_INVALID_TOKEN_SIZE,ident,hasIdent);
+        else
+            accept(client,d + header,reinterpret_cast<const char*>(d + header + toklen + 2),len,ident,hasIdent);
+        return client->closing ? -1 : total;
+    }
+
+    if (d[0] == 2)
+    {
+        if (size < 5)
+            return 0;
+        quint32 framelen = qFromBigEndian<quint32>(d + 1);
+        if (framelen > MOCK_MAX_FRAME)
+        {
+            errorResponse(client,STATUS_PROCESSING_ERROR,0,true);
+            return -1;
+        }
+        if ((quint32)size < 5 + framelen)
+            return 0;
+
+        const uchar *p = d + 5;
+        const uchar *end = p + framelen;
+        const uchar *token = 0;
+        const char *json = 0;
+        int len = 0;
+        quint32 ident = 0;
+        while (p + 3 <= end)
+        {
+            int itemlen = qFromBigEndian<quint16>(p + 1);
+            if (p + 3 + itemlen > end)
+                break;
+            if (p[0] == 1 && itemlen == 32)
+                token = p + 3;
+            else if (p[0] == 2)
+            {
+                json = reinterpret_cast<const char*>(p + 3);
+                len = itemlen;
+            }
+            else if (p[0] == 3 && itemlen == 4)
+                ident = qFromBigEndian<quint32>(p + 3);
+            p += 3 + itemlen;
+        }
+
+        if (!token)
+            errorResponse(client,STATUS_MISSING_TOKEN,ident,true);
+        else if (!json)
+            errorResponse(client,STATUS_MISSING_PAYLOAD,ident,true);
+        else
+            accept(client,token,json,len,ident,true);
+        return client->closing ? -1 : 5 + framelen;
+    }
+
+    errorResponse(client,STATUS_PROCESSING_ERROR,0,true);
+    return -1;
+}
+
+bool CMockGateway::accept(Client *client, const uchar *token, const char *json, int len, quint32 ident, bool hasIdent)
+{
+    client->notifications++;
+    quint64 seen = m_iSeen++;
+
+    if (m_options.errorEvery > 0 && seen % m_options.errorEvery == (quint64)m_options.errorEvery - 1)
+    {
+        if (m_options.errorStatus == STATUS_INVALID_TOKEN && m_feedback.size() < MOCK_MAX_FEEDBACK)
+            m_feedback.append(QByteArray(reinterpret_cast<const char*>(token),32));
+        errorResponse(client,m_options.errorStatus,ident,hasIdent);
+        return false;
+    }
+
+    notification(token,json,len,ident);
+    count(&m_iReceived);
+
+    if (m_options.disconnectEvery > 0 && client->notifications >= m_options.disconnectEvery)
+    {
+        count(&m_iDisconnects);
+        close(client);
+        return false;
+    }
+    return true;
+}
+
+//command 0 has no error response, the connection is only closed
+void CMockGateway::errorResponse(Client *client, quint8 status, quint32 ident, bool hasIdent)
+{
+    if (hasIdent)
+    {
+        uchar response[6];
+        response[0] = 8;
+        response[1] = status;
+        qToBigEndian<quint32>(ident,response + 2);
+        client->socket->write(reinterpret_cast<const char*>(response),sizeof(response));
+    }
+    count(&m_iErrors);
+    close(client);
+}
+
+void CMockGateway::close(Client *client)
+{
+    client->closing = true;
+    client->delayed.clear();
+    client->socket->disconnectFromHost();
+}
@@ -0,0 +1,154 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CMOCKGATEWAY_H
+#define CMOCKGATEWAY_H
+
+#include <QObject>
+#include <QTcpServer>
+#include <QSslCertificate>
+#include <QSslKey>
+#include <QByteArray>
+#include <QString>
+#include <QList>
+
+class QSslSocket;
+class QTimer;
+
+/*
+ * Stand-in for the APNs gateway and feedback service on 127.0.0.1, for
+ * load tests that cannot run against Apple. Accepts commands 0, 1 and 2,
+ * answers every errorEvery-th notification with an error response and
+ * closes, drops a connection after disconnectEvery notifications and
+ * delays processing by latency ms. Tokens answered with status 8 are
+ * reported by the feedback service on port + 1.
+ */
+
+struct MockGatewayOptions
+{
+    QString certFile;
+    QString keyFile;
+    quint16 port;
+    int latency;
+    int errorEvery;
+    quint8 errorStatus;
+    int disconnectEvery;
+
+    MockGatewayOptions() : port(2195), latency(0), errorEvery(0), errorStatus(8), disconnectEvery(0) {}
+
+    //one --name value command line option, false when unknown
+    bool set(const char *name, const char *value);
+    static void usage();
+};
+
+//hands out QSslSockets, encryption is started by the owner
+class CSslServer : public QTcpServer
+{
+public:
+    explicit CSslServer(QObject *parent = 0) : QTcpServer(parent) {}
+
+protected:
+#if QT_VERSION >= 0x050000
+    void incomingConnection(qintptr socketDescriptor);
+#else
+    void incomingConnection(int socketDescriptor);
+#endif
+};
+
+class CMockGateway : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CMockGateway(const MockGatewayOptions &options, QObject *parent = 0);
+    virtual ~CMockGateway();
+
+    //false and error set when the certificate, key or ports are unusable
+    bool listen(QString *error);
+
+    //safe to read from any thread
+    quint64 received() const { return __atomic_load_n(&m_iReceived,__ATOMIC_ACQUIRE); }
+    quint64 errors() const { return __atomic_load_n(&m_iErrors,__ATOMIC_ACQUIRE); }
+    quint64 disconnects() const { return __atomic_load_n(&m_iDisconnects,__ATOMIC_ACQUIRE); }
+    quint64 connections() const { return __atomic_load_n(&m_iConnections,__ATOMIC_ACQUIRE); }
+    quint64 bytes() const { return __atomic_load_n(&m_iBytes,__ATOMIC_ACQUIRE); }
+
+public slots:
+    //one line with the totals and the rate since the previous call
+    void report();
+
+protected:
+    //every accepted notification, in the gateway thread
+    virtual void notification(const uchar *token, const char *json, int len, quint32 ident);
+
+private:
+    struct Chunk
+    {
+        quint64 due;
+        QByteArray data;
+    };
+
+    struct Client
+    {
+        QSslSocket *socket;
+        QByteArray buffer;
+        QList<Chunk> delayed;
+        int notifications;
+        bool closing;
+        bool busy;
+        bool gone;
+    };
+
+    Client *findClient(QObject *socket) const;
+    void process(Client *client);
+    int parseFrame(Client *client, const uchar *d, int size);
+    bool accept(Client *client, const uchar *token, const char *json, int len, quint32 ident, bool hasIdent);
+    void errorResponse(Client *client, quint8 status, quint32 ident, bool hasIdent);
+    void close(Client *client);
+    static void count(quint64 *counter, quint64 n = 1);
+
+    MockGatewayOptions m_options;
+    QSslCertificate m_cert;
+    QSslKey m_key;
+    CSslServer *m_pGateway;
+    CSslServer *m_pFeedback;
+    QTimer *m_pDelayTimer;
+    QList<Client*> m_clients;
+    QList<QByteArray> m_feedback;
+
+    quint64 m_iSeen;
+    quint64 m_iReceived;
+    quint64 m_iErrors;
+    quint64 m_iDisconnects;
+    quint64 m_iConnections;
+    quint64 m_iBytes;
+    quint64 m_iLastReceived;
+    quint64 m_iLastReport;
+
+private slots:
+    void newGatewayConnection();
+    void newFeedbackConnection();
+    void feedbackEncrypted();
+    void readyRead();
+    void disconnected();
+    void processDelayed();
+};
+
+#endif // CMOCKGATEWAY_H
@@ -0,0 +1,24 @@
+#-------------------------------------------------
+#
+# Local APNs gateway and feedback service for load tests
+#
+#-------------------------------------------------
+
+QT       += core network
+
+QT       -= gui
+
+TARGET = mockgateway
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += main.cpp \
+    cmockgateway.cpp
+
+HEADERS += \
+    cmockgateway.h \
+    ../../src/latency.h
@@ -0,0 +1,74 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QCoreApplication>
+#include <QTimer>
+#include <iostream>
+#include <stdlib.h>
+#include "cmockgateway.h"
+
+/*
+ * Local APNs gateway for load tests. Point apns_server at 127.0.0.1 and
+ * apns_server_port at --port in /etc/APNSd.cfg, the feedback service
+ * listens on the port after it.
+ */
+
+void usage()
+{
+    std::cout << "mockgateway --cert <pem file> --key <pem file> [options]\n";
+    MockGatewayOptions::usage();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    MockGatewayOptions options;
+    for (int i=1;i<argc;i+=2)
+    {
+        if (i + 1 >= argc || !options.set(argv[i],argv[i + 1]))
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (options.certFile.isEmpty() || options.keyFile.isEmpty())
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    CMockGateway gateway(options);
+    QString error;
+    if (!gateway.listen(&error))
+    {
+        std::cout << error.toStdString() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Listening on 127.0.0.1:" << options.port << ", feedback on 127.0.0.1:" << options.port + 1 << ".\n";
+
+    QTimer reportTimer;
+    QObject::connect(&reportTimer,SIGNAL(timeout()),&gateway,SLOT(report()));
+    reportTimer.start(1000);
+
+    return a.exec();
+}
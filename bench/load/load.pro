@@ -0,0 +1,25 @@
+#-------------------------------------------------
+#
+# End-to-end throughput and latency benchmark, APNSd against the mock gateway
+#
+#-------------------------------------------------
+
+QT       += core network
+
+QT       -= gui
+
+TARGET = loadbench
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src ../gateway
+
+SOURCES += main.cpp \
+    ../gateway/cmockgateway.cpp
+
+HEADERS += \
+    ../gateway/cmockgateway.h \
+    ../../src/latency.h \
+    ../../src/shared.h
@@ -0,0 +1,412 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QCoreApplication>
+#include <QThread>
+#include <QLocalSocket>
+#include <QtEndian>
+#include <iostream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "cmockgateway.h"
+#include "cingestserver.h"
+#include "config.h"
+#include "latency.h"
+#include "shared.h"
+
+/*
+ * Drives a running APNSd through its ingest socket into an in-process
+ * CMockGateway, and times every notification from the ingest write to its
+ * arrival at the gateway. /etc/APNSd.cfg has to point apns_server at
+ * 127.0.0.1 and apns_server_port at --port. CPU and memory are read from
+ * /proc for the daemon process.
+ */
+
+#define ACK_SIZE 14
+#define MAX_UNACKED 16
+#define IDLE_TIMEOUT 10
+
+static quint32 s_iCount = 100000;
+//ingest write time per sequence number, read by the gateway thread
+static quint64 *s_sent = 0;
+static quint8 *s_seen = 0;
+
+class CBenchGateway : public CMockGateway
+{
+public:
+    explicit CBenchGateway(const MockGatewayOptions &options) :
+        CMockGateway(options), m_iUnique(0), m_iDuplicates(0), m_iLast(0)
+    {
+        m_latency.reset();
+    }
+
+    quint64 unique() const { return __atomic_load_n(&m_iUnique,__ATOMIC_ACQUIRE); }
+    //only valid once the gateway thread finished
+    quint64 duplicates() const { return m_iDuplicates; }
+    quint64 last() const { return m_iLast; }
+    const LatencyHistogram &latency() const { return m_latency; }
+
+protected:
+    //payloads start with {"seq":<n>,
+    void notification(const uchar *, const char *json, int len, quint32)
+    {
+        if (len < 8 || memcmp(json,"{\"seq\":",7) != 0)
+            return;
+        quint32 seq = strtoul(json + 7,0,10);
+        if (seq >= s_iCount)
+            return;
+
+        quint64 now = monotonicNs();
+        if (s_seen[seq])
+        {
+            m_iDuplicates++;
+            return;
+        }
+        s_seen[seq] = 1;
+        m_latency.record(now - __atomic_load_n(&s_sent[seq],__ATOMIC_ACQUIRE));
+        m_iLast = now;
+        __atomic_store_n(&m_iUnique,m_iUnique + 1,__ATOMIC_RELEASE);
+    }
+
+private:
+    LatencyHistogram m_latency;
+    quint64 m_iUnique;
+    quint64 m_iDuplicates;
+    quint64 m_iLast;
+};
+
+void usage()
+{
+    std::cout << "loadbench --cert <pem file> --key <pem file> [options]\n";
+    std::cout << "  --count <n>                notifications to send (default 100000)\n";
+    std::cout << "  --rate <n>                 notifications per second, 0 = as fast as APNSd takes them (default)\n";
+    std::cout << "  --batch <n>                notifications per ingest batch (default 256)\n";
+    std::cout << "  --size <bytes>             json payload size (default 256)\n";
+    std::cout << "  --socket <path>            APNSd ingest socket (default " INGEST_DEFAULT_SOCKET ")\n";
+    std::cout << "  --pid <pid>                APNSd process, found in /proc by default\n";
+    MockGatewayOptions::usage();
+}
+
+static pid_t findDaemon()
+{
+    DIR *dir = opendir("/proc");
+    if (!dir)
+        return 0;
+
+    pid_t pid = 0;
+    struct dirent *entry;
+    while (pid == 0 && (entry = readdir(dir)) != 0)
+    {
+        pid_t candidate = atoi(entry->d_name);
+        if (candidate <= 0)
+            continue;
+        char path[64], comm[32] = "";
+        snprintf(path,sizeof(path),"/proc/%d/comm",candidate);
+        FILE *f = fopen(path,"r");
+        if (!f)
+            continue;
+        if (fgets(comm,sizeof(comm),f) && strcmp(comm,"APNSd\n") == 0)
+            pid = candidate;
+        fclose(f);
+    }
+    closedir(dir);
+    return pid;
+}
+
+//user + system time in clock ticks
+static quint64 cpuTicks(pid_t pid)
+{
+    char path[64], buf[1024];
+    snprintf(path,sizeof(path),"/proc/%d/stat",pid);
+    FILE *f = fopen(path,"r");
+    if (!f)
+        return 0;
+    size_t n = fread(buf,1,sizeof(buf) - 1,f);
+    fclose(f);
+    buf[n] = 0;
+
+    //fields after the command name, utime and stime are 14 and 15
+    char *p = strrchr(buf,')');
+    if (!p)
+        return 0;
+    unsigned long long utime = 0, stime = 0;
+    sscanf(p + 2,"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",&utime,&stime);
+    return utime + stime;
+}
+
+//kB from /proc/<pid>/status
+static quint64 memoryKb(pid_t pid, const char *field)
+{
+    char path[64], line[256];
+    snprintf(path,sizeof(path),"/proc/%d/status",pid);
+    FILE *f = fopen(path,"r");
+    if (!f)
+        return 0;
+    quint64 kb = 0;
+    size_t len = strlen(field);
+    while (fgets(line,sizeof(line),f))
+        if (strncmp(line,field,len) == 0)
+            kb = strtoull(line + len,0,10);
+    fclose(f);
+    return kb;
+}
+
+static void readAcks(QLocalSocket *socket, int *unacked, quint64 *accepted, quint64 *rejected)
+{
+    while (socket->bytesAvailable() >= ACK_SIZE)
+    {
+        uchar ack[ACK_SIZE];
+        socket->read(reinterpret_cast<char*>(ack),ACK_SIZE);
+        if (ack[4] != INGEST_ACK || ack[9] != INGEST_OK)
+        {
+            std::cout << "APNSd rejected a batch as malformed.\n";
+            exit(EXIT_FAILURE);
+        }
+        *accepted += qFromBigEndian<quint16>(ack + 10);
+        *rejected += qFromBigEndian<quint16>(ack + 12);
+        (*unacked)--;
+    }
+}
+
+static bool waitForAcks(QLocalSocket *socket, int timeout, int *unacked, quint64 *accepted, quint64 *rejected)
+{
+    if (!socket->waitForReadyRead(timeout) && socket->state() != QLocalSocket::ConnectedState)
+        return false;
+    readAcks(socket,unacked,accepted,rejected);
+    return true;
+}
+
+//frame(4) type(1) id(4) count(2), per payload token(32) priority(1) expiry(4) length(2) json
+static void buildBatch(QByteArray *frame, quint32 id, quint32 first, int count, int size)
+{
+    int framelen = 1 + 6 + count * (39 + size);
+    frame->resize(4 + framelen);
+    uchar *p = reinterpret_cast<uchar*>(frame->data());
+    qToBigEndian<quint32>(framelen,p);
+    p[4] = INGEST_BATCH;
+    qToBigEndian<quint32>(id,p + 5);
+    qToBigEndian<quint16>(count,p + 9);
+    p += 11;
+
+    for (int i=0;i<count;i++)
+    {
+        for (int b=0;b<32;b++)
+            p[b] = rand();
+        p[32] = 10;
+        qToBigEndian<quint32>(0,p + 33);
+        qToBigEndian<quint16>(size,p + 37);
+        p += 39;
+
+        //pad the alert so every payload is exactly size bytes
+        char *json = reinterpret_cast<char*>(p);
+        int head = snprintf(json,size + 1,"{\"seq\":%u,\"aps\":{\"alert\":\"",first + i);
+        memset(json + head,'x',size - head - 3);
+        memcpy(json + size - 3,"\"}}",3);
+        p += size;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    MockGatewayOptions options;
+    int rate = 0;
+    int batch = 256;
+    int size = 256;
+    QString socketPath = INGEST_DEFAULT_SOCKET;
+    pid_t pid = 0;
+
+    for (int i=1;i<argc;i+=2)
+    {
+        if (i + 1 >= argc)
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+        if (strcmp(argv[i],"--count") == 0)
+            s_iCount = strtoul(argv[i + 1],0,10);
+        else if (strcmp(argv[i],"--rate") == 0)
+            rate = atoi(argv[i + 1]);
+        else if (strcmp(argv[i],"--batch") == 0)
+            batch = atoi(argv[i + 1]);
+        else if (strcmp(argv[i],"--size") == 0)
+            size = atoi(argv[i + 1]);
+        else if (strcmp(argv[i],"--socket") == 0)
+            socketPath = argv[i + 1];
+        else if (strcmp(argv[i],"--pid") == 0)
+            pid = atoi(argv[i + 1]);
+        else if (!options.set(argv[i],argv[i + 1]))
+        {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.certFile.isEmpty() || options.keyFile.isEmpty() || s_iCount == 0 || batch < 1 || batch > 65535
+            || size < 64 || size > PAYLOAD_MAX_SIZE)
+    {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    if (pid == 0)
+        pid = findDaemon();
+    if (pid == 0)
+    {
+        std::cout << "APNSd service not running?\n";
+        return EXIT_FAILURE;
+    }
+
+    CBenchGateway *gateway = new CBenchGateway(options);
+    QString error;
+    if (!gateway->listen(&error))
+    {
+        std::cout << error.toStdString() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    QThread thread;
+    gateway->moveToThread(&thread);
+    thread.start();
+
+    QLocalSocket socket;
+    socket.connectToServer(socketPath);
+    if (!socket.waitForConnected(2000))
+    {
+        std::cout << "Could not connect to " << socketPath.toStdString() << ": " << socket.errorString().toStdString() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    s_sent = new quint64[s_iCount];
+    s_seen = new quint8[s_iCount];
+    memset(s_sent,0,s_iCount * sizeof(quint64));
+    memset(s_seen,0,s_iCount);
+
+    std::cout << "Waiting for APNSd to connect to 127.0.0.1:" << options.port << "...\n";
+    for (int i=0;i<IDLE_TIMEOUT * 10 && gateway->connections() == 0;i++)
+        usleep(100000);
+
+    long ticksPerSec = sysconf(_SC_CLK_TCK);
+    quint64 cpuStart = cpuTicks(pid);
+    quint64 start = monotonicNs();
+
+    QByteArray frame;
+    quint32 id = 0;
+    int unacked = 0;
+    quint64 accepted = 0, rejected = 0;
+    for (quint32 seq=0;seq<s_iCount;id++)
+    {
+        if (rate > 0)
+        {
+            quint64 due = start + (quint64)seq * 1000000000ULL / rate;
+            quint64 now;
+            while ((now = monotonicNs()) < due)
+            {
+                int ms = (due - now) / 1000000;
+                if (ms > 0)
+                    waitForAcks(&socket,ms,&unacked,&accepted,&rejected);
+            }
+        }
+
+        while (unacked >= MAX_UNACKED)
+        {
+            if (!waitForAcks(&socket,IDLE_TIMEOUT * 1000,&unacked,&accepted,&rejected))
+            {
+                std::cout << "APNSd stopped acknowledging batches.\n";
+                return EXIT_FAILURE;
+            }
+        }
+
+        int count = s_iCount - seq < (quint32)batch ? s_iCount - seq : batch;
+        buildBatch(&frame,id,seq,count,size);
+
+        quint64 now = monotonicNs();
+        for (int i=0;i<count;i++)
+            __atomic_store_n(&s_sent[seq + i],now,__ATOMIC_RELEASE);
+        socket.write(frame);
+        socket.flush();
+        readAcks(&socket,&unacked,&accepted,&rejected);
+
+        unacked++;
+        seq += count;
+    }
+
+    while (unacked > 0)
+    {
+        if (!waitForAcks(&socket,IDLE_TIMEOUT * 1000,&unacked,&accepted,&rejected))
+        {
+            std::cout << "APNSd stopped acknowledging batches.\n";
+            return EXIT_FAILURE;
+        }
+    }
+    quint64 sendEnd = monotonicNs();
+
+    //notifications answered with an error response never arrive
+    quint64 progress = 0;
+    quint64 lastProgress = monotonicNs();
+    while (gateway->unique() + gateway->errors() < accepted)
+    {
+        usleep(10000);
+        quint64 done = gateway->unique() + gateway->errors();
+        if (done != progress)
+        {
+            progress = done;
+            lastProgress = monotonicNs();
+        }
+        else if (monotonicNs() - lastProgress > IDLE_TIMEOUT * 1000000000ULL)
+            break;
+    }
+
+    quint64 cpuEnd = cpuTicks(pid);
+    quint64 rss = memoryKb(pid,"VmRSS:");
+    quint64 hwm = memoryKb(pid,"VmHWM:");
+
+    thread.quit();
+    thread.wait();
+
+    quint64 delivered = gateway->unique();
+    quint64 errors = gateway->errors();
+    quint64 lost = accepted > delivered + errors ? accepted - delivered - errors : 0;
+    quint64 end = gateway->last() > sendEnd ? gateway->last() : sendEnd;
+    double secs = (end - start) / 1e9;
+    const LatencyHistogram &latency = gateway->latency();
+    double cpuMs = (cpuEnd - cpuStart) * 1000.0 / ticksPerSec;
+
+    printf("sent        %u in %.2f s (%llu accepted, %llu rejected by APNSd)\n",
+           s_iCount,(sendEnd - start) / 1e9,(unsigned long long)accepted,(unsigned long long)rejected);
+    printf("delivered   %llu (%llu error responses, %llu lost, %llu duplicates, %llu gateway connections)\n",
+           (unsigned long long)delivered,(unsigned long long)errors,(unsigned long long)lost,
+           (unsigned long long)gateway->duplicates(),(unsigned long long)gateway->connections());
+    printf("throughput  %.0f notifications/sec\n",delivered / secs);
+    printf("latency     p50 %.3f ms p99 %.3f ms p999 %.3f ms max %.3f ms\n",
+           latency.percentile(0.5) / 1e6,latency.percentile(0.99) / 1e6,latency.percentile(0.999) / 1e6,latency.max / 1e6);
+    printf("daemon cpu  %.2f ms per 1k notifications (%.0f ms total)\n",delivered ? cpuMs * 1000.0 / delivered : 0.0,cpuMs);
+    printf("daemon mem  %llu kB resident, %llu kB peak\n",(unsigned long long)rss,(unsigned long long)hwm);
+
+    delete gateway;
+    delete [] s_sent;
+    delete [] s_seen;
+    return lost == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -21,38 +21,60 @@
 ****************************************************************************/
 #include "capnsd.h"
 #include "shared.h"
+#include "cgatewayconnection.h"
+#include "cpayloaddrain.h"
+#include "cingestserver.h"
+#include "cbroadcastjob.h"
+#include "config.h"
+#include "stats.h"
+#include "cstatsserver.h"
 #include <unistd.h>
-#include <iostream>
-#include <QSettings>
 #include <QSslSocket>
 #include <syslog.h>
 #include <QTimer>
 #include <QSharedMemory>
-#include <QDataStream>
 #include <QFile>
+#include <QDir>
 #include <QCoreApplication>
 #include <QSocketNotifier>
+#include <QThread>
 #include <sys/types.h>
 #include <sys/socket.h>
-#include <QDateTime>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <QtEndian>
 
 int CAPNSd::m_sighupFd[];
 int CAPNSd::m_sigtermFd[];
 
-CAPNSd::CAPNSd(QSharedMemory *mem,SharedPayload *shared,bool bDaemon,QObject *parent) :
-    QObject(parent), m_pSharedMem(mem), m_pShared(shared), m_bDaemon(bDaemon)
-{
-    m_iFailure = 0;
-    m_iIdent = 0;
-    m_pTimer = new QTimer();
-    m_pTimer->setInterval(500);
-#if QT_VERSION >= 0x050000
-    m_pTimer->setTimerType(Qt::CoarseTimer);
+#if CONNECTION_POOL_MAX > STATS_CONNECTIONS
+#error "the stats block needs a slot for every pool connection"
 #endif
-    connect(m_pTimer,SIGNAL(timeout()),this,SLOT(checkPayloads()));
 
-    m_pSocket = new QSslSocket();
+CAPNSd::CAPNSd(const ConfigSnapshot &config,QSharedMemory *mem,SharedPayload *shared,DaemonStats *stats,bool bDaemon,QObject *parent) :
+    QObject(parent), m_config(config), m_pSharedMem(mem), m_pShared(shared), m_pStats(stats), m_bDaemon(bDaemon)
+{
+    m_pStatsServer = 0;
+    m_pDrain = 0;
+    m_pDrainThread = 0;
+    m_pIngest = 0;
+    m_pIngestThread = 0;
+
+    m_pLogger = new CLogger(bDaemon);
+    m_pLoggerThread = new QThread();
+    m_pLogger->moveToThread(m_pLoggerThread);
+    m_pLoggerThread->start();
+    QMetaObject::invokeMethod(m_pLogger,"start",Qt::QueuedConnection);
+
+    qRegisterMetaType<ConfigSnapshot>("ConfigSnapshot");
+    qRegisterMetaType<QList<CGatewayConnection*> >("QList<CGatewayConnection*>");
+
     m_pFeedbackSocket = new QSslSocket();
+    m_pFeedbackTimer = 0;
+    m_iFeedbackCount = 0;
+    m_iFeedbackApp = 0;
 
     if (::socketpair(AF_UNIX, SOCK_STREAM, 0, m_sighupFd))
         qFatal("Couldn't create HUP socketpair");
@@ -67,286 +89,353 @@ CAPNSd::CAPNSd(QSharedMemory *mem,SharedPayload *shared,bool bDaemon,QObject *pa
 
 CAPNSd::~CAPNSd()
 {
-    m_pSocket->deleteLater();
-    m_pTimer->deleteLater();
+    shutdown();
+    delete m_pLogger;
 }
 
-void CAPNSd::setup()
+//stops the pipeline threads, must run before the shared segment is detached
+void CAPNSd::shutdown()
 {
-    QSettings settings("/etc/APNSd.cfg",QSettings::IniFormat);
+    if (m_pIngestThread)
+    {
+        m_pIngestThread->quit();
+        m_pIngestThread->wait();
+        delete m_pIngest;
+        delete m_pIngestThread;
+        m_pIngest = 0;
+        m_pIngestThread = 0;
+    }
 
-    if (!(settings.contains("local_cert_file") && settings.contains("private_key_passprase") && settings.contains("private_key_file")
-            && settings.contains("apns_server") && settings.contains("apns_server_port") && settings.contains("root_cert_file")))
+    if (m_pDrainThread)
     {
-        settings.setValue("local_cert_file",QVariant("/sslcerts/cert.pem"));
-        settings.setValue("root_cert_file",QVariant("/sslcerts/entrust_2048_ca.cer"));
-        settings.setValue("private_key_file",QVariant("/sslcerts/pk.pem"));
-        settings.setValue("private_key_passprase",QVariant(QByteArray("1234")));
-        settings.setValue("apns_server",QVariant("gateway.sandbox.push.apple.com"));
-        settings.setValue("apns_server_port",QVariant(2195));
-        settings.sync();
+        m_pDrainThread->quit();
+        m_pDrainThread->wait();
+        //journal what is left in the shared queue
+        m_pDrain->spill();
+    }
 
-        log(LOG_ALERT,"Missing settings. Settings file recreated.");
+    for (int i=0;i<m_threads.size();i++)
+    {
+        m_threads[i]->quit();
+        m_threads[i]->wait();
+    }
 
-        qApp->exit(EXIT_FAILURE);
-        return;
+    if (m_pDrainThread)
+    {
+        m_pDrain->closeSpool();
+        m_pDrain->closeBroadcast();
+        delete m_pDrain;
+        delete m_pDrainThread;
+        m_pDrain = 0;
+        m_pDrainThread = 0;
     }
 
-    if (!QFile(settings.value("root_cert_file").toString()).exists())
+    for (int i=0;i<m_threads.size();i++)
     {
-        QString err = "Could not find root ca certificate file. (";
-        err += settings.value("root_cert_file").toString() + ")";
-        log(LOG_ALERT,err);
+        delete m_connections[i];
+        delete m_threads[i];
+    }
+    m_threads.clear();
+    m_connections.clear();
 
-        qApp->exit(EXIT_FAILURE);
-        return;
+    //lines logged from here on are written right away
+    if (m_pLoggerThread)
+    {
+        m_pLoggerThread->quit();
+        m_pLoggerThread->wait();
+        delete m_pLoggerThread;
+        m_pLoggerThread = 0;
+        m_pLogger->stop();
     }
+}
 
+//main() loaded the configuration and laid out the shared segment from it
+void CAPNSd::setup()
+{
+    m_pLogger->setRateLimit(m_config->logRateLimit);
+    __atomic_store_n(&m_pStats->connections,m_config->connections(),__ATOMIC_RELAXED);
 
-    if (!QFile(settings.value("local_cert_file").toString()).exists())
+    m_pDrain = new CPayloadDrain(m_pShared,this);
+
+    if (!m_pDrain->openWakeupFifo())
     {
-        QString err = "Could not find local certificate file. (";
-        err += settings.value("local_cert_file").toString() + ")";
+        QString err = "Could not create wakeup fifo. (";
+        err += QString(APNSD_WAKEUP_FIFO) + ": " + QString::fromLocal8Bit(strerror(errno)) + ")";
         log(LOG_ALERT,err);
+        delete m_pDrain;
+        m_pDrain = 0;
         qApp->exit(EXIT_FAILURE);
         return;
     }
 
-    if (!QFile(settings.value("private_key_file").toString()).exists())
+    if (!m_config->spoolDir.isEmpty())
     {
-        QString err = "Could not find private key file. (";
-        err += settings.value("private_key_file").toString() + ")";
-        log(LOG_ALERT,err);
-        qApp->exit(EXIT_FAILURE);
-        return;
+        QString err;
+        if (!m_pDrain->openSpool(m_config->spoolDir,m_config->spoolSegmentSize,m_config->spoolSyncInterval,&err))
+        {
+            log(LOG_ALERT,err);
+            delete m_pDrain;
+            m_pDrain = 0;
+            qApp->exit(EXIT_FAILURE);
+            return;
+        }
+        if (m_pDrain->spooledCount())
+            log(LOG_INFO,"Resending " + QString::number(m_pDrain->spooledCount()) + " spooled push payloads.");
     }
 
-    QList<QSslCertificate> cert = QSslCertificate::fromPath(settings.value("local_cert_file").toString());
-    QList<QSslCertificate> cacert = QSslCertificate::fromPath(settings.value("root_cert_file").toString());
+    if (!m_config->blocklistFile.isEmpty())
+    {
+        QString err;
+        if (!m_pDrain->openBlocklist(m_config->blocklistFile,&err))
+        {
+            log(LOG_ALERT,err);
+            delete m_pDrain;
+            m_pDrain = 0;
+            qApp->exit(EXIT_FAILURE);
+            return;
+        }
+        log(LOG_INFO,QString::number(m_pDrain->blocklistSize()) + " devices on the blocklist.");
+    }
 
-    m_pSocket->addCaCertificates(cacert);
-    m_pSocket->setLocalCertificate(cert[0]);
-    m_pSocket->ignoreSslErrors(/*expectedSslErrors*/);
-    m_pSocket->setPrivateKey(settings.value("private_key_file").toString(),QSsl::Rsa,QSsl::Pem,settings.value("private_key_passprase").toByteArray());
+    m_pDrain->setReleaseRate(m_config->releaseRate);
+    m_pDrain->setCapture(m_config->captureFile);
 
-    m_pSocket->setPeerVerifyMode(QSslSocket::QueryPeer);
+    QString broadcastdir = m_config->broadcastDir;
+    if (!broadcastdir.isEmpty())
+    {
+        //APNSd broadcast may run as any user
+        if (QDir().mkpath(broadcastdir))
+            ::chmod(broadcastdir.toLocal8Bit().constData(),01777);
+        m_pDrain->setBroadcastDir(broadcastdir);
+    }
 
-    m_pFeedbackSocket->addCaCertificates(cacert);
-    m_pFeedbackSocket->setLocalCertificate(cert[0]);
-    m_pFeedbackSocket->ignoreSslErrors(/*expectedSslErrors*/);
-    m_pFeedbackSocket->setPrivateKey(settings.value("private_key_file").toString(),QSsl::Rsa,QSsl::Pem,settings.value("private_key_passprase").toByteArray());
+    for (int a=0;a<m_config->apps.size();a++)
+        for (int i=0;i<m_config->apps[a].poolSize;i++)
+            addConnection(a);
 
-    m_pFeedbackSocket->setPeerVerifyMode(QSslSocket::QueryPeer);
+    m_pDrain->setConnections(m_connections,*m_config);
+    m_pDrainThread = new QThread();
+    m_pDrain->moveToThread(m_pDrainThread);
+    m_pDrainThread->start();
 
-    connect(m_pSocket,SIGNAL(encrypted()),this,SLOT(encrypted()));
-    connect(m_pSocket,SIGNAL(disconnected()),this,SLOT(disconnected()));
-    connect(m_pSocket,SIGNAL(error(QAbstractSocket::SocketError)),this,SLOT(socketError(QAbstractSocket::SocketError)));
-    connect(m_pSocket,SIGNAL(sslErrors(QList<QSslError>)),this,SLOT(sslErrors(QList<QSslError>)));
-    connect(m_pSocket,SIGNAL(readyRead()),this,SLOT(readyRead()));
+    m_pIngest = new CIngestServer(m_pShared,this);
+    m_pIngest->setAddress(m_config->ingestSocket,m_config->ingestTcpPort);
+    m_pIngestThread = new QThread();
+    m_pIngest->moveToThread(m_pIngestThread);
+    m_pIngestThread->start();
 
     connect(m_pFeedbackSocket,SIGNAL(readyRead()),this,SLOT(readyReadFeedback()));
+    connect(m_pFeedbackSocket,SIGNAL(disconnected()),this,SLOT(feedbackDisconnected()));
+    connect(m_pFeedbackSocket,SIGNAL(error(QAbstractSocket::SocketError)),this,SLOT(feedbackError(QAbstractSocket::SocketError)));
 
-    connectSocket();
-}
-
-void CAPNSd::encrypted()
-{
-    log(LOG_INFO,"Connected to APN service.");
-
-    m_iFailure = 0;
-    m_pTimer->start();
-}
+    if (!m_config->statsSocket.isEmpty() || m_config->statsPort)
+    {
+        m_pStatsServer = new CStatsServer(m_pStats,m_pShared,this);
+        m_pStatsServer->listen(m_config->statsSocket,m_config->statsPort);
+    }
 
-void CAPNSd::disconnected()
-{
-    m_pTimer->stop();
-    m_iIdent = 0;
-    if (m_iFailure++ > 3)
+    m_pFeedbackTimer = new QTimer(this);
+    connect(m_pFeedbackTimer,SIGNAL(timeout()),this,SLOT(checkFeedback()));
+    if (m_config->feedbackInterval > 0)
     {
-        log(LOG_ALERT,"Could not connect to APN service. Retry in 30 seconds...");
-#if QT_VERSION >= 0x050000
-        QTimer::singleShot(30000,Qt::VeryCoarseTimer,this,SLOT(connectSocket()));
-#else
-        QTimer::singleShot(30000,this,SLOT(connectSocket()));
-#endif
-        return;
+        m_pFeedbackTimer->setInterval(m_config->feedbackInterval * 1000);
+        m_pFeedbackTimer->start();
+        QTimer::singleShot(0,this,SLOT(checkFeedback()));
     }
-    //reconnect
-    log(LOG_ALERT,"Connection reset.");
-    connectSocket();
+
+    QMetaObject::invokeMethod(m_pIngest,"start",Qt::QueuedConnection);
+    QMetaObject::invokeMethod(m_pDrain,"start",Qt::QueuedConnection);
+    for (int i=0;i<m_connections.size();i++)
+        QMetaObject::invokeMethod(m_connections[i],"connectSocket",Qt::QueuedConnection);
 }
 
-void CAPNSd::connectSocket()
+//the drain must exist, the connection thread is started here
+CGatewayConnection *CAPNSd::addConnection(int app)
 {
-    QSettings settings("/etc/APNSd.cfg",QSettings::IniFormat);
-    QString msg = "Connecting to "+settings.value("apns_server").toString()+":"+settings.value("apns_server_port").toString()+"...";
-    log(LOG_INFO,msg);
-    m_pSocket->connectToHostEncrypted(settings.value("apns_server").toString(),settings.value("apns_server_port").toInt());
+    int index = m_connections.size();
+    QByteArray name = m_config->apps[app].name.toUtf8();
+    qstrncpy(m_pStats->conn[index].app,name.constData(),STATS_APP_NAME_MAX);
+
+    CGatewayConnection *conn = new CGatewayConnection(index,app,m_pShared,this);
+    conn->applyConfig(m_config);
+    connect(conn,SIGNAL(ready()),m_pDrain,SLOT(checkPayloads()));
+    connect(conn,SIGNAL(spaceAvailable()),m_pDrain,SLOT(checkPayloads()));
+    connect(conn,SIGNAL(invalidToken(QByteArray)),m_pDrain,SLOT(blockTokens(QByteArray)));
+
+    QThread *thread = new QThread();
+    conn->moveToThread(thread);
+    thread->start();
+
+    m_connections.append(conn);
+    m_threads.append(thread);
+    return conn;
 }
 
-void CAPNSd::checkPayloads()
+/*
+ * Loads the configuration again and hands the new snapshot to the running
+ * threads. The shared queue, the spool and the connection queues stay,
+ * connections with other credentials or another gateway move to a new
+ * socket one by one. A broken file keeps the running configuration.
+ */
+void CAPNSd::reload()
 {
-    m_pSharedMem->lock();
+    if (!m_config)
+        return;
 
-    if (m_pShared->size == 0)
+    QString error;
+    Config *loaded = Config::load(APNSD_CONFIG_FILE,&error);
+    if (!loaded)
     {
-        m_pSharedMem->unlock();
+        log(LOG_ALERT,"Reload failed, keeping the running configuration. " + error);
         return;
     }
+    ConfigSnapshot config(loaded);
 
-    QString msg = "Sending " + QString::number(m_pShared->size) + " push payloads.";
-
-    log(LOG_INFO,msg);
-
-#ifdef PUSH_PROTOCOL_V2
-    QByteArray data;
-    QDataStream ds(&data,QIODevice::WriteOnly);
-    quint32 size = 0;
-    ds << (quint8)(2) << (quint32)(0);
-
-    for (quint8 i=0;i<m_pShared->size;i++)
+    QStringList restart = config->restartOnly(*m_config);
+    //the queue rings and the connections are laid out per app
+    if (!config->sameApps(*m_config))
     {
-        QByteArray device = QByteArray::fromHex(QByteArray(m_pShared->data[i].device,64));
-        QString json= QString::fromUtf8(m_pShared->data[i].json);
-
-        memset(m_pShared->data[i].json,0,PAYLOAD_JSONSTR_SIZE);
-
-        m_iIdent++;
-
-        ds << i << (quint16)(32 + json.size() + 9);
-        ds.writeRawData(device.data(),32);
-        ds.writeRawData(json.toUtf8().data(),json.size());
-        ds << m_iIdent << (quint32)(0) << (quint8)(10);
-        size += 3 + 32 + json.size() + 9;
+        log(LOG_ALERT,"Reload failed, keeping the running configuration. Changes to " + restart.join(", ") + " take effect after a restart.");
+        return;
     }
 
-    m_pShared->size = 0;
+    if (!restart.isEmpty())
+        log(LOG_ALERT,"Changes to " + restart.join(", ") + " take effect after a restart.");
 
-    m_pSharedMem->unlock();
+    m_config = config;
+    m_pLogger->setRateLimit(config->logRateLimit);
+    __atomic_store_n(&m_pStats->connections,config->connections(),__ATOMIC_RELAXED);
 
-    ds.device()->seek(1);
-    ds << size;
+    //pools only grow, the drain retires connections above the pool size
+    int running = m_connections.size();
+    for (int a=0;a<config->apps.size();a++)
+    {
+        int have = 0;
+        for (int i=0;i<running;i++)
+            if (m_connections[i]->app() == a)
+                have++;
+        for (;have<config->apps[a].poolSize && m_connections.size() < CONNECTION_POOL_MAX;have++)
+            addConnection(a);
+        if (have < config->apps[a].poolSize)
+            log(LOG_ALERT,"No more than " + QString::number(CONNECTION_POOL_MAX) + " connections, pool of " + config->apps[a].name + " not grown.");
+    }
+    for (int i=0;i<running;i++)
+        QMetaObject::invokeMethod(m_connections[i],"applyConfig",Qt::QueuedConnection,Q_ARG(ConfigSnapshot,config));
+    QMetaObject::invokeMethod(m_pDrain,"applyConfig",Qt::QueuedConnection,Q_ARG(ConfigSnapshot,config),Q_ARG(QList<CGatewayConnection*>,m_connections));
+    for (int i=running;i<m_connections.size();i++)
+        QMetaObject::invokeMethod(m_connections[i],"connectSocket",Qt::QueuedConnection);
 
-    QFile test("test");
-    test.open(QIODevice::WriteOnly);
-    test.write(data);
-    test.close();
-    m_pSocket->write(data);
-#else //push protocol v0
-    for (quint8 i=0;i<m_pShared->size;i++)
+    if (config->feedbackInterval > 0)
     {
-        QByteArray data;
-        QDataStream ds(&data,QIODevice::WriteOnly);
+        m_pFeedbackTimer->setInterval(config->feedbackInterval * 1000);
+        if (!m_pFeedbackTimer->isActive())
+            m_pFeedbackTimer->start();
+    }
+    else
+        m_pFeedbackTimer->stop();
 
-        ds << (quint8)(0) << (quint16)(32);
+    log(LOG_INFO,"Configuration reloaded.");
+}
 
-        QByteArray device = QByteArray::fromHex(QByteArray(m_pShared->data[i].device,64));
-        QString json= QString::fromUtf8(m_pShared->data[i].json);
+/*
+ * The feedback service sends time(4) token length(2) token tuples and
+ * closes the connection. Tuples may be split over reads.
+ */
+void CAPNSd::readyReadFeedback()
+{
+    if (m_pFeedbackSocket->bytesAvailable() == 0)
+        return;
+
+    m_feedbackBuffer.append(m_pFeedbackSocket->readAll());
 
-        memset(m_pShared->data[i].json,0,PAYLOAD_JSONSTR_SIZE);
+    const uchar *d = reinterpret_cast<const uchar*>(m_feedbackBuffer.constData());
+    int size = m_feedbackBuffer.size();
+    int pos = 0;
+    QByteArray records;
 
-        ds.writeRawData(device.data(),32);
-        ds << (quint16)(json.size());
-        ds.writeRawData(json.toUtf8().data(),json.size());
-        //qDebug() << data;
-        m_pSocket->write(data);
+    while (size - pos >= 6)
+    {
+        quint32 time = qFromBigEndian<quint32>(d + pos);
+        quint16 tokenlen = qFromBigEndian<quint16>(d + pos + 4);
+        if (size - pos - 6 < tokenlen)
+            break;
+
+        if (tokenlen == PAYLOAD_TOKEN_SIZE)
+        {
+            uchar t[4];
+            qToBigEndian<quint32>(time,t);
+            records.append(reinterpret_cast<const char*>(d + pos + 6),PAYLOAD_TOKEN_SIZE);
+            records.append(reinterpret_cast<const char*>(t),4);
+            m_iFeedbackCount++;
+        }
+        pos += 6 + tokenlen;
     }
 
-    m_pShared->size = 0;
+    m_feedbackBuffer.remove(0,pos);
 
-    m_pSharedMem->unlock();
-#endif
+    if (!records.isEmpty() && m_pDrain)
+        QMetaObject::invokeMethod(m_pDrain,"blockTokens",Qt::QueuedConnection,Q_ARG(QByteArray,records));
 }
 
-void CAPNSd::socketError(QAbstractSocket::SocketError err)
+void CAPNSd::feedbackDisconnected()
 {
-    QString msg = "Socket error: "+QString::number(err);
-    log(LOG_ALERT,msg);
+    const QString &app = m_config->apps[m_iFeedbackApp].name;
+    log(LOG_INFO,"Feedback service reported " + QString::number(m_iFeedbackCount) + " invalid devices for " + app + ".");
+    m_feedbackBuffer.clear();
+    m_iFeedbackCount = 0;
+
+    //the service only reports the tokens of the certificate's app
+    if (++m_iFeedbackApp < m_config->apps.size())
+        QTimer::singleShot(0,this,SLOT(connectFeedback()));
 }
 
-void CAPNSd::sslErrors(const QList<QSslError> &errors)
+/*
+ * The service closing the connection is the normal end of a poll, any
+ * other error ends the poll of this app too so the next one gets its turn.
+ */
+void CAPNSd::feedbackError(QAbstractSocket::SocketError err)
 {
-    for (int i=0;i<errors.size();i++)
-        log(LOG_ALERT,errors[i].errorString());
-}
-
-void CAPNSd::readyRead()
-{
-    if (m_pSocket->bytesAvailable() == 0)
+    if (err == QAbstractSocket::RemoteHostClosedError)
         return;
-    QString str = "APNS reply: ";
-    //syslog(LOG_ALERT,str.toStdString().c_str());
-    QByteArray d = m_pSocket->readAll();
-    QDataStream ds(&d,QIODevice::ReadWrite);
-    quint8 cmd,status;
-    quint32 id;
-    ds >> cmd >> status >> id;
-
-    if (cmd == 8)
-    {
-        if (status == 0)
-            str += "No errors";
-        else if (status == 1)
-            str += "Processing error";
-        else if (status == 2)
-            str += "Missing device token";
-        else if (status == 3)
-            str += "Missing topic";
-        else if (status == 4)
-            str += "Missing payload";
-        else if (status == 5)
-            str += "Invalid token size";
-        else if (status == 6)
-            str += "Invalid topic size";
-        else if (status == 7)
-            str += "Invalid payload size";
-        else if (status == 8)
-            str += "Invalid token";
-        else if (status == 10)
-            str += "Shutdown";
-        else
-            str += "Unknown error ("+QString::number(status)+")";
-
-        str += " For id " + QString::number(id);
-    }
+
+    const QString &app = m_config->apps[m_iFeedbackApp].name;
+    log(LOG_ALERT,"Feedback service error for " + app + ": " + m_pFeedbackSocket->errorString());
+
+    //connecting failed, there is no disconnected() for it
+    if (m_pFeedbackSocket->state() == QAbstractSocket::UnconnectedState)
+        feedbackDisconnected();
     else
-        str += "Unknown command";
-    log(LOG_ALERT,str);
-    //checkFeedback();
+        m_pFeedbackSocket->abort();
 }
 
-void CAPNSd::readyReadFeedback()
+void CAPNSd::checkFeedback()
 {
-    if (m_pFeedbackSocket->bytesAvailable() == 0)
+    //previous poll still running
+    if (m_pFeedbackSocket->state() != QAbstractSocket::UnconnectedState)
         return;
-    QString str = "APNS reply: ";
-    //syslog(LOG_ALERT,str.toStdString().c_str());
-    QByteArray d = m_pFeedbackSocket->readAll();
-    QDataStream ds(&d,QIODevice::ReadWrite);
-    quint32 time;
-    quint16 tokenlen;
-
-    while (!ds.atEnd())
-    {
-        ds >> time >> tokenlen;
-        char* tokenbuffer = new char[tokenlen];
-        ds.readRawData(tokenbuffer,tokenlen);
-        QByteArray token(tokenbuffer,tokenlen);
-        delete []tokenbuffer;
-        token = token.toHex();
-        //qDebug() << "invalid token: " << token;
-    }
 
+    m_iFeedbackApp = 0;
+    connectFeedback();
 }
 
-void CAPNSd::checkFeedback()
+void CAPNSd::connectFeedback()
 {
-    QSettings settings("/etc/APNSd.cfg",QSettings::IniFormat);
-    QString serv = settings.value("apns_server").toString();
+    m_feedbackBuffer.clear();
+    m_iFeedbackCount = 0;
+
+    //credentials of the current snapshot
+    const AppProfile &app = m_config->apps[m_iFeedbackApp];
+    m_pFeedbackSocket->setCaCertificates(m_config->caCerts);
+    m_pFeedbackSocket->setLocalCertificate(app.cert);
+    m_pFeedbackSocket->ignoreSslErrors(/*expectedSslErrors*/);
+    m_pFeedbackSocket->setPrivateKey(app.key);
+    m_pFeedbackSocket->setPeerVerifyMode(QSslSocket::QueryPeer);
+
+    QString serv = m_config->server;
     serv.replace("gateway","feedback");
-    QString msg = "Connecting to "+serv+":"+QString::number(settings.value("apns_server_port").toInt()+1)+"...";
+    QString msg = "Connecting to "+serv+":"+QString::number(m_config->port+1)+" for "+app.name+"...";
     log(LOG_INFO,msg);
-    m_pFeedbackSocket->connectToHostEncrypted(serv,settings.value("apns_server_port").toInt()+1);
+    m_pFeedbackSocket->connectToHostEncrypted(serv,m_config->port+1);
 }
 
 void CAPNSd::hupSignalHandler(int)
@@ -378,21 +467,12 @@ void CAPNSd::handleSigHup()
     char tmp;
     ::read(m_sighupFd[1], &tmp, sizeof(tmp));
 
-    qApp->quit();
+    reload();
 
     m_psnHup->setEnabled(true);
 }
 
-void CAPNSd::log(int type, QString msg) const
+void CAPNSd::log(int type, const QString &msg, int event, int conn) const
 {
-    if (m_bDaemon)
-        syslog(type,msg.toStdString().c_str());
-    else
-    {
-        QDateTime d;
-        if (type == LOG_ALERT)
-            std::cout << d.currentDateTime().toString("dd-MM-yyyy HH:mm:ss").toStdString()  <<  " - error: " << msg.toStdString() << "\n";
-        else
-            std::cout << d.currentDateTime().toString("dd-MM-yyyy HH:mm:ss").toStdString()  <<  " - info: " << msg.toStdString() << "\n";
-    }
+    m_pLogger->write(type,event,conn,msg);
 }
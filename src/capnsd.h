@@ -25,25 +25,43 @@
 #include <QObject>
 #include <QString>
 #include <QSslSocket>
+#include <QList>
+#include "config.h"
+#include "clogger.h"
 
 struct SharedPayload;
-class QTimer;
+struct DaemonStats;
+class CStatsServer;
+class CGatewayConnection;
+class CPayloadDrain;
+class CIngestServer;
 class QSharedMemory;
 class QSocketNotifier;
+class QThread;
+class QTimer;
 
+/*
+ * Owns the pipeline threads: an ingest thread feeding the shared queue
+ * from local sockets, one drain thread pulling from the shared queue and
+ * one thread per gateway connection doing encoding and TLS I/O.
+ * The main event loop only handles signals and the feedback service.
+ * SIGHUP reloads the configuration into the running pipeline.
+ * log() only queues the line, the logger thread writes it.
+ */
 class CAPNSd : public QObject
 {
     Q_OBJECT
 public:
-    explicit CAPNSd(QSharedMemory *mem, SharedPayload *shared,bool bDaemon,QObject *parent = 0);
+    explicit CAPNSd(const ConfigSnapshot &config, QSharedMemory *mem, SharedPayload *shared, DaemonStats *stats, bool bDaemon, QObject *parent = 0);
     ~CAPNSd();
 
     static void hupSignalHandler(int unused);
     static void termSignalHandler(int unused);
 
-private:
-
-    void log(int type, QString msg) const;
+    //any thread, never blocks
+    void log(int type, const QString &msg, int event = LOG_EVENT_GENERAL, int conn = -1) const;
+    DaemonStats *stats() const { return m_pStats; }
+    void shutdown();
 
 signals:
 
@@ -55,24 +73,35 @@ public slots:
 
 private slots:
 
-    void checkPayloads();
-    void encrypted();
-    void disconnected();
-    void connectSocket();
-    void socketError(QAbstractSocket::SocketError);
-    void sslErrors(const QList<QSslError> & errors);
-    void readyRead();
+    void reload();
     void checkFeedback();
+    void connectFeedback();
     void readyReadFeedback();
+    void feedbackDisconnected();
+    void feedbackError(QAbstractSocket::SocketError err);
 
 private:
+    CGatewayConnection *addConnection(int app);
+
+    ConfigSnapshot m_config;
+    CLogger *m_pLogger;
+    QThread *m_pLoggerThread;
     QSharedMemory *m_pSharedMem;
     SharedPayload *m_pShared;
-    QSslSocket *m_pSocket;
+    DaemonStats *m_pStats;
+    CStatsServer *m_pStatsServer;
     QSslSocket *m_pFeedbackSocket;
-    QTimer *m_pTimer;
-    int m_iFailure;
-    quint32 m_iIdent;
+    QTimer *m_pFeedbackTimer;
+    QByteArray m_feedbackBuffer;
+    int m_iFeedbackCount;
+    //app whose feedback is polled, the apps are polled one after another
+    int m_iFeedbackApp;
+    QList<CGatewayConnection*> m_connections;
+    QList<QThread*> m_threads;
+    CPayloadDrain *m_pDrain;
+    QThread *m_pDrainThread;
+    CIngestServer *m_pIngest;
+    QThread *m_pIngestThread;
     bool m_bDaemon;
 
     static int m_sighupFd[2];
@@ -0,0 +1,132 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "cbroadcastjob.h"
+#include <QSettings>
+#include <QFileInfo>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+CBroadcastJob::CBroadcastJob()
+{
+    m_iProgressFd = -1;
+    m_pTokens = 0;
+    m_iMapSize = 0;
+    m_iCount = 0;
+    m_iProgress = 0;
+    memset(&m_header,0,sizeof(m_header));
+}
+
+CBroadcastJob::~CBroadcastJob()
+{
+    if (m_pTokens)
+        ::munmap(m_pTokens,m_iMapSize);
+    if (m_iProgressFd >= 0)
+        ::close(m_iProgressFd);
+}
+
+bool CBroadcastJob::load(const QString &jobFile, QString *error)
+{
+    QFileInfo info(jobFile);
+    m_sName = info.completeBaseName();
+    m_sJobFile = jobFile;
+    m_sProgressFile = info.absolutePath() + "/" + m_sName + ".progress";
+
+    QSettings job(jobFile,QSettings::IniFormat);
+    QString tokens = job.value("tokens").toString();
+    m_payload = QByteArray::fromBase64(job.value("payload").toByteArray());
+    m_header.priority = job.value("priority",PAYLOAD_PRIORITY_IMMEDIATE).toUInt();
+    m_header.expiry = job.value("expiry",0).toUInt();
+    m_sApp = job.value("app").toString();
+    m_header.length = m_payload.size();
+    m_header.block = PAYLOAD_NO_BLOCK;
+
+    if (m_payload.isEmpty() || m_payload.size() > PAYLOAD_MAX_SIZE)
+    {
+        *error = "Broadcast " + m_sName + " has an empty or too large payload.";
+        return false;
+    }
+
+    QByteArray path = tokens.toLocal8Bit();
+    int fd = ::open(path.constData(),O_RDONLY);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd,&st) < 0)
+    {
+        *error = "Broadcast " + m_sName + ": could not open " + tokens + ": " + QString::fromLocal8Bit(strerror(errno));
+        if (fd >= 0)
+            ::close(fd);
+        return false;
+    }
+
+    if (st.st_size == 0 || st.st_size % PAYLOAD_TOKEN_SIZE)
+    {
+        *error = "Broadcast " + m_sName + ": " + tokens + " is not a list of 32 byte tokens.";
+        ::close(fd);
+        return false;
+    }
+
+    void *map = ::mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+    {
+        *error = "Broadcast " + m_sName + ": could not map " + tokens + ": " + QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+    ::madvise(map,st.st_size,MADV_SEQUENTIAL);
+
+    m_pTokens = static_cast<uchar*>(map);
+    m_iMapSize = st.st_size;
+    m_iCount = st.st_size / PAYLOAD_TOKEN_SIZE;
+
+    QByteArray progress = m_sProgressFile.toLocal8Bit();
+    m_iProgressFd = ::open(progress.constData(),O_RDWR | O_CREAT,0600);
+    if (m_iProgressFd < 0)
+    {
+        *error = "Could not open " + m_sProgressFile + ": " + QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+    if (::pread(m_iProgressFd,&m_iProgress,sizeof(m_iProgress),0) != sizeof(m_iProgress) || m_iProgress > m_iCount)
+        m_iProgress = 0;
+
+    return true;
+}
+
+void CBroadcastJob::setProgress(quint64 done)
+{
+    if (done <= m_iProgress)
+        return;
+    if (::pwrite(m_iProgressFd,&done,sizeof(done),0) == sizeof(done))
+    {
+        ::fdatasync(m_iProgressFd);
+        m_iProgress = done;
+    }
+}
+
+void CBroadcastJob::remove()
+{
+    ::unlink(m_sJobFile.toLocal8Bit().constData());
+    ::unlink(m_sProgressFile.toLocal8Bit().constData());
+}
@@ -0,0 +1,74 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CBROADCASTJOB_H
+#define CBROADCASTJOB_H
+
+#include <QString>
+#include <QByteArray>
+#include "shared.h"
+
+/*
+ * One payload for every token in a binary token file (32 bytes per token).
+ * APNSd broadcast writes <name>.job (QSettings: tokens, payload, priority,
+ * expiry, app) into the broadcast directory, the daemon maps the token file and
+ * keeps the number of tokens written to a gateway connection in
+ * <name>.progress, so a broadcast resumes after a restart.
+ */
+class CBroadcastJob
+{
+public:
+    CBroadcastJob();
+    ~CBroadcastJob();
+
+    bool load(const QString &jobFile, QString *error);
+
+    const QString &name() const { return m_sName; }
+    quint64 count() const { return m_iCount; }
+    const uchar *token(quint64 i) const { return m_pTokens + i * PAYLOAD_TOKEN_SIZE; }
+    //priority, expiry and length for every recipient
+    const PayloadData &header() const { return m_header; }
+    //app profile name, empty for the default app
+    const QString &app() const { return m_sApp; }
+    void setApp(int app) { m_header.app = app; }
+    const char *payload() const { return m_payload.constData(); }
+
+    quint64 progress() const { return m_iProgress; }
+    void setProgress(quint64 done);
+    void remove();
+
+private:
+    QString m_sName;
+    QString m_sApp;
+    QString m_sJobFile;
+    QString m_sProgressFile;
+    int m_iProgressFd;
+
+    uchar *m_pTokens;
+    size_t m_iMapSize;
+    quint64 m_iCount;
+
+    QByteArray m_payload;
+    PayloadData m_header;
+    quint64 m_iProgress;
+};
+
+#endif // CBROADCASTJOB_H
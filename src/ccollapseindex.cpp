@@ -0,0 +1,117 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "ccollapseindex.h"
+
+CCollapseIndex::CCollapseIndex()
+{
+    m_iMask = 0;
+    m_iUsed = 0;
+}
+
+void CCollapseIndex::resize(int capacity)
+{
+    quint32 c = 16;
+    while (c < (quint32)capacity * 2)
+        c <<= 1;
+
+    Entry empty;
+    empty.key = 0;
+    empty.pos = 0;
+    empty.lane = 0;
+    m_entries.fill(empty,c);
+    m_iMask = c - 1;
+    m_iUsed = 0;
+}
+
+bool CCollapseIndex::find(quint64 key, int *lane, quint32 *pos) const
+{
+    if (m_entries.isEmpty())
+        return false;
+
+    for (quint32 i=key & m_iMask;;i = (i + 1) & m_iMask)
+    {
+        const Entry &e = m_entries[i];
+        if (e.key == 0)
+            return false;
+        if (e.key == key)
+        {
+            *lane = e.lane;
+            *pos = e.pos;
+            return true;
+        }
+    }
+}
+
+void CCollapseIndex::insert(quint64 key, int lane, quint32 pos, const QVector<quint32> &consumed)
+{
+    if (m_entries.isEmpty())
+        return;
+
+    if (m_iUsed + 1 > (int)(m_iMask + 1) / 2)
+        rebuild(consumed);
+
+    int reuse = -1;
+    quint32 i;
+    for (i=key & m_iMask;m_entries[i].key != 0;i = (i + 1) & m_iMask)
+    {
+        if (m_entries[i].key == key)
+            break;
+        if (reuse < 0 && stale(m_entries[i],consumed))
+            reuse = i;
+    }
+
+    if (m_entries[i].key == 0)
+    {
+        if (reuse >= 0)
+            i = reuse;
+        else
+            m_iUsed++;
+    }
+
+    Entry &e = m_entries[i];
+    e.key = key;
+    e.lane = lane;
+    e.pos = pos;
+}
+
+void CCollapseIndex::rebuild(const QVector<quint32> &consumed)
+{
+    QVector<Entry> old = m_entries;
+    Entry empty;
+    empty.key = 0;
+    empty.pos = 0;
+    empty.lane = 0;
+    m_entries.fill(empty);
+    m_iUsed = 0;
+
+    for (int n=0;n<old.size();n++)
+    {
+        const Entry &e = old[n];
+        if (e.key == 0 || stale(e,consumed))
+            continue;
+        quint32 i = e.key & m_iMask;
+        while (m_entries[i].key != 0)
+            i = (i + 1) & m_iMask;
+        m_entries[i] = e;
+        m_iUsed++;
+    }
+}
@@ -0,0 +1,65 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CCOLLAPSEINDEX_H
+#define CCOLLAPSEINDEX_H
+
+#include <QVector>
+
+/*
+ * Maps the hash of (device, collapse key) to the connection lane and queue
+ * position of the last payload queued for it. Entries go stale once their
+ * lane consumed past them, stale ones are reused on insert and dropped
+ * when the table is rebuilt at half load. Open addressing with linear
+ * probing, keys are never 0.
+ */
+class CCollapseIndex
+{
+public:
+    CCollapseIndex();
+
+    void resize(int capacity);
+    bool isEmpty() const { return m_entries.isEmpty(); }
+
+    bool find(quint64 key, int *lane, quint32 *pos) const;
+    //consumed holds the consumer position of every lane
+    void insert(quint64 key, int lane, quint32 pos, const QVector<quint32> &consumed);
+
+private:
+    struct Entry
+    {
+        quint64 key;
+        quint32 pos;
+        qint32 lane;
+    };
+
+    static bool stale(const Entry &e, const QVector<quint32> &consumed)
+    {
+        return (qint32)(e.pos - consumed[e.lane]) < 0;
+    }
+    void rebuild(const QVector<quint32> &consumed);
+
+    QVector<Entry> m_entries;
+    quint32 m_iMask;
+    int m_iUsed;
+};
+
+#endif // CCOLLAPSEINDEX_H
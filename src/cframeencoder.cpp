@@ -0,0 +1,124 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "cframeencoder.h"
+#include "shared.h"
+#include <QtEndian>
+#include <string.h>
+
+#define FRAME_V0_HEADER (1 + 2 + 32 + 2)
+#define FRAME_V2_HEADER (1 + 4)
+#define FRAME_V2_ITEMS (3 + 32 + 3 + 3 + 4 + 3 + 4 + 3 + 1)
+
+CFrameEncoder::CFrameEncoder(int reserve) : m_iProtocol(0), m_iSize(0), m_iFrames(0)
+{
+    m_buffer.resize(reserve);
+}
+
+void CFrameEncoder::clear()
+{
+    m_iSize = 0;
+    m_iFrames = 0;
+}
+
+uchar *CFrameEncoder::reserve(int len)
+{
+    if (m_iSize + len > m_buffer.size())
+    {
+        int cap = m_buffer.size() * 2;
+        while (cap < m_iSize + len)
+            cap *= 2;
+        m_buffer.resize(cap);
+    }
+
+    uchar *p = reinterpret_cast<uchar*>(m_buffer.data()) + m_iSize;
+    m_iSize += len;
+    return p;
+}
+
+void CFrameEncoder::encode(const PayloadData *payload, const char *json, quint32 ident)
+{
+    if (m_iProtocol == 2)
+        encodeV2(payload,json,ident);
+    else
+        encodeV0(payload,json);
+}
+
+/*
+ * Push protocol v0 (command 0):
+ * command(1) token length(2) token(32) payload length(2) payload
+ */
+void CFrameEncoder::encodeV0(const PayloadData *payload, const char *json)
+{
+    int jsonlen = payload->length;
+    uchar *p = reserve(FRAME_V0_HEADER + jsonlen);
+
+    p[0] = 0;
+    qToBigEndian<quint16>(32,p + 1);
+    memcpy(p + 3,payload->device,32);
+    qToBigEndian<quint16>(jsonlen,p + 35);
+    memcpy(p + FRAME_V0_HEADER,json,jsonlen);
+
+    m_iFrames++;
+}
+
+/*
+ * Push protocol v2 (command 2):
+ * command(1) frame length(4) followed by the items, each item being
+ * item id(1) item length(2) item data. One notification per frame.
+ *  1 device token, 2 payload, 3 identifier, 4 expiration date, 5 priority
+ */
+void CFrameEncoder::encodeV2(const PayloadData *payload, const char *json, quint32 ident)
+{
+    int jsonlen = payload->length;
+    int framelen = FRAME_V2_ITEMS + jsonlen;
+    uchar *p = reserve(FRAME_V2_HEADER + framelen);
+
+    p[0] = 2;
+    qToBigEndian<quint32>(framelen,p + 1);
+    p += FRAME_V2_HEADER;
+
+    p[0] = 1;
+    qToBigEndian<quint16>(32,p + 1);
+    memcpy(p + 3,payload->device,32);
+    p += 3 + 32;
+
+    p[0] = 2;
+    qToBigEndian<quint16>(jsonlen,p + 1);
+    memcpy(p + 3,json,jsonlen);
+    p += 3 + jsonlen;
+
+    p[0] = 3;
+    qToBigEndian<quint16>(4,p + 1);
+    qToBigEndian<quint32>(ident,p + 3);
+    p += 3 + 4;
+
+    p[0] = 4;
+    qToBigEndian<quint16>(4,p + 1);
+    qToBigEndian<quint32>(payload->expiry,p + 3);
+    p += 3 + 4;
+
+    p[0] = 5;
+    qToBigEndian<quint16>(1,p + 1);
+    p[3] = payload->priority;
+
+    m_iFrames++;
+}
@@ -0,0 +1,62 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CFRAMEENCODER_H
+#define CFRAMEENCODER_H
+
+#include <QByteArray>
+
+struct PayloadData;
+
+/*
+ * Serializes drained payloads into one reusable output buffer, so a whole
+ * batch costs a single socket write and no per frame allocations.
+ *
+ * Protocol 0 is the simple notification format (command 0), protocol 2 the
+ * frame format (command 2) carrying identifier, expiry and priority.
+ */
+class CFrameEncoder
+{
+public:
+    explicit CFrameEncoder(int reserve = 65536);
+
+    void setProtocol(int protocol) { m_iProtocol = protocol; }
+    int protocol() const { return m_iProtocol; }
+
+    void clear();
+    void encode(const PayloadData *payload, const char *json, quint32 ident = 0);
+
+    const char *data() const { return m_buffer.constData(); }
+    int size() const { return m_iSize; }
+    int frames() const { return m_iFrames; }
+
+private:
+    uchar *reserve(int len);
+    void encodeV0(const PayloadData *payload, const char *json);
+    void encodeV2(const PayloadData *payload, const char *json, quint32 ident);
+
+    QByteArray m_buffer;
+    int m_iProtocol;
+    int m_iSize;
+    int m_iFrames;
+};
+
+#endif // CFRAMEENCODER_H
@@ -0,0 +1,865 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "cgatewayconnection.h"
+#include "capnsd.h"
+#include <syslog.h>
+#include <QTimer>
+#include <QtEndian>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+CGatewayConnection::CGatewayConnection(int index, int app, SharedPayload *shared, CAPNSd *daemon) :
+    QObject(0), m_pShared(shared), m_pDaemon(daemon), m_iIndex(index), m_iApp(app)
+{
+    for (int i=0;i<PAYLOAD_CLASSES;i++)
+    {
+        m_inbound[i].resize(CONNECTION_QUEUE_DEFAULT_SIZE);
+        m_iWrittenSeq[i] = 0;
+        m_aEncodedSeq[i] = 0;
+        m_iProcessed[i] = 0;
+    }
+    m_bSeqPending = false;
+    m_iWriteTotal = 0;
+    m_iSentTotal = 0;
+    m_iReady = 0;
+    m_iScheduled = 0;
+    m_iDrainWaiting = 0;
+    m_iQueuedBytes = 0;
+    m_iSocketBacklog = 0;
+    m_iHighWater = 1024 * 1024;
+    m_iLowWater = 256 * 1024;
+    m_bWritePaused = false;
+    m_iFailure = 0;
+    m_iIdent = 0;
+    m_iMaxWriteSize = 65536;
+    m_iBatch = 0;
+    m_bReplay = false;
+    m_iFramesSent = 0;
+    m_iExpired = 0;
+    m_iBytesWritten = 0;
+    m_iReportFrames = 0;
+    m_iReportBytes = 0;
+    m_latency.reset();
+    m_pStats = &daemon->stats()->conn[index];
+    m_iConnectStart = 0;
+    m_iStandbyStart = 0;
+    m_iReportNs = 60 * 1000000000ULL;
+    m_iLastReport = monotonicNs();
+
+    m_bReconnectPending = false;
+    m_bRetired = false;
+    m_iBackoffMin = 100;
+    m_iBackoffMax = 30000;
+    m_iSeed = (unsigned int)(::time(0) ^ (index << 16));
+    m_bStandby = false;
+    m_pStandby = 0;
+    m_iStandbyFailure = 0;
+    m_bMigrating = false;
+
+    m_pSocket = new QSslSocket(this);
+    attach(m_pSocket);
+}
+
+CGatewayConnection::~CGatewayConnection()
+{
+}
+
+/*
+ * Frame format, inflight window and queue sizes are taken from the first
+ * snapshot only, they can't change under a running connection.
+ */
+void CGatewayConnection::applyConfig(const ConfigSnapshot &config)
+{
+    bool migrate = m_config && !config->sameGateway(*m_config,m_iApp);
+
+    if (!m_config)
+    {
+        m_encoder.setProtocol(config->protocol);
+        m_inflight.resize(config->windowFrames,config->windowBytes);
+        for (int i=0;i<PAYLOAD_CLASSES;i++)
+            m_inbound[i].resize(config->queueSize);
+    }
+
+    m_config = config;
+    m_iMaxWriteSize = config->maxWriteSize;
+    m_iHighWater = config->highWater;
+    m_iLowWater = config->lowWater;
+    m_iBackoffMin = config->backoffMin;
+    m_iBackoffMax = config->backoffMax;
+    m_bStandby = config->standby;
+    m_iReportNs = config->reportNs;
+
+    if (migrate)
+    {
+        //a session of the old certificate is of no use
+        m_sessionTicket.clear();
+        if (m_pStandby)
+        {
+            disconnect(m_pStandby,0,this,0);
+            m_pStandby->abort();
+            m_pStandby->deleteLater();
+            m_pStandby = 0;
+        }
+        //a connection that is down picks the new settings up on its next attempt
+        if (isReady())
+        {
+            log(LOG_INFO,"Configuration changed, moving to a new connection.");
+            m_bMigrating = true;
+            connectStandby();
+        }
+    }
+    else if (!m_bStandby && m_pStandby && !m_bMigrating)
+    {
+        disconnect(m_pStandby,0,this,0);
+        m_pStandby->disconnectFromHost();
+        m_pStandby->deleteLater();
+        m_pStandby = 0;
+    }
+    else if (m_bStandby && !m_pStandby && isReady())
+        connectStandby();
+}
+
+//a retired connection takes no new payloads, it closes once it sent what it holds
+void CGatewayConnection::setRetired(bool retired)
+{
+    if (retired == m_bRetired)
+        return;
+    m_bRetired = retired;
+
+    if (retired)
+    {
+        log(LOG_INFO,"Leaving the pool.");
+        closeIfIdle();
+    }
+    else if (m_pSocket->state() == QAbstractSocket::UnconnectedState)
+        connectSocket();
+}
+
+void CGatewayConnection::closeIfIdle()
+{
+    if (!m_bRetired || m_bReplay || !isReady())
+        return;
+    for (int i=0;i<PAYLOAD_CLASSES;i++)
+        if (m_inbound[i].size())
+            return;
+    if (m_pSocket->bytesToWrite())
+        return;
+
+    if (m_pStandby)
+    {
+        disconnect(m_pStandby,0,this,0);
+        m_pStandby->abort();
+        m_pStandby->deleteLater();
+        m_pStandby = 0;
+    }
+    m_bMigrating = false;
+    m_pSocket->disconnectFromHost();
+}
+
+void CGatewayConnection::configure(QSslSocket *socket)
+{
+    socket->setCaCertificates(m_config->caCerts);
+    socket->setLocalCertificate(m_config->apps[m_iApp].cert);
+    socket->ignoreSslErrors(/*expectedSslErrors*/);
+    socket->setPrivateKey(m_config->apps[m_iApp].key);
+
+    socket->setPeerVerifyMode(QSslSocket::QueryPeer);
+}
+
+QSslSocket *CGatewayConnection::createSocket()
+{
+    QSslSocket *socket = new QSslSocket(this);
+    configure(socket);
+    return socket;
+}
+
+void CGatewayConnection::attach(QSslSocket *socket)
+{
+    connect(socket,SIGNAL(encrypted()),this,SLOT(encrypted()));
+    connect(socket,SIGNAL(disconnected()),this,SLOT(disconnected()));
+    connect(socket,SIGNAL(error(QAbstractSocket::SocketError)),this,SLOT(socketError(QAbstractSocket::SocketError)));
+    connect(socket,SIGNAL(sslErrors(QList<QSslError>)),this,SLOT(sslErrors(QList<QSslError>)));
+    connect(socket,SIGNAL(readyRead()),this,SLOT(readyRead()));
+    connect(socket,SIGNAL(bytesWritten(qint64)),this,SLOT(bytesWritten(qint64)));
+    connect(socket,SIGNAL(encryptedBytesWritten(qint64)),this,SLOT(bytesWritten(qint64)));
+}
+
+bool CGatewayConnection::isReady() const
+{
+    return __atomic_load_n(&m_iReady,__ATOMIC_ACQUIRE);
+}
+
+qint64 CGatewayConnection::outstandingBytes() const
+{
+    return __atomic_load_n(&m_iSocketBacklog,__ATOMIC_RELAXED) + __atomic_load_n(&m_iQueuedBytes,__ATOMIC_RELAXED);
+}
+
+/*
+ * Drain thread side. Returns false when the connection queue is full, the
+ * connection emits spaceAvailable() once it made room.
+ */
+bool CGatewayConnection::enqueue(const PayloadData *payload, const char *json, quint64 spoolseq, quint32 *ppos)
+{
+    CSpscQueue<QueuedPayload> &inbound = m_inbound[payloadClass(payload->priority)];
+    QueuedPayload *slot = inbound.claim();
+
+    if (!slot)
+    {
+        __atomic_store_n(&m_iDrainWaiting,1,__ATOMIC_SEQ_CST);
+        slot = inbound.claim();
+        if (!slot)
+            return false;
+        __atomic_store_n(&m_iDrainWaiting,0,__ATOMIC_RELAXED);
+    }
+
+    memcpy(&slot->payload,payload,sizeof(PayloadData));
+    slot->json = json;
+    slot->spoolseq = spoolseq;
+    slot->state = QUEUED_PENDING;
+    if (ppos)
+        *ppos = inbound.head();
+    __atomic_add_fetch(&m_iQueuedBytes,payload->length,__ATOMIC_RELAXED);
+    inbound.publish();
+    return true;
+}
+
+/*
+ * Drain thread side. Overwrites the payload queued at pos of a lane if
+ * the connection did not take it yet and it is for the same device and
+ * collapse key. The old arena block is freed, the spool sequence number
+ * stays with the slot.
+ */
+bool CGatewayConnection::replace(int lane, quint32 pos, const PayloadData *payload, const char *json)
+{
+    CSpscQueue<QueuedPayload> &inbound = m_inbound[lane];
+
+    //consumed already, the slot may hold a newer payload
+    if ((qint32)(pos - inbound.tail()) < 0)
+        return false;
+
+    QueuedPayload *slot = inbound.at(pos);
+    int expected = QUEUED_PENDING;
+    if (!__atomic_compare_exchange_n(&slot->state,&expected,QUEUED_WRITING,false,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+        return false;
+
+    bool same = slot->payload.collapse == payload->collapse && memcmp(slot->payload.device,payload->device,PAYLOAD_TOKEN_SIZE) == 0;
+    if (same)
+    {
+        if (slot->payload.block != PAYLOAD_NO_BLOCK)
+            m_pShared->freePayload(slot->payload.block,slot->payload.app);
+        __atomic_add_fetch(&m_iQueuedBytes,(qint64)payload->length - slot->payload.length,__ATOMIC_RELAXED);
+        memcpy(&slot->payload,payload,sizeof(PayloadData));
+        slot->json = json;
+    }
+
+    __atomic_store_n(&slot->state,QUEUED_PENDING,__ATOMIC_RELEASE);
+    return same;
+}
+
+void CGatewayConnection::schedule()
+{
+    if (__atomic_exchange_n(&m_iScheduled,1,__ATOMIC_ACQ_REL) == 0)
+        QMetaObject::invokeMethod(this,"process",Qt::QueuedConnection);
+}
+
+//spool sequence number of the last payload of a lane written to the socket
+quint64 CGatewayConnection::writtenSeq(int lane) const
+{
+    return __atomic_load_n(&m_iWrittenSeq[lane],__ATOMIC_ACQUIRE);
+}
+
+//number of payloads of a lane written to the socket (or dropped) so far
+quint64 CGatewayConnection::processedCount(int lane) const
+{
+    return __atomic_load_n(&m_iProcessed[lane],__ATOMIC_ACQUIRE);
+}
+
+void CGatewayConnection::bytesWritten(qint64)
+{
+    acknowledge();
+
+    qint64 backlog = m_pSocket->bytesToWrite();
+    __atomic_store_n(&m_iSocketBacklog,backlog,__ATOMIC_RELAXED);
+
+    if (m_bWritePaused && backlog <= m_iLowWater)
+    {
+        m_bWritePaused = false;
+        process();
+    }
+
+    closeIfIdle();
+}
+
+void CGatewayConnection::log(int type, const QString &msg, int event) const
+{
+    m_pDaemon->log(type,msg,event,m_iIndex);
+}
+
+void CGatewayConnection::connectTo(QSslSocket *socket)
+{
+    //the snapshot may have changed since the socket was created
+    configure(socket);
+    if (socket == m_pSocket)
+        m_iConnectStart = monotonicNs();
+    else
+        m_iStandbyStart = monotonicNs();
+
+#if QT_VERSION >= 0x050400
+    //offer the ticket of the last session, skips the client certificate exchange
+    QSslConfiguration config = socket->sslConfiguration();
+    config.setSslOption(QSsl::SslOptionDisableSessionPersistence,false);
+    if (!m_sessionTicket.isEmpty())
+        config.setSessionTicket(m_sessionTicket);
+    socket->setSslConfiguration(config);
+#endif
+
+    socket->connectToHostEncrypted(m_config->server,m_config->port);
+}
+
+void CGatewayConnection::saveSession(QSslSocket *socket)
+{
+#if QT_VERSION >= 0x050400
+    QByteArray ticket = socket->sslConfiguration().sessionTicket();
+    if (!ticket.isEmpty())
+        m_sessionTicket = ticket;
+#else
+    Q_UNUSED(socket);
+#endif
+}
+
+void CGatewayConnection::connectSocket()
+{
+    m_bReconnectPending = false;
+
+    //the standby took over meanwhile
+    if (m_bRetired || m_pSocket->state() != QAbstractSocket::UnconnectedState)
+        return;
+
+    QString msg = "Connecting to "+m_config->server+":"+QString::number(m_config->port)+"...";
+    log(LOG_INFO,msg);
+    connectTo(m_pSocket);
+}
+
+//exponential, half of the delay is random so pool connections spread out
+int CGatewayConnection::backoff(int failures)
+{
+    qint64 delay = (qint64)m_iBackoffMin << qMin(failures,20);
+    if (delay > m_iBackoffMax)
+        delay = m_iBackoffMax;
+    return delay / 2 + rand_r(&m_iSeed) % (delay / 2 + 1);
+}
+
+void CGatewayConnection::scheduleReconnect()
+{
+    if (m_bReconnectPending)
+        return;
+    m_bReconnectPending = true;
+
+    statAdd(&m_pStats->reconnects);
+    int delay = backoff(m_iFailure++);
+    log(LOG_ALERT,"Reconnecting in " + QString::number(delay) + " ms.");
+#if QT_VERSION >= 0x050000
+    QTimer::singleShot(delay,Qt::PreciseTimer,this,SLOT(connectSocket()));
+#else
+    QTimer::singleShot(delay,this,SLOT(connectSocket()));
+#endif
+}
+
+void CGatewayConnection::encrypted()
+{
+    log(LOG_INFO,"Connected to APN service.");
+
+    m_iFailure = 0;
+    m_bWritePaused = false;
+    saveSession(m_pSocket);
+
+    //a promoted standby was counted when it connected
+    if (m_iConnectStart)
+    {
+        statAdd(&m_pStats->connects);
+        m_pStats->handshake.record(monotonicNs() - m_iConnectStart);
+        m_iConnectStart = 0;
+    }
+
+    m_iWriteTotal = 0;
+    m_iSentTotal = 0;
+    if (m_bReplay)
+    {
+        log(LOG_INFO,"Resending " + QString::number(m_inflight.count()) + " push payloads.");
+        for (int i=0;i<m_inflight.count();i++)
+        {
+            m_pSocket->write(m_inflight.frame(i),m_inflight.frameSize(i));
+            m_iWriteTotal += m_inflight.frameSize(i);
+            m_iBytesWritten += m_inflight.frameSize(i);
+            statAdd(&m_pStats->bytes,m_inflight.frameSize(i));
+        }
+        m_bReplay = false;
+    }
+    //what the last socket did not send went out again above
+    for (int i=0;i<m_marks.size();i++)
+        m_marks[i].end = m_iWriteTotal;
+
+    __atomic_store_n(&m_iReady,1,__ATOMIC_RELEASE);
+    emit ready();
+
+    process();
+
+    if (m_bStandby && !m_pStandby && !m_bRetired)
+        connectStandby();
+}
+
+void CGatewayConnection::disconnected()
+{
+    __atomic_store_n(&m_iReady,0,__ATOMIC_RELEASE);
+    m_readBuffer.clear();
+
+    //after an error response the window already holds what Apple dropped
+    if (!m_bReplay)
+        keepUnsent();
+
+    //a retired connection only comes back to resend what Apple did not take
+    if (m_bRetired && !m_bReplay)
+    {
+        log(LOG_INFO,"Connection closed.");
+        return;
+    }
+
+    log(LOG_ALERT,"Connection reset.");
+
+    if (promoteStandby())
+        return;
+
+    scheduleReconnect();
+}
+
+void CGatewayConnection::socketError(QAbstractSocket::SocketError err)
+{
+    QString msg = "Socket error: "+QString::number(err);
+    log(LOG_ALERT,msg,LOG_EVENT_SOCKET_ERROR);
+
+    //connecting failed, there is no disconnected() for it
+    if (m_pSocket->state() == QAbstractSocket::UnconnectedState && !isReady())
+        scheduleReconnect();
+}
+
+/*
+ * Takes over an encrypted standby socket as the active one, the inflight
+ * replay and queued payloads go out on it right away.
+ */
+bool CGatewayConnection::promoteStandby()
+{
+    if (!m_pStandby || !m_pStandby->isEncrypted())
+        return false;
+
+    log(LOG_INFO,"Standby connection took over.");
+    handOver(false);
+    return true;
+}
+
+/*
+ * Makes the standby socket the active one. A graceful hand over lets the
+ * old socket write out what it buffered before it closes.
+ */
+void CGatewayConnection::handOver(bool graceful)
+{
+    QSslSocket *old = m_pSocket;
+    disconnect(old,0,this,0);
+    if (graceful && old->state() == QAbstractSocket::ConnectedState)
+    {
+        connect(old,SIGNAL(disconnected()),old,SLOT(deleteLater()));
+        old->disconnectFromHost();
+    }
+    else
+        old->deleteLater();
+
+    disconnect(m_pStandby,0,this,0);
+    m_pSocket = m_pStandby;
+    m_pStandby = 0;
+    m_bMigrating = false;
+    attach(m_pSocket);
+
+    encrypted();
+}
+
+void CGatewayConnection::connectStandby()
+{
+    if (!(m_bStandby || m_bMigrating) || m_pStandby)
+        return;
+
+    m_pStandby = createSocket();
+    connect(m_pStandby,SIGNAL(encrypted()),this,SLOT(standbyEncrypted()));
+    connect(m_pStandby,SIGNAL(disconnected()),this,SLOT(standbyLost()));
+    connect(m_pStandby,SIGNAL(error(QAbstractSocket::SocketError)),this,SLOT(standbyLost()));
+    connectTo(m_pStandby);
+}
+
+void CGatewayConnection::standbyEncrypted()
+{
+    m_iStandbyFailure = 0;
+    saveSession(m_pStandby);
+    statAdd(&m_pStats->connects);
+    m_pStats->handshake.record(monotonicNs() - m_iStandbyStart);
+
+    if (m_bMigrating)
+    {
+        log(LOG_INFO,"Switched to the new connection.");
+        handOver(true);
+        return;
+    }
+    log(LOG_INFO,"Standby connection ready.");
+}
+
+void CGatewayConnection::standbyLost()
+{
+    if (!m_pStandby || m_pStandby->state() != QAbstractSocket::UnconnectedState)
+        return;
+
+    disconnect(m_pStandby,0,this,0);
+    m_pStandby->deleteLater();
+    m_pStandby = 0;
+
+    int delay = backoff(m_iStandbyFailure++);
+    log(LOG_ALERT,"Standby connection lost, reconnecting in " + QString::number(delay) + " ms.");
+    QTimer::singleShot(delay,this,SLOT(connectStandby()));
+}
+
+void CGatewayConnection::sslErrors(const QList<QSslError> &errors)
+{
+    for (int i=0;i<errors.size();i++)
+        log(LOG_ALERT,errors[i].errorString(),LOG_EVENT_SOCKET_ERROR);
+}
+
+void CGatewayConnection::encode(const PayloadData *payload, const char *json)
+{
+    m_encoder.encode(payload,json,++m_iIdent);
+    m_aEnqueued[m_iBatch] = payload->enqueued;
+    m_aFrameEnd[m_iBatch] = m_encoder.size();
+    m_iBatch++;
+}
+
+bool CGatewayConnection::batchFull() const
+{
+    return m_iBatch >= ENCODE_BATCH_SIZE || m_encoder.size() >= m_iMaxWriteSize;
+}
+
+/*
+ * Connection thread side, encodes and writes what the drain thread queued.
+ * Payloads stay queued while the connection is down. The immediate lane is
+ * emptied first, power considerate payloads follow a batch at a time so
+ * newly queued immediate ones do not wait behind a long backlog.
+ */
+void CGatewayConnection::process()
+{
+    __atomic_store_n(&m_iScheduled,0,__ATOMIC_SEQ_CST);
+
+    //nothing is sent on a connection Apple reported an error on
+    if (!m_pSocket->isEncrypted() || m_bReplay)
+        return;
+
+    QueuedPayload *queued;
+    quint32 now = (quint32)::time(0);
+    quint32 done[PAYLOAD_CLASSES];
+    bool more = false;
+
+    for (int lane=0;lane<PAYLOAD_CLASSES;lane++)
+    {
+        CSpscQueue<QueuedPayload> &inbound = m_inbound[lane];
+        quint32 count = inbound.size();
+        quint32 n;
+
+        if (lane != PAYLOAD_CLASS_IMMEDIATE && count > ENCODE_BATCH_SIZE)
+            count = ENCODE_BATCH_SIZE;
+
+        for (n=0;n<count && !m_bWritePaused && (queued = inbound.front()) != 0;n++)
+        {
+            //the drain is replacing it, takes a few stores
+            int expected = QUEUED_PENDING;
+            while (!__atomic_compare_exchange_n(&queued->state,&expected,QUEUED_TAKEN,false,__ATOMIC_ACQUIRE,__ATOMIC_RELAXED))
+                expected = QUEUED_PENDING;
+
+            if (payloadExpired(&queued->payload,now))
+            {
+                m_iExpired++;
+                statAdd(&m_pStats->expired);
+            }
+            else
+                encode(&queued->payload,queued->json);
+            //the frame holds a copy now
+            if (queued->payload.block != PAYLOAD_NO_BLOCK)
+                m_pShared->freePayload(queued->payload.block,queued->payload.app);
+
+            if (queued->spoolseq)
+            {
+                m_aEncodedSeq[lane] = queued->spoolseq;
+                m_bSeqPending = true;
+            }
+            __atomic_sub_fetch(&m_iQueuedBytes,queued->payload.length,__ATOMIC_RELAXED);
+            inbound.pop();
+
+            if (batchFull())
+                flush();
+        }
+
+        done[lane] = n;
+        if (inbound.front() != 0)
+            more = true;
+    }
+
+    flush();
+    //expired payloads count as written once everything before them is
+    addMark();
+    acknowledge();
+
+    for (int lane=0;lane<PAYLOAD_CLASSES;lane++)
+        __atomic_store_n(&m_iProcessed[lane],m_iProcessed[lane] + done[lane],__ATOMIC_RELEASE);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&m_iDrainWaiting,0,__ATOMIC_SEQ_CST))
+        emit spaceAvailable();
+
+    //give the socket a turn before the rest, bytesWritten() resumes a paused connection
+    if (more && !m_bWritePaused)
+        schedule();
+
+    report();
+}
+
+void CGatewayConnection::flush()
+{
+    if (m_iBatch == 0)
+        return;
+
+    m_pSocket->write(m_encoder.data(),m_encoder.size());
+    m_iWriteTotal += m_encoder.size();
+
+    //v0 frames are kept too, for resending what the socket did not send
+    quint32 ident = m_iIdent - m_iBatch + 1;
+    int start = 0;
+    for (int i=0;i<m_iBatch;i++)
+    {
+        m_inflight.add(ident++,m_encoder.data() + start,m_aFrameEnd[i] - start);
+        start = m_aFrameEnd[i];
+    }
+
+    quint64 now = monotonicNs();
+    for (int i=0;i<m_iBatch;i++)
+    {
+        m_latency.record(now - m_aEnqueued[i]);
+        m_pStats->enqueueWrite.record(now - m_aEnqueued[i]);
+    }
+
+    m_iFramesSent += m_iBatch;
+    m_iBytesWritten += m_encoder.size();
+    statAdd(&m_pStats->sent,m_iBatch);
+    statAdd(&m_pStats->bytes,m_encoder.size());
+
+    m_encoder.clear();
+    m_iBatch = 0;
+    addMark();
+
+    qint64 backlog = m_pSocket->bytesToWrite();
+    __atomic_store_n(&m_iSocketBacklog,backlog,__ATOMIC_RELAXED);
+    if (backlog >= m_iHighWater)
+        m_bWritePaused = true;
+}
+
+void CGatewayConnection::addMark()
+{
+    if (!m_bSeqPending)
+        return;
+
+    WriteMark mark;
+    mark.end = m_iWriteTotal;
+    memcpy(mark.spoolseq,m_aEncodedSeq,sizeof(mark.spoolseq));
+    m_marks.append(mark);
+    m_bSeqPending = false;
+}
+
+/*
+ * Moves the written spool sequence numbers on to what the socket sent.
+ * Encrypted bytes still buffered are at least as many as the plain bytes
+ * they carry, so the sent count errs on the low side. A closed socket may
+ * have dropped its buffers, the count stays where it was then.
+ */
+void CGatewayConnection::acknowledge()
+{
+    if (m_pSocket->state() != QAbstractSocket::UnconnectedState)
+    {
+        qint64 sent = (qint64)m_iWriteTotal - m_pSocket->bytesToWrite() - m_pSocket->encryptedBytesToWrite();
+        if (sent > (qint64)m_iSentTotal)
+            m_iSentTotal = sent;
+    }
+
+    while (!m_marks.isEmpty() && m_marks.first().end <= m_iSentTotal)
+    {
+        const WriteMark &mark = m_marks.first();
+        for (int lane=0;lane<PAYLOAD_CLASSES;lane++)
+            if (mark.spoolseq[lane])
+                __atomic_store_n(&m_iWrittenSeq[lane],mark.spoolseq[lane],__ATOMIC_RELEASE);
+        m_marks.removeFirst();
+    }
+}
+
+/*
+ * The connection dropped without an error response. The newest frames the
+ * socket had not sent never reached Apple, they stay in the window and go
+ * out again on the next connection.
+ */
+void CGatewayConnection::keepUnsent()
+{
+    quint64 unsent = m_iWriteTotal - m_iSentTotal;
+    quint64 kept = 0;
+    int first = m_inflight.count();
+    while (first > 0 && kept < unsent)
+        kept += m_inflight.frameSize(--first);
+
+    if (kept < unsent)
+        log(LOG_ALERT,QString::number(unsent - kept) + " unsent bytes are no longer in the inflight window and are lost.");
+
+    if (first > 0)
+        m_inflight.discardThrough(m_inflight.ident(first - 1));
+    if (m_inflight.count())
+        m_bReplay = true;
+}
+
+void CGatewayConnection::report()
+{
+    quint64 now = monotonicNs();
+
+    if (m_iReportNs == 0 || now - m_iLastReport < m_iReportNs)
+        return;
+
+    double seconds = (now - m_iLastReport) / 1e9;
+    quint64 frames = m_iFramesSent - m_iReportFrames;
+    quint64 bytes = m_iBytesWritten - m_iReportBytes;
+
+    QString msg = QString::number(frames / seconds,'f',1) + " payloads/s, ";
+    msg += QString::number(bytes / seconds / 1024,'f',1) + " KiB/s (";
+    msg += QString::number(m_iFramesSent) + " payloads, " + QString::number(m_iBytesWritten) + " bytes total";
+    if (m_iExpired)
+        msg += ", " + QString::number(m_iExpired) + " expired";
+    msg += ")";
+
+    if (m_latency.count)
+    {
+        msg += ", latency enqueue->write (us): p50 " + QString::number(m_latency.percentile(0.5) / 1000);
+        msg += " p99 " + QString::number(m_latency.percentile(0.99) / 1000);
+        msg += " max " + QString::number(m_latency.max / 1000);
+    }
+    log(LOG_INFO,msg,LOG_EVENT_REPORT);
+
+    m_latency.reset();
+    m_iReportFrames = m_iFramesSent;
+    m_iReportBytes = m_iBytesWritten;
+    m_iLastReport = now;
+}
+
+void CGatewayConnection::readyRead()
+{
+    if (m_pSocket->bytesAvailable() == 0)
+        return;
+
+    m_readBuffer.append(m_pSocket->readAll());
+
+    //error responses are 6 bytes: command(1) status(1) identifier(4)
+    int pos = 0;
+    while (m_readBuffer.size() - pos >= 6)
+    {
+        const uchar *d = reinterpret_cast<const uchar*>(m_readBuffer.constData()) + pos;
+        quint8 cmd = d[0];
+        quint8 status = d[1];
+        quint32 id = qFromBigEndian<quint32>(d + 2);
+        pos += 6;
+
+        QString str = "APNS reply: ";
+
+        if (cmd != 8)
+        {
+            str += "Unknown command";
+            log(LOG_ALERT,str,LOG_EVENT_ERROR_RESPONSE);
+            pos = m_readBuffer.size();
+            break;
+        }
+
+        if (status == 0)
+            str += "No errors";
+        else if (status == 1)
+            str += "Processing error";
+        else if (status == 2)
+            str += "Missing device token";
+        else if (status == 3)
+            str += "Missing topic";
+        else if (status == 4)
+            str += "Missing payload";
+        else if (status == 5)
+            str += "Invalid token size";
+        else if (status == 6)
+            str += "Invalid topic size";
+        else if (status == 7)
+            str += "Invalid payload size";
+        else if (status == 8)
+            str += "Invalid token";
+        else if (status == 10)
+            str += "Shutdown";
+        else
+            str += "Unknown error ("+QString::number(status)+")";
+
+        statAdd(&m_pStats->errorResponses);
+        statAdd(&m_pStats->status[status]);
+
+        str += " For id " + QString::number(id);
+        log(LOG_ALERT,str,LOG_EVENT_ERROR_RESPONSE);
+
+        if (m_encoder.protocol() == 2 && status == 8)
+        {
+            //v2 frame: command(1) length(4) item id(1) item length(2) token(32)
+            int i = m_inflight.indexOf(id);
+            if (i >= 0 && m_inflight.frameSize(i) >= 8 + PAYLOAD_TOKEN_SIZE)
+            {
+                QByteArray record(m_inflight.frame(i) + 8,PAYLOAD_TOKEN_SIZE);
+                uchar t[4];
+                qToBigEndian<quint32>((quint32)::time(0),t);
+                record.append(reinterpret_cast<const char*>(t),4);
+                emit invalidToken(record);
+            }
+        }
+
+        if (m_encoder.protocol() == 2 && status != 0)
+        {
+            /*
+             * Apple closes the connection after an error and drops
+             * everything sent after id. For status 10 (shutdown) id is the
+             * last notification it accepted, otherwise it is the one that
+             * failed. Either way everything newer has to be sent again.
+             */
+            m_inflight.discardThrough(id);
+            m_bReplay = true;
+            __atomic_store_n(&m_iReady,0,__ATOMIC_RELEASE);
+        }
+    }
+
+    m_readBuffer.remove(0,pos);
+
+    if (m_bReplay)
+        m_pSocket->disconnectFromHost();
+}
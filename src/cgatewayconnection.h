@@ -0,0 +1,229 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CGATEWAYCONNECTION_H
+#define CGATEWAYCONNECTION_H
+
+#include <QObject>
+#include <QString>
+#include <QSslSocket>
+#include <QSslCertificate>
+#include "cframeencoder.h"
+#include "cinflightwindow.h"
+#include "cspscqueue.h"
+#include "shared.h"
+#include "latency.h"
+#include "config.h"
+#include "clogger.h"
+#include "stats.h"
+
+#define ENCODE_BATCH_SIZE 4096
+
+class CAPNSd;
+
+//QueuedPayload::state
+#define QUEUED_PENDING 0
+#define QUEUED_TAKEN 1
+#define QUEUED_WRITING 2
+
+/*
+ * json points into the payload arena, or into the spool mapping for
+ * replayed payloads (payload.block is PAYLOAD_NO_BLOCK then). spoolseq is
+ * the journal sequence number, 0 without a spool. The drain may replace a
+ * pending payload in place, state keeps it from racing the connection.
+ */
+struct QueuedPayload
+{
+    PayloadData payload;
+    const char *json;
+    quint64 spoolseq;
+    int state;
+};
+
+/*
+ * Spool sequence numbers of the payloads written up to byte end of the
+ * socket stream, they count as written once the socket sent that far.
+ */
+struct WriteMark
+{
+    quint64 end;
+    quint64 spoolseq[PAYLOAD_CLASSES];
+};
+
+/*
+ * One TLS connection to the APN gateway, living in its own thread. The
+ * drain thread hands payloads over through enqueue(), the connection
+ * thread encodes them into its own batch buffer and writes them, so TLS
+ * and encoding work spread over the cores. Each connection keeps its own
+ * identifier sequence, replay window and reconnect state.
+ *
+ * Every priority class has its own queue (lane), immediate payloads are
+ * written before power considerate ones and expired payloads are dropped
+ * before they are encoded.
+ *
+ * Writing pauses once the socket buffers more than the high-water mark and
+ * resumes when bytesWritten() brings it under the low-water mark, a slow
+ * gateway leaves the backlog in the queues instead of in the socket.
+ * A payload only counts as written for the spool once the socket sent it,
+ * frames still buffered when the connection drops are sent again.
+ *
+ * Reconnects back off exponentially with jitter and resume the last TLS
+ * session when Qt supports it (5.4). With a standby connection a second
+ * socket is kept encrypted and idle, it takes over as soon as the active
+ * one drops.
+ *
+ * A reloaded configuration with other credentials or another gateway is
+ * taken over on a fresh socket, the old one is closed once it is encrypted.
+ * A retired connection stops reconnecting once its queues are empty.
+ */
+class CGatewayConnection : public QObject
+{
+    Q_OBJECT
+public:
+    CGatewayConnection(int index, int app, SharedPayload *shared, CAPNSd *daemon);
+    ~CGatewayConnection();
+
+    int index() const { return m_iIndex; }
+    //app profile whose certificate the connection uses
+    int app() const { return m_iApp; }
+    quint32 queueSize() const { return m_inbound[0].capacity(); }
+
+    //called from the drain thread
+    bool isReady() const;
+    qint64 outstandingBytes() const;
+    bool enqueue(const PayloadData *payload, const char *json, quint64 spoolseq = 0, quint32 *ppos = 0);
+    bool replace(int lane, quint32 pos, const PayloadData *payload, const char *json);
+    void schedule();
+    quint64 writtenSeq(int lane) const;
+    quint64 processedCount(int lane) const;
+
+signals:
+    void ready();
+    void spaceAvailable();
+    //token(32) time(4) of a notification Apple rejected with status 8
+    void invalidToken(const QByteArray &record);
+
+public slots:
+    //call directly before the thread starts, queued afterwards
+    void applyConfig(const ConfigSnapshot &config);
+    void setRetired(bool retired);
+    void connectSocket();
+    void connectStandby();
+    void process();
+
+private slots:
+    void encrypted();
+    void disconnected();
+    void socketError(QAbstractSocket::SocketError);
+    void sslErrors(const QList<QSslError> & errors);
+    void readyRead();
+    void standbyEncrypted();
+    void standbyLost();
+
+    void bytesWritten(qint64);
+
+private:
+    void log(int type, const QString &msg, int event = LOG_EVENT_CONNECTION) const;
+    QSslSocket *createSocket();
+    void configure(QSslSocket *socket);
+    void attach(QSslSocket *socket);
+    void connectTo(QSslSocket *socket);
+    void saveSession(QSslSocket *socket);
+    int backoff(int failures);
+    void scheduleReconnect();
+    bool promoteStandby();
+    void handOver(bool graceful);
+    void closeIfIdle();
+    void encode(const PayloadData *payload, const char *json);
+    bool batchFull() const;
+    void flush();
+    void addMark();
+    void acknowledge();
+    void keepUnsent();
+    void report();
+
+    SharedPayload *m_pShared;
+    CAPNSd *m_pDaemon;
+    QSslSocket *m_pSocket;
+    int m_iIndex;
+    int m_iApp;
+    int m_iFailure;
+    bool m_bReconnectPending;
+    bool m_bRetired;
+
+    ConfigSnapshot m_config;
+    QByteArray m_sessionTicket;
+
+    int m_iBackoffMin;
+    int m_iBackoffMax;
+    unsigned int m_iSeed;
+    bool m_bStandby;
+    QSslSocket *m_pStandby;
+    int m_iStandbyFailure;
+    bool m_bMigrating;
+    quint32 m_iIdent;
+
+    CSpscQueue<QueuedPayload> m_inbound[PAYLOAD_CLASSES];
+    quint64 m_iWrittenSeq[PAYLOAD_CLASSES];
+    //last spool sequence number encoded per lane, not yet in a mark if m_bSeqPending
+    quint64 m_aEncodedSeq[PAYLOAD_CLASSES];
+    bool m_bSeqPending;
+    QList<WriteMark> m_marks;
+    //bytes handed to the socket and bytes it sent, since it connected
+    quint64 m_iWriteTotal;
+    quint64 m_iSentTotal;
+    quint64 m_iProcessed[PAYLOAD_CLASSES];
+    int m_iReady;
+    int m_iScheduled;
+    int m_iDrainWaiting;
+    //payload bytes in the lanes, added by the drain and taken off by process()
+    qint64 m_iQueuedBytes;
+    qint64 m_iSocketBacklog;
+    qint64 m_iHighWater;
+    qint64 m_iLowWater;
+    bool m_bWritePaused;
+
+    CFrameEncoder m_encoder;
+    int m_iMaxWriteSize;
+    int m_iBatch;
+    quint64 m_aEnqueued[ENCODE_BATCH_SIZE];
+    int m_aFrameEnd[ENCODE_BATCH_SIZE];
+
+    CInflightWindow m_inflight;
+    bool m_bReplay;
+    QByteArray m_readBuffer;
+
+    quint64 m_iFramesSent;
+    quint64 m_iExpired;
+    quint64 m_iBytesWritten;
+    quint64 m_iReportFrames;
+    quint64 m_iReportBytes;
+
+    LatencyHistogram m_latency;
+    //shared stats block, m_latency only spans one report interval
+    ConnectionStats *m_pStats;
+    quint64 m_iConnectStart;
+    quint64 m_iStandbyStart;
+    quint64 m_iReportNs;
+    quint64 m_iLastReport;
+};
+
+#endif // CGATEWAYCONNECTION_H
@@ -0,0 +1,101 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "cinflightwindow.h"
+#include <string.h>
+
+CInflightWindow::CInflightWindow(int maxFrames, int maxBytes)
+{
+    resize(maxFrames,maxBytes);
+}
+
+void CInflightWindow::resize(int maxFrames, int maxBytes)
+{
+    m_entries.resize(qMax(maxFrames,1));
+    m_data.resize(qMax(maxBytes,1));
+    clear();
+}
+
+void CInflightWindow::clear()
+{
+    m_iTail = 0;
+    m_iCount = 0;
+    m_iWrite = 0;
+}
+
+void CInflightWindow::evictOldest()
+{
+    m_iTail = (m_iTail + 1) % m_entries.size();
+    m_iCount--;
+}
+
+void CInflightWindow::add(quint32 ident, const char *frame, int len)
+{
+    if (len > m_data.size())
+    {
+        //never fits, whatever is older can no longer be replayed either
+        clear();
+        return;
+    }
+
+    if (m_iCount == m_entries.size())
+        evictOldest();
+
+    int start = m_iWrite;
+    if (start + len > m_data.size())
+    {
+        //frames are kept contiguous, skip the tail of the ring
+        while (m_iCount > 0 && m_entries[m_iTail].offset >= start)
+            evictOldest();
+        start = 0;
+    }
+
+    while (m_iCount > 0 && m_entries[m_iTail].offset >= start && m_entries[m_iTail].offset < start + len)
+        evictOldest();
+
+    memcpy(m_data.data() + start,frame,len);
+
+    Entry &e = m_entries[index(m_iCount)];
+    e.ident = ident;
+    e.offset = start;
+    e.length = len;
+    m_iCount++;
+    m_iWrite = start + len;
+}
+
+//identifiers have no gaps, so the position follows from the oldest one
+int CInflightWindow::indexOf(quint32 ident) const
+{
+    if (m_iCount == 0)
+        return -1;
+    quint32 i = ident - m_entries[m_iTail].ident;
+    return i < (quint32)m_iCount ? (int)i : -1;
+}
+
+/*
+ * Drops every frame up to and including ident. Frames after it are the
+ * ones Apple discarded when it closed the connection.
+ */
+void CInflightWindow::discardThrough(quint32 ident)
+{
+    while (m_iCount > 0 && (qint32)(ident - m_entries[m_iTail].ident) >= 0)
+        evictOldest();
+}
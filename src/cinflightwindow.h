@@ -0,0 +1,70 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CINFLIGHTWINDOW_H
+#define CINFLIGHTWINDOW_H
+
+#include <QByteArray>
+#include <QVector>
+
+/*
+ * Keeps the most recently written frames, keyed by their notification
+ * identifier, for resending what Apple dropped after an error or what the
+ * socket had not sent when the connection closed. Identifiers are added in increasing order without gaps, frames
+ * are stored back to back in a fixed byte ring and the oldest ones are
+ * evicted when either the frame or the byte limit is reached.
+ */
+class CInflightWindow
+{
+public:
+    CInflightWindow(int maxFrames = 16384, int maxBytes = 4 * 1024 * 1024);
+
+    void resize(int maxFrames, int maxBytes);
+    void clear();
+
+    void add(quint32 ident, const char *frame, int len);
+    void discardThrough(quint32 ident);
+    int indexOf(quint32 ident) const;
+
+    int count() const { return m_iCount; }
+    quint32 ident(int i) const { return m_entries[index(i)].ident; }
+    const char *frame(int i) const { return m_data.constData() + m_entries[index(i)].offset; }
+    int frameSize(int i) const { return m_entries[index(i)].length; }
+
+private:
+    struct Entry
+    {
+        quint32 ident;
+        int offset;
+        int length;
+    };
+
+    int index(int i) const { return (m_iTail + i) % m_entries.size(); }
+    void evictOldest();
+
+    QVector<Entry> m_entries;
+    QByteArray m_data;
+    int m_iTail;
+    int m_iCount;
+    int m_iWrite;
+};
+
+#endif // CINFLIGHTWINDOW_H
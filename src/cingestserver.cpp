@@ -0,0 +1,392 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "cingestserver.h"
+#include "capnsd.h"
+#include "shared.h"
+#include "latency.h"
+#include "stats.h"
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QHostAddress>
+#include <QTimer>
+#include <QtEndian>
+#include <syslog.h>
+#include <string.h>
+
+#define INGEST_ITEM_HEADER 39
+#define INGEST_SCHEDULED_ITEM_HEADER 43
+#define INGEST_COLLAPSE_ITEM_HEADER 44
+#define INGEST_BATCH_HEADER 6
+#define INGEST_READ_BUFFER (256 * 1024)
+
+CIngestServer::CIngestServer(SharedPayload *shared, CAPNSd *daemon) :
+    QObject(0), m_pShared(shared), m_pDaemon(daemon)
+{
+    m_sSocketPath = INGEST_DEFAULT_SOCKET;
+    m_iTcpPort = 0;
+    m_pLocalServer = 0;
+    m_pTcpServer = 0;
+    m_pRetryTimer = 0;
+}
+
+CIngestServer::~CIngestServer()
+{
+    for (int i=0;i<m_clients.size();i++)
+        delete m_clients[i];
+}
+
+void CIngestServer::setAddress(const QString &socketPath, quint16 tcpPort)
+{
+    m_sSocketPath = socketPath;
+    m_iTcpPort = tcpPort;
+}
+
+//runs in the ingest thread, the servers belong to it
+void CIngestServer::start()
+{
+    m_pRetryTimer = new QTimer(this);
+    m_pRetryTimer->setSingleShot(true);
+    m_pRetryTimer->setInterval(5);
+    connect(m_pRetryTimer,SIGNAL(timeout()),this,SLOT(retryStalled()));
+
+    if (!m_sSocketPath.isEmpty())
+    {
+        QLocalServer::removeServer(m_sSocketPath);
+        m_pLocalServer = new QLocalServer(this);
+#if QT_VERSION >= 0x050000
+        //APNSd push may run as any user, so may the clients
+        m_pLocalServer->setSocketOptions(QLocalServer::WorldAccessOption);
+#endif
+        connect(m_pLocalServer,SIGNAL(newConnection()),this,SLOT(newLocalConnection()));
+        if (m_pLocalServer->listen(m_sSocketPath))
+            m_pDaemon->log(LOG_INFO,"Accepting push payloads on " + m_sSocketPath + ".");
+        else
+            m_pDaemon->log(LOG_ALERT,"Could not listen on " + m_sSocketPath + ": " + m_pLocalServer->errorString());
+    }
+
+    if (m_iTcpPort != 0)
+    {
+        m_pTcpServer = new QTcpServer(this);
+        connect(m_pTcpServer,SIGNAL(newConnection()),this,SLOT(newTcpConnection()));
+        if (m_pTcpServer->listen(QHostAddress::LocalHost,m_iTcpPort))
+            m_pDaemon->log(LOG_INFO,"Accepting push payloads on 127.0.0.1:" + QString::number(m_iTcpPort) + ".");
+        else
+            m_pDaemon->log(LOG_ALERT,"Could not listen on 127.0.0.1:" + QString::number(m_iTcpPort) + ": " + m_pTcpServer->errorString());
+    }
+}
+
+void CIngestServer::newLocalConnection()
+{
+    QLocalSocket *socket;
+    while ((socket = m_pLocalServer->nextPendingConnection()) != 0)
+    {
+        //bounded so a client waiting on a full queue is not read any further
+        socket->setReadBufferSize(INGEST_READ_BUFFER);
+        addClient(socket);
+    }
+}
+
+void CIngestServer::newTcpConnection()
+{
+    QTcpSocket *socket;
+    while ((socket = m_pTcpServer->nextPendingConnection()) != 0)
+    {
+        socket->setReadBufferSize(INGEST_READ_BUFFER);
+        socket->setSocketOption(QAbstractSocket::LowDelayOption,1);
+        addClient(socket);
+    }
+}
+
+void CIngestServer::addClient(QIODevice *device)
+{
+    Client *client = new Client;
+    client->device = device;
+    client->pos = 0;
+    client->item = 0;
+    client->itemPos = INGEST_BATCH_HEADER;
+    client->accepted = 0;
+    client->rejected = 0;
+    client->stalled = false;
+    client->closed = false;
+    m_clients.append(client);
+
+    connect(device,SIGNAL(readyRead()),this,SLOT(readyRead()));
+    connect(device,SIGNAL(disconnected()),this,SLOT(disconnected()));
+}
+
+CIngestServer::Client *CIngestServer::findClient(QObject *device) const
+{
+    for (int i=0;i<m_clients.size();i++)
+        if (m_clients[i]->device == device)
+            return m_clients[i];
+    return 0;
+}
+
+void CIngestServer::readyRead()
+{
+    Client *client = findClient(sender());
+    if (client)
+        readClient(client);
+}
+
+void CIngestServer::disconnected()
+{
+    Client *client = findClient(sender());
+    if (!client)
+        return;
+
+    //may be emitted from within process(), the client goes away later
+    client->closed = true;
+    client->device->deleteLater();
+    QMetaObject::invokeMethod(this,"removeClosed",Qt::QueuedConnection);
+}
+
+void CIngestServer::removeClosed()
+{
+    for (int i=m_clients.size()-1;i>=0;i--)
+    {
+        if (m_clients[i]->closed)
+        {
+            delete m_clients[i];
+            m_clients.removeAt(i);
+        }
+    }
+}
+
+void CIngestServer::retryStalled()
+{
+    bool stalled = false;
+
+    for (int i=0;i<m_clients.size();i++)
+    {
+        Client *client = m_clients[i];
+        if (!client->stalled || client->closed)
+            continue;
+        client->stalled = false;
+        readClient(client);
+        stalled |= client->stalled;
+    }
+
+    if (stalled)
+        m_pRetryTimer->start();
+}
+
+void CIngestServer::readClient(Client *client)
+{
+    while (!client->stalled && !client->closed)
+    {
+        if (client->device->bytesAvailable() > 0)
+            client->buffer.append(client->device->readAll());
+
+        process(client);
+
+        if (client->device->bytesAvailable() == 0)
+            break;
+    }
+}
+
+void CIngestServer::process(Client *client)
+{
+    const uchar *data = reinterpret_cast<const uchar*>(client->buffer.constData());
+    int size = client->buffer.size();
+
+    while (size - client->pos >= 5)
+    {
+        quint32 len = qFromBigEndian<quint32>(data + client->pos);
+        const uchar *body = data + client->pos + 4;
+
+        if (len < 1 || len > INGEST_MAX_FRAME || (body[0] < INGEST_BATCH || body[0] > INGEST_APP_BATCH))
+        {
+            sendAck(client,0,INGEST_MALFORMED);
+            client->closed = true;
+            break;
+        }
+        if ((quint32)(size - client->pos - 4) < len)
+            break;
+
+        int result = processBatch(client,body[0],body + 1,len - 1);
+        if (result < 0)
+        {
+            quint32 id = len >= 5 ? qFromBigEndian<quint32>(body + 1) : 0;
+            sendAck(client,id,INGEST_MALFORMED);
+            client->closed = true;
+            break;
+        }
+        if (result == 0)
+        {
+            statAdd(&m_pDaemon->stats()->ingestStalls);
+            client->stalled = true;
+            if (!m_pRetryTimer->isActive())
+                m_pRetryTimer->start();
+            break;
+        }
+
+        client->pos += 4 + len;
+    }
+
+    if (client->pos == size)
+    {
+        client->buffer.clear();
+        client->pos = 0;
+    }
+    else if (client->pos > INGEST_READ_BUFFER)
+    {
+        client->buffer.remove(0,client->pos);
+        client->pos = 0;
+    }
+
+    m_pShared->wakeConsumer();
+
+    if (client->closed)
+    {
+        m_pDaemon->log(LOG_ALERT,"Closing ingest connection after a malformed frame.",LOG_EVENT_INGEST);
+        client->device->close();
+    }
+}
+
+//walks the items of a batch, false when they overrun it or do not fill it exactly
+static bool wellFormed(const uchar *body, int len, int start, int fixed, quint16 count)
+{
+    int p = start;
+    for (int i=0;i<count;i++)
+    {
+        if (len - p < fixed)
+            return false;
+        int header = fixed + (fixed == INGEST_COLLAPSE_ITEM_HEADER ? body[p + 41] : 0);
+        if (len - p < header)
+            return false;
+        quint16 plen = qFromBigEndian<quint16>(body + p + header - 2);
+        if (len - p - header < plen)
+            return false;
+        p += header + plen;
+    }
+    return p == len;
+}
+
+/*
+ * Publishes the items of one batch. Returns 1 when done, 0 when the shared
+ * queue is full (the batch continues where it stopped) and -1 when the
+ * batch is malformed.
+ */
+int CIngestServer::processBatch(Client *client, int type, const uchar *body, int len)
+{
+    int fixed = INGEST_ITEM_HEADER;
+    if (type == INGEST_SCHEDULED_BATCH)
+        fixed = INGEST_SCHEDULED_ITEM_HEADER;
+    else if (type == INGEST_COLLAPSE_BATCH || type == INGEST_APP_BATCH)
+        fixed = INGEST_COLLAPSE_ITEM_HEADER;
+
+    if (len < INGEST_BATCH_HEADER)
+        return -1;
+
+    quint32 id = qFromBigEndian<quint32>(body);
+    quint16 count = qFromBigEndian<quint16>(body + 4);
+    int start = INGEST_BATCH_HEADER;
+    int app = 0;
+
+    if (type == INGEST_APP_BATCH)
+    {
+        if (len < INGEST_BATCH_HEADER + 1 || len < INGEST_BATCH_HEADER + 1 + body[6])
+            return -1;
+        start += 1 + body[6];
+        app = m_pShared->findApp(reinterpret_cast<const char*>(body + 7),body[6]);
+        if (app < 0)
+        {
+            client->rejected = count;
+            sendAck(client,id,INGEST_UNKNOWN_APP);
+            statAdd(&m_pDaemon->stats()->ingestRejected,count);
+            client->rejected = 0;
+            return 1;
+        }
+    }
+
+    //checked as a whole first, a client retrying a malformed batch must not duplicate items
+    if (!client->item && !wellFormed(body,len,start,fixed,count))
+        return -1;
+
+    int p = client->item ? client->itemPos : start;
+
+    for (;client->item < count;client->item++)
+    {
+        const uchar *item = body + p;
+        quint8 priority = item[32];
+        //the collapse key sits between send_at and the payload length
+        int keylen = fixed == INGEST_COLLAPSE_ITEM_HEADER ? item[41] : 0;
+        int header = fixed + keylen;
+        quint16 plen = qFromBigEndian<quint16>(item + header - 2);
+
+        if (plen == 0 || plen > PAYLOAD_MAX_SIZE || keylen > PAYLOAD_COLLAPSE_KEY_MAX || (priority != PAYLOAD_PRIORITY_IMMEDIATE && priority != PAYLOAD_PRIORITY_CONSERVE))
+            client->rejected++;
+        else
+        {
+            quint32 block = m_pShared->allocPayload(plen,app);
+            quint32 pos;
+            PayloadData *slot = block != PAYLOAD_NO_BLOCK ? m_pShared->claim(payloadRing(app,priority),&pos) : 0;
+            if (!slot)
+            {
+                if (block != PAYLOAD_NO_BLOCK)
+                    m_pShared->freePayload(block,app);
+                client->itemPos = p;
+                return 0;
+            }
+
+            memcpy(slot->device,item,PAYLOAD_TOKEN_SIZE);
+            slot->priority = priority;
+            slot->expiry = qFromBigEndian<quint32>(item + 33);
+            slot->sendAt = type != INGEST_BATCH ? qFromBigEndian<quint32>(item + 37) : 0;
+            slot->collapse = keylen ? collapseKeyHash(reinterpret_cast<const char*>(item + 42),keylen) : 0;
+            memcpy(m_pShared->payloadBytes(block),item + header,plen);
+            slot->length = plen;
+            slot->block = block;
+            slot->app = app;
+            slot->enqueued = monotonicNs();
+            m_pShared->publish(slot,pos);
+            client->accepted++;
+        }
+
+        p += header + plen;
+    }
+
+    sendAck(client,id,INGEST_OK);
+    statAdd(&m_pDaemon->stats()->ingestAccepted,client->accepted);
+    statAdd(&m_pDaemon->stats()->ingestRejected,client->rejected);
+
+    client->item = 0;
+    client->itemPos = INGEST_BATCH_HEADER;
+    client->accepted = 0;
+    client->rejected = 0;
+    return 1;
+}
+
+void CIngestServer::sendAck(Client *client, quint32 id, quint8 status)
+{
+    uchar ack[14];
+    qToBigEndian<quint32>(10,ack);
+    ack[4] = INGEST_ACK;
+    qToBigEndian<quint32>(id,ack + 5);
+    ack[9] = status;
+    qToBigEndian<quint16>(client->accepted,ack + 10);
+    qToBigEndian<quint16>(client->rejected,ack + 12);
+    client->device->write(reinterpret_cast<const char*>(ack),sizeof(ack));
+}
@@ -0,0 +1,124 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CINGESTSERVER_H
+#define CINGESTSERVER_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QList>
+
+#define INGEST_MAX_FRAME (1024 * 1024)
+
+//frame types
+#define INGEST_BATCH 1
+#define INGEST_SCHEDULED_BATCH 2
+#define INGEST_COLLAPSE_BATCH 3
+#define INGEST_APP_BATCH 4
+#define INGEST_ACK 0x81
+
+//ack status
+#define INGEST_OK 0
+#define INGEST_MALFORMED 1
+#define INGEST_UNKNOWN_APP 2
+
+struct SharedPayload;
+class CAPNSd;
+class QLocalServer;
+class QTcpServer;
+class QIODevice;
+class QTimer;
+
+/*
+ * Accepts notifications over persistent local connections and publishes
+ * them to the shared queue, in its own thread. All integers are big endian.
+ *
+ * Frame:  length(4, bytes following) type(1) body
+ * Batch:  type 1, id(4) count(2) then count times
+ *         token(32) priority(1) expiry(4) length(2) payload
+ * Batch:  type 2, as type 1 with send_at(4) after expiry
+ * Batch:  type 3, as type 2 with key_length(1) collapse key after send_at
+ * Batch:  type 4, id(4) count(2) app_length(1) app name then type 3 items
+ * Ack:    type 0x81, id(4) status(1) accepted(2) rejected(2)
+ *
+ * Batches may be pipelined, acks come back in order once the whole batch
+ * is in the shared queue. Items with a bad priority or an empty payload or
+ * one over PAYLOAD_MAX_SIZE bytes are rejected. While the shared queue or
+ * the payload arena is full the connection is not read any further. A
+ * malformed frame is acked with status 1 and the connection is closed,
+ * nothing of it is published. A batch for an app the daemon has no
+ * profile for is rejected as a whole with status 2.
+ * Batches of types 1 to 3 go to the default app.
+ */
+class CIngestServer : public QObject
+{
+    Q_OBJECT
+public:
+    CIngestServer(SharedPayload *shared, CAPNSd *daemon);
+    ~CIngestServer();
+
+    void setAddress(const QString &socketPath, quint16 tcpPort);
+
+public slots:
+    void start();
+
+private slots:
+    void newLocalConnection();
+    void newTcpConnection();
+    void readyRead();
+    void disconnected();
+    void retryStalled();
+    void removeClosed();
+
+private:
+    struct Client
+    {
+        QIODevice *device;
+        QByteArray buffer;
+        int pos;
+        //progress through the current batch while the queue is full
+        int item;
+        int itemPos;
+        quint16 accepted;
+        quint16 rejected;
+        bool stalled;
+        bool closed;
+    };
+
+    void addClient(QIODevice *device);
+    Client *findClient(QObject *device) const;
+    void readClient(Client *client);
+    void process(Client *client);
+    int processBatch(Client *client, int type, const uchar *body, int len);
+    void sendAck(Client *client, quint32 id, quint8 status);
+
+    SharedPayload *m_pShared;
+    CAPNSd *m_pDaemon;
+    QString m_sSocketPath;
+    quint16 m_iTcpPort;
+    QLocalServer *m_pLocalServer;
+    QTcpServer *m_pTcpServer;
+    QTimer *m_pRetryTimer;
+    QList<Client*> m_clients;
+};
+
+#endif // CINGESTSERVER_H
@@ -0,0 +1,261 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "clogger.h"
+#include "config.h"
+#include <QTimer>
+#include <syslog.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *eventNames[LOG_EVENTS] =
+{
+    "general",
+    "connection",
+    "socket_error",
+    "error_response",
+    "drain",
+    "ingest",
+    "report"
+};
+
+CLogger::CLogger(bool bSyslog) :
+    QObject(0), m_bSyslog(bSyslog)
+{
+    m_pTimer = 0;
+    m_iRateLimit = LOG_DEFAULT_RATE_LIMIT;
+    m_iStopped = 0;
+
+    m_pRing = new LogRecord[LOG_RING_SIZE];
+    for (quint32 i=0;i<LOG_RING_SIZE;i++)
+        m_pRing[i].sequence = i;
+    m_iHead = 0;
+    m_iTail = 0;
+    m_iDropped = 0;
+    m_iLastSummary = 0;
+    memset(m_limits,0,sizeof(m_limits));
+}
+
+CLogger::~CLogger()
+{
+    delete[] m_pRing;
+}
+
+void CLogger::setRateLimit(int limit)
+{
+    __atomic_store_n(&m_iRateLimit,qMax(limit,0),__ATOMIC_RELAXED);
+}
+
+void CLogger::start()
+{
+    m_pTimer = new QTimer(this);
+    m_pTimer->setInterval(50);
+    connect(m_pTimer,SIGNAL(timeout()),this,SLOT(flush()));
+    m_pTimer->start();
+}
+
+void CLogger::stop()
+{
+    __atomic_store_n(&m_iStopped,1,__ATOMIC_RELEASE);
+    //report what was held back in the last second too
+    m_iLastSummary = 0;
+    flush();
+}
+
+//approximate, writers racing at a second boundary may get a few more lines through
+bool CLogger::admit(int event, quint64 second)
+{
+    int limit = __atomic_load_n(&m_iRateLimit,__ATOMIC_RELAXED);
+    if (!limit)
+        return true;
+
+    LogLimit &l = m_limits[event];
+    quint64 current = __atomic_load_n(&l.second,__ATOMIC_RELAXED);
+    if (current != second && __atomic_compare_exchange_n(&l.second,&current,second,false,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+        __atomic_store_n(&l.count,0,__ATOMIC_RELAXED);
+
+    if (__atomic_add_fetch(&l.count,1,__ATOMIC_RELAXED) <= (quint32)limit)
+        return true;
+    __atomic_add_fetch(&l.suppressed,1,__ATOMIC_RELAXED);
+    return false;
+}
+
+void CLogger::write(int type, int event, int conn, const QString &msg)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME,&ts);
+
+    if (event < 0 || event >= LOG_EVENTS)
+        event = LOG_EVENT_GENERAL;
+    if (!admit(event,ts.tv_sec))
+        return;
+
+    QByteArray text = msg.toUtf8();
+
+    LogRecord *record;
+    quint32 pos = __atomic_load_n(&m_iHead,__ATOMIC_RELAXED);
+    for (;;)
+    {
+        record = &m_pRing[pos & (LOG_RING_SIZE - 1)];
+        quint32 seq = __atomic_load_n(&record->sequence,__ATOMIC_ACQUIRE);
+        qint32 diff = (qint32)(seq - pos);
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&m_iHead,&pos,pos + 1,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            __atomic_add_fetch(&m_iDropped,1,__ATOMIC_RELAXED);
+            return;
+        }
+        else
+            pos = __atomic_load_n(&m_iHead,__ATOMIC_RELAXED);
+    }
+
+    record->type = type;
+    record->event = event;
+    record->conn = conn;
+    record->time = (quint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    record->length = qMin(text.size(),LOG_TEXT_SIZE);
+    memcpy(record->text,text.constData(),record->length);
+    __atomic_store_n(&record->sequence,pos + 1,__ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&m_iStopped,__ATOMIC_ACQUIRE))
+        flush();
+}
+
+static const char *levelName(int type)
+{
+    if (type <= LOG_ERR)
+        return "error";
+    if (type == LOG_WARNING)
+        return "warning";
+    return "info";
+}
+
+//level=.. event=.. [conn=..] msg="..", quotes and control characters escaped
+static int formatLine(char *buf, int size, int type, int event, int conn, const char *text, int length)
+{
+    int n;
+    if (conn >= 0)
+        n = snprintf(buf,size,"level=%s event=%s conn=%d msg=\"",levelName(type),eventNames[event],conn);
+    else
+        n = snprintf(buf,size,"level=%s event=%s msg=\"",levelName(type),eventNames[event]);
+
+    for (int i=0;i<length && n < size - 3;i++)
+    {
+        char c = text[i];
+        if (c == '"' || c == '\\')
+        {
+            buf[n++] = '\\';
+            buf[n++] = c;
+        }
+        else if ((uchar)c < 0x20)
+            buf[n++] = ' ';
+        else
+            buf[n++] = c;
+    }
+    buf[n++] = '"';
+    buf[n] = 0;
+    return n;
+}
+
+void CLogger::output(int type, quint64 time, const char *line, int length, QByteArray *out)
+{
+    if (m_bSyslog)
+    {
+        syslog(type,"%s",line);
+        return;
+    }
+
+    time_t sec = time / 1000000000ULL;
+    struct tm tm;
+    gmtime_r(&sec,&tm);
+    char stamp[48];
+    int n = strftime(stamp,sizeof(stamp),"time=%Y-%m-%dT%H:%M:%S",&tm);
+    n += snprintf(stamp + n,sizeof(stamp) - n,".%03dZ ",(int)(time % 1000000000ULL / 1000000));
+
+    out->append(stamp,n);
+    out->append(line,length);
+    out->append('\n');
+}
+
+//one line per event and second with the number of lines the rate limit held back
+void CLogger::summarize(quint64 second, QByteArray *out)
+{
+    if (second == m_iLastSummary)
+        return;
+    m_iLastSummary = second;
+
+    char line[128];
+    for (int i=0;i<LOG_EVENTS;i++)
+    {
+        quint32 n = __atomic_exchange_n(&m_limits[i].suppressed,0,__ATOMIC_RELAXED);
+        if (!n)
+            continue;
+        int length = snprintf(line,sizeof(line),"level=warning event=%s suppressed=%u",eventNames[i],n);
+        output(LOG_WARNING,second * 1000000000ULL,line,length,out);
+    }
+
+    quint32 dropped = __atomic_exchange_n(&m_iDropped,0,__ATOMIC_RELAXED);
+    if (dropped)
+    {
+        int length = snprintf(line,sizeof(line),"level=warning event=general dropped=%u msg=\"log ring full\"",dropped);
+        output(LOG_WARNING,second * 1000000000ULL,line,length,out);
+    }
+}
+
+//the only consumer, runs in the logger thread until stop()
+void CLogger::flush()
+{
+    QByteArray out;
+    char line[LOG_TEXT_SIZE * 2 + 96];
+
+    for (;;)
+    {
+        LogRecord *record = &m_pRing[m_iTail & (LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&record->sequence,__ATOMIC_ACQUIRE) != m_iTail + 1)
+            break;
+
+        int length = formatLine(line,sizeof(line),record->type,record->event,record->conn,record->text,record->length);
+        output(record->type,record->time,line,length,&out);
+
+        __atomic_store_n(&record->sequence,m_iTail + LOG_RING_SIZE,__ATOMIC_RELEASE);
+        m_iTail++;
+    }
+
+    summarize((quint64)::time(0),&out);
+
+    const char *d = out.constData();
+    int left = out.size();
+    while (left > 0)
+    {
+        ssize_t n = ::write(STDOUT_FILENO,d,left);
+        if (n <= 0)
+            break;
+        d += n;
+        left -= n;
+    }
+}
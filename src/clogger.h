@@ -0,0 +1,115 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CLOGGER_H
+#define CLOGGER_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+
+#define LOG_RING_SIZE 4096
+#define LOG_TEXT_SIZE 224
+
+//message types, each has its own rate limit
+enum LogEvent
+{
+    LOG_EVENT_GENERAL,
+    LOG_EVENT_CONNECTION,
+    LOG_EVENT_SOCKET_ERROR,
+    LOG_EVENT_ERROR_RESPONSE,
+    LOG_EVENT_DRAIN,
+    LOG_EVENT_INGEST,
+    LOG_EVENT_REPORT,
+    LOG_EVENTS
+};
+
+struct LogRecord
+{
+    quint32 sequence;
+    qint16 type;
+    qint16 event;
+    qint32 conn;
+    quint32 length;
+    quint64 time; //CLOCK_REALTIME ns
+    char text[LOG_TEXT_SIZE];
+};
+
+struct LogLimit
+{
+    quint64 second;
+    quint32 count;
+    quint32 suppressed;
+};
+
+class QTimer;
+
+/*
+ * Log lines are copied into a bounded multi-producer ring (the same slot
+ * sequence scheme as the shared payload rings) and written by the logger
+ * thread, syslog or stdout is never touched from the send path. A full
+ * ring drops the line instead of waiting.
+ *
+ * Each event type may log log_rate_limit lines per second, the rest is
+ * counted and reported once a second as a suppressed= line.
+ *
+ * Lines are key=value: time level event conn msg.
+ */
+class CLogger : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CLogger(bool bSyslog);
+    ~CLogger();
+
+    //lines per second per event, 0 = no limit
+    void setRateLimit(int limit);
+
+    //any thread, never blocks
+    void write(int type, int event, int conn, const QString &msg);
+
+    //after the logger thread stopped, later lines are written right away
+    void stop();
+
+public slots:
+    void start();
+    void flush();
+
+private:
+    bool admit(int event, quint64 second);
+    void output(int type, quint64 time, const char *line, int length, QByteArray *out);
+    void summarize(quint64 second, QByteArray *out);
+
+    bool m_bSyslog;
+    QTimer *m_pTimer;
+    int m_iRateLimit;
+    int m_iStopped;
+
+    LogRecord *m_pRing;
+    quint32 m_iHead;
+    quint32 m_iTail;
+    quint32 m_iDropped;
+    quint64 m_iLastSummary;
+
+    LogLimit m_limits[LOG_EVENTS];
+};
+
+#endif // CLOGGER_H
@@ -0,0 +1,281 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "config.h"
+#include "shared.h"
+#include <QSettings>
+#include <QFile>
+
+//app names end up in metric labels and section names, keep them plain
+static bool validAppName(const QString &name)
+{
+    QByteArray utf8 = name.toUtf8();
+    if (utf8.isEmpty() || utf8.size() >= PAYLOAD_APP_NAME_MAX)
+        return false;
+    for (int i=0;i<utf8.size();i++)
+    {
+        char c = utf8[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '.' || c == '_' || c == '-'))
+            return false;
+    }
+    return true;
+}
+
+//credentials and pool of one app from the current settings group
+static bool loadProfile(QSettings &settings, AppProfile *app, bool credentials, QString *error)
+{
+    app->poolSize = qBound(1,settings.value("pool_size",1).toInt(),CONNECTION_POOL_MAX);
+    app->weight = qBound(1,settings.value("weight",1).toInt(),100);
+    if (!credentials)
+        return true;
+
+    QString section = app->name == "default" ? QString() : " [" + app->name + "]";
+    if (!(settings.contains("local_cert_file") && settings.contains("private_key_passprase") && settings.contains("private_key_file")))
+    {
+        *error = "Missing certificate settings" + section + ".";
+        return false;
+    }
+
+    const char *files[] = { "local_cert_file", "private_key_file" };
+    const char *names[] = { "local certificate", "private key" };
+    for (int i=0;i<2;i++)
+    {
+        QString file = settings.value(files[i]).toString();
+        if (!QFile(file).exists())
+        {
+            *error = QString("Could not find ") + names[i] + " file" + section + ". (" + file + ")";
+            return false;
+        }
+    }
+
+    QList<QSslCertificate> cert = QSslCertificate::fromPath(settings.value("local_cert_file").toString());
+    if (cert.isEmpty())
+    {
+        *error = "No certificate in " + settings.value("local_cert_file").toString() + ".";
+        return false;
+    }
+
+    QFile keyfile(settings.value("private_key_file").toString());
+    if (keyfile.open(QIODevice::ReadOnly))
+        app->key = QSslKey(keyfile.readAll(),QSsl::Rsa,QSsl::Pem,QSsl::PrivateKey,settings.value("private_key_passprase").toByteArray());
+    if (app->key.isNull())
+    {
+        *error = "Could not read private key " + keyfile.fileName() + ".";
+        return false;
+    }
+
+    app->cert = cert[0];
+    return true;
+}
+
+bool Config::createDefault(const QString &path)
+{
+    QSettings settings(path,QSettings::IniFormat);
+
+    if (settings.contains("local_cert_file") && settings.contains("private_key_passprase") && settings.contains("private_key_file")
+            && settings.contains("apns_server") && settings.contains("apns_server_port") && settings.contains("root_cert_file"))
+        return false;
+
+    settings.setValue("local_cert_file",QVariant("/sslcerts/cert.pem"));
+    settings.setValue("root_cert_file",QVariant("/sslcerts/entrust_2048_ca.cer"));
+    settings.setValue("private_key_file",QVariant("/sslcerts/pk.pem"));
+    settings.setValue("private_key_passprase",QVariant(QByteArray("1234")));
+    settings.setValue("apns_server",QVariant("gateway.sandbox.push.apple.com"));
+    settings.setValue("apns_server_port",QVariant(2195));
+    settings.sync();
+    return true;
+}
+
+/*
+ * Without credentials the certificates and keys are not read, for the
+ * command line tools that only need the other settings and may run as a
+ * user who cannot read the keys.
+ */
+Config *Config::load(const QString &path, QString *error, bool credentials)
+{
+    QSettings settings(path,QSettings::IniFormat);
+
+    if (!(settings.contains("apns_server") && settings.contains("apns_server_port") && settings.contains("root_cert_file")))
+    {
+        *error = "Missing settings in " + path + ".";
+        return 0;
+    }
+
+    if (credentials && !QFile(settings.value("root_cert_file").toString()).exists())
+    {
+        *error = "Could not find root ca certificate file. (" + settings.value("root_cert_file").toString() + ")";
+        return 0;
+    }
+
+    //an empty apps= reads as one empty name
+    QStringList names("default");
+    QStringList listed = settings.value("apps").toStringList();
+    for (int i=0;i<listed.size();i++)
+        if (!listed[i].trimmed().isEmpty())
+            names << listed[i].trimmed();
+    if (names.size() > PAYLOAD_APPS_MAX)
+    {
+        *error = "More than " + QString::number(PAYLOAD_APPS_MAX) + " apps.";
+        return 0;
+    }
+
+    QList<AppProfile> apps;
+    int connections = 0;
+    for (int i=0;i<names.size();i++)
+    {
+        AppProfile app;
+        app.name = names[i];
+        if (!validAppName(app.name) || names.indexOf(app.name) != i)
+        {
+            *error = "Invalid app name \"" + app.name + "\".";
+            return 0;
+        }
+        //profile 0 is the top level, the others their own [name] section
+        if (i > 0)
+            settings.beginGroup(app.name);
+        bool ok = loadProfile(settings,&app,credentials,error);
+        if (i > 0)
+            settings.endGroup();
+        if (!ok)
+            return 0;
+        connections += app.poolSize;
+        apps << app;
+    }
+    if (connections > CONNECTION_POOL_MAX)
+    {
+        *error = "More than " + QString::number(CONNECTION_POOL_MAX) + " connections over all apps.";
+        return 0;
+    }
+
+    int protocol = settings.value("push_protocol",0).toInt();
+    if (protocol != 0 && protocol != 2)
+    {
+        *error = "Unsupported push_protocol " + QString::number(protocol) + ", use 0 or 2.";
+        return 0;
+    }
+
+    Config *config = new Config;
+    config->server = settings.value("apns_server").toString();
+    config->port = settings.value("apns_server_port").toInt();
+    if (credentials)
+        config->caCerts = QSslCertificate::fromPath(settings.value("root_cert_file").toString());
+    config->apps = apps;
+
+    config->payloadQueueSize = SharedPayload::roundCapacity(settings.value("queue_size",PAYLOAD_QUEUE_DEFAULT_SIZE).toUInt());
+    config->arenaSize = SharedPayload::roundArenaSize(settings.value("arena_size",PAYLOAD_ARENA_DEFAULT_SIZE).toULongLong());
+    //percent of the arena one app may hold, by default an equal share
+    int share = qBound(1,settings.value("arena_app_share",100 / apps.size()).toInt(),100);
+    config->arenaQuota = share < 100 ? (quint64)config->arenaSize * share / 100 : 0;
+
+    config->protocol = protocol;
+    config->maxWriteSize = qMax(settings.value("max_write_size",65536).toInt(),1024);
+    //socket buffer limits, the high mark holds at least one full write
+    config->highWater = qMax(settings.value("write_high_water",1024 * 1024).toLongLong(),(qint64)config->maxWriteSize);
+    config->lowWater = qBound((qint64)0,settings.value("write_low_water",256 * 1024).toLongLong(),config->highWater);
+    config->backoffMin = qMax(settings.value("reconnect_backoff_min",100).toInt(),1);
+    config->backoffMax = qMax(settings.value("reconnect_backoff_max",30000).toInt(),config->backoffMin);
+    config->standby = settings.value("standby_connection",false).toBool();
+    //0 or a negative size would leave the window or the queues without room
+    config->windowFrames = qBound(1,settings.value("inflight_window",INFLIGHT_DEFAULT_FRAMES).toInt(),INFLIGHT_MAX_FRAMES);
+    config->windowBytes = qBound(65536,settings.value("inflight_window_bytes",INFLIGHT_DEFAULT_BYTES).toInt(),INFLIGHT_MAX_BYTES);
+    config->queueSize = qBound(2,settings.value("connection_queue_size",CONNECTION_QUEUE_DEFAULT_SIZE).toInt(),CONNECTION_QUEUE_MAX_SIZE);
+    config->sharding = SHARD_TOKEN_HASH;
+    if (settings.value("pool_sharding","token").toString() == "least_outstanding")
+        config->sharding = SHARD_LEAST_OUTSTANDING;
+    config->reportNs = settings.value("latency_report_interval",60).toULongLong() * 1000000000ULL;
+
+    config->spoolDir = settings.value("spool_dir").toString();
+    config->spoolSegmentSize = settings.value("spool_segment_size",SPOOL_DEFAULT_SEGMENT_SIZE).toLongLong();
+    config->spoolSyncInterval = qMax(settings.value("spool_sync_interval",200).toInt(),1);
+    config->blocklistFile = settings.value("blocklist_file").toString();
+    //payloads per second moved out of the timing wheel once due, 0 = no limit
+    config->releaseRate = settings.value("scheduled_release_rate",5000).toInt();
+    config->broadcastDir = settings.value("broadcast_dir",BROADCAST_DEFAULT_DIR).toString();
+    config->ingestSocket = settings.value("ingest_socket",INGEST_DEFAULT_SOCKET).toString();
+    config->ingestTcpPort = settings.value("ingest_tcp_port",0).toUInt();
+    config->feedbackInterval = settings.value("feedback_interval",3600).toInt();
+    config->logRateLimit = settings.value("log_rate_limit",LOG_DEFAULT_RATE_LIMIT).toInt();
+    config->statsSocket = settings.value("stats_socket").toString();
+    config->statsPort = settings.value("stats_port",0).toUInt();
+    config->captureFile = settings.value("capture_file").toString();
+
+    return config;
+}
+
+/*
+ * The shared segment is laid out before the threads start, queue sizes
+ * and the frame format are fixed once the connection threads run, the
+ * spool, blocklist and sockets are opened once.
+ */
+QStringList Config::restartOnly(const Config &running) const
+{
+    QStringList changed;
+    if (!sameApps(running))
+        changed << "apps";
+    if (payloadQueueSize != running.payloadQueueSize)
+        changed << "queue_size";
+    if (arenaSize != running.arenaSize)
+        changed << "arena_size";
+    if (arenaQuota != running.arenaQuota)
+        changed << "arena_app_share";
+    if (protocol != running.protocol)
+        changed << "push_protocol";
+    if (windowFrames != running.windowFrames || windowBytes != running.windowBytes)
+        changed << "inflight_window";
+    if (queueSize != running.queueSize)
+        changed << "connection_queue_size";
+    if (spoolDir != running.spoolDir || spoolSegmentSize != running.spoolSegmentSize || spoolSyncInterval != running.spoolSyncInterval)
+        changed << "spool_dir";
+    if (blocklistFile != running.blocklistFile)
+        changed << "blocklist_file";
+    if (broadcastDir != running.broadcastDir)
+        changed << "broadcast_dir";
+    if (ingestSocket != running.ingestSocket || ingestTcpPort != running.ingestTcpPort)
+        changed << "ingest_socket";
+    if (statsSocket != running.statsSocket || statsPort != running.statsPort)
+        changed << "stats_port";
+    return changed;
+}
+
+//false when connections of the app have to be reestablished for the new settings
+bool Config::sameGateway(const Config &other, int app) const
+{
+    return server == other.server && port == other.port && caCerts == other.caCerts && app < apps.size()
+            && app < other.apps.size() && apps[app].cert == other.apps[app].cert && apps[app].key == other.apps[app].key;
+}
+
+bool Config::sameApps(const Config &other) const
+{
+    if (apps.size() != other.apps.size())
+        return false;
+    for (int i=0;i<apps.size();i++)
+        if (apps[i].name != other.apps[i].name)
+            return false;
+    return true;
+}
+
+int Config::connections() const
+{
+    int total = 0;
+    for (int i=0;i<apps.size();i++)
+        total += apps[i].poolSize;
+    return total;
+}
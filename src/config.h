@@ -0,0 +1,131 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <QString>
+#include <QStringList>
+#include <QByteArray>
+#include <QList>
+#include <QSslCertificate>
+#include <QSslKey>
+#include <QSharedPointer>
+#include <QMetaType>
+
+#define APNSD_CONFIG_FILE "/etc/APNSd.cfg"
+
+//defaults and limits of the settings, the pipeline classes start out with them too
+#define CONNECTION_POOL_MAX 128
+#define CONNECTION_QUEUE_DEFAULT_SIZE 8192
+#define CONNECTION_QUEUE_MAX_SIZE 1048576
+#define INFLIGHT_DEFAULT_FRAMES 16384
+#define INFLIGHT_MAX_FRAMES 1048576
+#define INFLIGHT_DEFAULT_BYTES (4 * 1024 * 1024)
+#define INFLIGHT_MAX_BYTES (256 * 1024 * 1024)
+#define SPOOL_DEFAULT_SEGMENT_SIZE (64 * 1024 * 1024)
+#define BROADCAST_DEFAULT_DIR "/tmp/APNSdBroadcast"
+#define INGEST_DEFAULT_SOCKET "/tmp/APNSd.sock"
+#define LOG_DEFAULT_RATE_LIMIT 50
+
+//how the drain picks a connection of an app's pool
+enum Sharding
+{
+    SHARD_TOKEN_HASH,
+    SHARD_LEAST_OUTSTANDING
+};
+
+/*
+ * One app (bundle id) on the gateway: its own client certificate, its own
+ * connections and a weight for its share of the drain. Profile 0 is
+ * "default" from the top level settings, others come from [name] sections.
+ */
+struct AppProfile
+{
+    QString name;
+    QSslCertificate cert;
+    //read at load, certificates are usually replaced under the same name
+    QSslKey key;
+    int poolSize;
+    int weight;
+};
+
+/*
+ * /etc/APNSd.cfg parsed and checked once. A snapshot never changes after
+ * load(), SIGHUP loads a new one and hands it to the pipeline threads, so
+ * no thread reads the file or sees a half updated configuration.
+ */
+struct Config
+{
+    QString server;
+    int port;
+    QList<QSslCertificate> caCerts;
+    //same order as the queue rings, index is the payload app
+    QList<AppProfile> apps;
+    //layout of the shared segment, rounded like SharedPayload::init() needs
+    quint32 payloadQueueSize;
+    size_t arenaSize;
+    quint64 arenaQuota;
+
+    int protocol;
+    int maxWriteSize;
+    qint64 highWater;
+    qint64 lowWater;
+    int backoffMin;
+    int backoffMax;
+    bool standby;
+    int windowFrames;
+    int windowBytes;
+    quint32 queueSize;
+    int sharding;
+    quint64 reportNs;
+
+    QString spoolDir;
+    qint64 spoolSegmentSize;
+    int spoolSyncInterval;
+    QString blocklistFile;
+    int releaseRate;
+    QString broadcastDir;
+    QString ingestSocket;
+    quint16 ingestTcpPort;
+    int feedbackInterval;
+    int logRateLimit;
+    QString statsSocket;
+    quint16 statsPort;
+    QString captureFile;
+
+    //0 and error set when a setting is missing or a certificate unusable
+    static Config *load(const QString &path, QString *error, bool credentials = true);
+    //writes placeholder settings when the gateway settings are missing
+    static bool createDefault(const QString &path);
+
+    //settings that differ from running but only apply on a restart
+    QStringList restartOnly(const Config &running) const;
+    bool sameGateway(const Config &other, int app) const;
+    //same app names in the same order, the queue rings depend on it
+    bool sameApps(const Config &other) const;
+    int connections() const;
+};
+
+typedef QSharedPointer<const Config> ConfigSnapshot;
+Q_DECLARE_METATYPE(ConfigSnapshot)
+
+#endif // CONFIG_H
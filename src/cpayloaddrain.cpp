@@ -0,0 +1,1118 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "cpayloaddrain.h"
+#include "cgatewayconnection.h"
+#include "capnsd.h"
+#include "cbroadcastjob.h"
+#include "shared.h"
+#include "latency.h"
+#include <QSocketNotifier>
+#include <QTimer>
+#include <QDir>
+#include <QFileSystemWatcher>
+#include <QtEndian>
+#include <syslog.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+CPayloadDrain::CPayloadDrain(SharedPayload *shared, CAPNSd *daemon) :
+    QObject(0), m_pShared(shared), m_pDaemon(daemon)
+{
+    m_pStats = daemon->stats();
+    m_iSharding = SHARD_TOKEN_HASH;
+    m_iNextApp = 0;
+    m_iWakeFd = -1;
+    m_iWakeWriteFd = -1;
+    m_psnWake = 0;
+    m_pSyncTimer = 0;
+    m_iSyncInterval = 200;
+    for (int i=0;i<PAYLOAD_RINGS_MAX;i++)
+    {
+        m_iHeldSeq[i] = 0;
+        m_iCaptureNext[i] = 0;
+        m_iReleasedSeq[i] = 0;
+        m_stalled[i] = false;
+    }
+    m_pWheelTimer = 0;
+    m_iReleaseRate = 0;
+    m_iRejournalSeq = 0;
+    m_fReleaseBudget = 0;
+    m_iLastRelease = 0;
+    m_pBroadcastWatcher = 0;
+    m_pBroadcastTimer = 0;
+    m_pBroadcast = 0;
+    m_iBroadcastNext = 0;
+    m_iBroadcastBlocked = 0;
+    m_iBroadcastExpired = 0;
+}
+
+CPayloadDrain::~CPayloadDrain()
+{
+    delete m_pBroadcast;
+    if (m_iWakeFd >= 0)
+    {
+        ::close(m_iWakeFd);
+        ::close(m_iWakeWriteFd);
+        ::unlink(APNSD_WAKEUP_FIFO);
+    }
+}
+
+void CPayloadDrain::setConnections(const QList<CGatewayConnection*> &connections, const Config &config)
+{
+    m_connections = connections;
+    m_iSharding = config.sharding;
+    setPools(config);
+    m_firstSeq.fill(0,connections.size() * PAYLOAD_CLASSES);
+    m_lastSeq.fill(0,connections.size() * PAYLOAD_CLASSES);
+    m_enqueued.fill(0,connections.size() * PAYLOAD_CLASSES);
+    m_consumed.fill(0,connections.size() * PAYLOAD_CLASSES);
+}
+
+//groups the connections by app, the first pool size ones of an app are active
+void CPayloadDrain::setPools(const Config &config)
+{
+    m_pools.resize(config.apps.size());
+    for (int a=0;a<m_pools.size();a++)
+    {
+        m_pools[a].connections.clear();
+        m_pools[a].weight = config.apps[a].weight;
+    }
+    for (int i=0;i<m_connections.size();i++)
+        if (m_connections[i]->app() < m_pools.size())
+            m_pools[m_connections[i]->app()].connections.append(m_connections[i]);
+    for (int a=0;a<m_pools.size();a++)
+        m_pools[a].active = qMin(config.apps[a].poolSize,m_pools[a].connections.size());
+    m_deferred.resize(m_pools.size());
+}
+
+/*
+ * New connections get fresh lanes. Shrinking the pool retires the last
+ * connections, they keep their lanes until what they hold is written.
+ */
+void CPayloadDrain::applyConfig(const ConfigSnapshot &config, const QList<CGatewayConnection*> &connections)
+{
+    m_iReleaseRate = config->releaseRate;
+    m_iSharding = config->sharding;
+    if (config->captureFile != m_sCaptureFile)
+        setCapture(config->captureFile);
+
+    if (connections.size() > m_connections.size())
+    {
+        int lanes = m_firstSeq.size();
+        m_connections = connections;
+        m_firstSeq.resize(connections.size() * PAYLOAD_CLASSES);
+        m_lastSeq.resize(connections.size() * PAYLOAD_CLASSES);
+        m_enqueued.resize(connections.size() * PAYLOAD_CLASSES);
+        m_consumed.resize(connections.size() * PAYLOAD_CLASSES);
+        for (int i=lanes;i<m_firstSeq.size();i++)
+        {
+            m_firstSeq[i] = 0;
+            m_lastSeq[i] = 0;
+            m_enqueued[i] = 0;
+            m_consumed[i] = 0;
+        }
+        //sized for the old lanes, queued payloads just won't collapse anymore
+        m_collapse = CCollapseIndex();
+    }
+
+    //new connections start out active
+    QVector<bool> retired(m_connections.size(),false);
+    for (int a=0;a<m_pools.size();a++)
+        for (int i=m_pools[a].active;i<m_pools[a].connections.size();i++)
+            retired[m_pools[a].connections[i]->index()] = true;
+
+    setPools(*config);
+
+    //nothing is queued on a retired connection after this
+    for (int a=0;a<m_pools.size();a++)
+        for (int i=0;i<m_pools[a].connections.size();i++)
+        {
+            CGatewayConnection *conn = m_pools[a].connections[i];
+            if ((i >= m_pools[a].active) != retired[conn->index()])
+                QMetaObject::invokeMethod(conn,"setRetired",Qt::QueuedConnection,Q_ARG(bool,i >= m_pools[a].active));
+        }
+
+    checkPayloads();
+}
+
+//called before the drain moves to its thread, start() creates the notifier
+bool CPayloadDrain::openWakeupFifo()
+{
+    ::unlink(APNSD_WAKEUP_FIFO);
+
+    if (::mkfifo(APNSD_WAKEUP_FIFO,0600) < 0)
+        return false;
+    //APNSd push may run as any user
+    ::chmod(APNSD_WAKEUP_FIFO,0666);
+
+    m_iWakeFd = ::open(APNSD_WAKEUP_FIFO,O_RDONLY | O_NONBLOCK);
+    if (m_iWakeFd < 0)
+        return false;
+
+    //keep a writer open so the fifo never reports end of file
+    m_iWakeWriteFd = ::open(APNSD_WAKEUP_FIFO,O_WRONLY | O_NONBLOCK);
+    if (m_iWakeWriteFd < 0)
+    {
+        ::close(m_iWakeFd);
+        m_iWakeFd = -1;
+        return false;
+    }
+
+    return true;
+}
+
+//called before the drain moves to its thread, records past the checkpoint are resent first
+bool CPayloadDrain::openSpool(const QString &dir, qint64 segmentSize, int syncInterval, QString *error)
+{
+    m_iSyncInterval = syncInterval;
+    if (!m_spool.open(dir,segmentSize,error))
+        return false;
+
+    for (int i=0;i<m_spool.skipped().size();i++)
+        m_pDaemon->log(LOG_ALERT,m_spool.skipped()[i] + " The file is kept, its payloads are not resent.",LOG_EVENT_DRAIN);
+    return true;
+}
+
+//called before the drain moves to its thread
+bool CPayloadDrain::openBlocklist(const QString &path, QString *error)
+{
+    return m_blocklist.open(path,error);
+}
+
+void CPayloadDrain::blockTokens(const QByteArray &records)
+{
+    const uchar *d = reinterpret_cast<const uchar*>(records.constData());
+    int added = 0;
+
+    for (int pos=0;pos + PAYLOAD_TOKEN_SIZE + 4 <= records.size();pos += PAYLOAD_TOKEN_SIZE + 4)
+        if (m_blocklist.add(d + pos,qFromBigEndian<quint32>(d + pos + PAYLOAD_TOKEN_SIZE)))
+            added++;
+
+    m_blocklist.flush();
+
+    if (added)
+        m_pDaemon->log(LOG_INFO,"Added " + QString::number(added) + " devices to the blocklist (" + QString::number(m_blocklist.size()) + " total).");
+}
+
+//also drops payloads of an app without a pool
+bool CPayloadDrain::blocked(const PayloadData *payload) const
+{
+    return payload->app >= m_pools.size() || (!m_blocklist.isEmpty() && m_blocklist.contains(payload->device));
+}
+
+void CPayloadDrain::start()
+{
+    m_psnWake = new QSocketNotifier(m_iWakeFd, QSocketNotifier::Read, this);
+    connect(m_psnWake, SIGNAL(activated(int)), this, SLOT(wakeup()));
+
+    m_pSyncTimer = new QTimer(this);
+    m_pSyncTimer->setSingleShot(true);
+    m_pSyncTimer->setInterval(m_iSyncInterval);
+    connect(m_pSyncTimer, SIGNAL(timeout()), this, SLOT(syncSpool()));
+
+    //a single timer releases all scheduled payloads, it runs while any are waiting
+    m_wheel.start((quint32)::time(0));
+    m_pWheelTimer = new QTimer(this);
+    m_pWheelTimer->setInterval(100);
+    connect(m_pWheelTimer, SIGNAL(timeout()), this, SLOT(releaseScheduled()));
+
+    if (!m_sBroadcastDir.isEmpty())
+    {
+        m_pBroadcastTimer = new QTimer(this);
+        m_pBroadcastTimer->setInterval(1000);
+        connect(m_pBroadcastTimer, SIGNAL(timeout()), this, SLOT(markBroadcast()));
+
+        m_pBroadcastWatcher = new QFileSystemWatcher(this);
+        m_pBroadcastWatcher->addPath(m_sBroadcastDir);
+        connect(m_pBroadcastWatcher, SIGNAL(directoryChanged(QString)), this, SLOT(scanBroadcasts()));
+
+        //resumes a broadcast interrupted by a restart
+        scanBroadcasts();
+    }
+
+    checkPayloads();
+}
+
+void CPayloadDrain::wakeup()
+{
+    char tmp[64];
+    while (::read(m_iWakeFd, tmp, sizeof(tmp)) > 0);
+
+    checkPayloads();
+}
+
+static inline quint32 tokenHash(const uchar *device)
+{
+    //FNV-1a
+    quint32 h = 2166136261U;
+    for (int i=0;i<PAYLOAD_TOKEN_SIZE;i++)
+    {
+        h ^= device[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/*
+ * Tokens stick to one connection of their app so notifications for a
+ * device keep their order, unless that connection is down. With
+ * least_outstanding sharding the connection with the fewest unsent bytes
+ * is used.
+ */
+CGatewayConnection *CPayloadDrain::pickConnection(const PayloadData *payload) const
+{
+    const AppPool &pool = m_pools[payload->app];
+    int n = pool.active;
+    if (n == 0)
+        return 0;
+
+    if (m_iSharding == SHARD_LEAST_OUTSTANDING)
+    {
+        CGatewayConnection *best = 0;
+        qint64 bestbytes = 0;
+        for (int i=0;i<n;i++)
+        {
+            CGatewayConnection *conn = pool.connections[i];
+            if (!conn->isReady())
+                continue;
+            qint64 bytes = conn->outstandingBytes();
+            if (!best || bytes < bestbytes)
+            {
+                best = conn;
+                bestbytes = bytes;
+            }
+        }
+        return best;
+    }
+
+    int start = tokenHash(payload->device) % n;
+    for (int i=0;i<n;i++)
+    {
+        CGatewayConnection *conn = pool.connections[(start + i) % n];
+        if (conn->isReady())
+            return conn;
+    }
+    return 0;
+}
+
+bool CPayloadDrain::anyConnectionReady() const
+{
+    for (int a=0;a<m_pools.size();a++)
+        for (int i=0;i<m_pools[a].active;i++)
+            if (m_pools[a].connections[i]->isReady())
+                return true;
+    return false;
+}
+
+void CPayloadDrain::spooled(CGatewayConnection *conn, const PayloadData *payload, quint64 seq)
+{
+    int i = conn->index() * PAYLOAD_CLASSES + payloadClass(payload->priority);
+    if (m_firstSeq[i] == 0)
+        m_firstSeq[i] = seq;
+    m_lastSeq[i] = seq;
+
+    if (!m_pSyncTimer->isActive())
+        m_pSyncTimer->start();
+}
+
+/*
+ * First spool sequence number not yet written by a connection. Payloads
+ * of a connection lane are queued in order, so everything it still holds
+ * lies past the last one it wrote.
+ */
+quint64 CPayloadDrain::checkpoint() const
+{
+    quint64 cp = m_spool.replaySeq();
+
+    for (int r=0;r<m_pShared->ringCount();r++)
+        if (m_iHeldSeq[r] && m_iHeldSeq[r] < cp)
+            cp = m_iHeldSeq[r];
+
+    if (!m_scheduled.isEmpty() && m_scheduled.firstKey() < cp)
+        cp = m_scheduled.firstKey();
+
+    for (int a=0;a<m_deferred.size();a++)
+        if (!m_deferred[a].isEmpty() && m_deferred[a].first().seq < cp)
+            cp = m_deferred[a].first().seq;
+
+    for (int i=0;i<m_lastSeq.size();i++)
+    {
+        quint64 written = m_connections[i / PAYLOAD_CLASSES]->writtenSeq(i % PAYLOAD_CLASSES);
+        if (written >= m_lastSeq[i])
+            continue;
+        quint64 pending = qMax(written + 1,m_firstSeq[i]);
+        if (pending < cp)
+            cp = pending;
+    }
+
+    return cp;
+}
+
+//group commit, repeats until the connections wrote everything journaled
+void CPayloadDrain::syncSpool()
+{
+    if (!m_scheduled.isEmpty() && m_scheduled.firstKey() < m_spool.segmentSeq() && m_iRejournalSeq != m_spool.segmentSeq())
+        rejournalScheduled();
+
+    m_spool.sync(checkpoint());
+
+    if (m_spool.dirty() || m_spool.checkpoint() < m_spool.nextSeq())
+        m_pSyncTimer->start();
+}
+
+void CPayloadDrain::setCapture(const QString &path)
+{
+    m_sCaptureFile = path;
+
+    if (m_trace.isOpen())
+    {
+        m_trace.close();
+        m_pDaemon->log(LOG_INFO,"Captured " + QString::number(m_trace.count()) + " payloads to " + m_trace.path() + ".",LOG_EVENT_DRAIN);
+    }
+
+    if (path.isEmpty())
+        return;
+
+    QString err;
+    if (!m_trace.open(path,&err))
+    {
+        m_pDaemon->log(LOG_ALERT,err,LOG_EVENT_DRAIN);
+        return;
+    }
+
+    //what is queued now is captured as queued at the start
+    for (int r=0;r<m_pShared->ringCount();r++)
+        m_iCaptureNext[r] = m_pShared->frontPos(r);
+    m_pDaemon->log(LOG_INFO,"Capturing ingested payloads to " + path + ".",LOG_EVENT_DRAIN);
+}
+
+/*
+ * Records the front payload of a ring the first time the drain sees it, a
+ * payload left in the ring for a full connection queue is seen again.
+ * Released ones were captured when they were scheduled.
+ */
+void CPayloadDrain::capture(int ring, const PayloadData *payload, bool released)
+{
+    quint32 pos = m_pShared->frontPos(ring);
+    if ((qint32)(pos - m_iCaptureNext[ring]) < 0)
+        return;
+    m_iCaptureNext[ring] = pos + 1;
+    if (released)
+        return;
+
+    m_trace.append(payload);
+    if (!m_trace.isOpen())
+        m_pDaemon->log(LOG_ALERT,"Could not write capture file " + m_sCaptureFile + ", capture stopped.",LOG_EVENT_DRAIN);
+}
+
+//seq is the journal record of the payload, 0 for none
+void CPayloadDrain::schedule(const PayloadData *payload, const char *json, quint64 seq)
+{
+    m_wheel.add(payload,json,seq);
+    if (seq)
+        m_scheduled.insert(seq,true);
+
+    if (!m_pWheelTimer->isActive())
+    {
+        m_iLastRelease = monotonicNs();
+        m_fReleaseBudget = 0;
+        m_pWheelTimer->start();
+    }
+}
+
+/*
+ * Journals the payloads in the timing wheel again whose records lie before
+ * the segment now appended to, the checkpoint then no longer waits for
+ * them. A crash before the checkpoint passed the old records replays both
+ * and the payload is sent twice.
+ */
+void CPayloadDrain::rejournalScheduled()
+{
+    quint64 before = m_spool.segmentSeq();
+    QVector<quint32> refs = m_wheel.journaledBefore(before);
+
+    for (int i=0;i<refs.size();i++)
+    {
+        const char *json;
+        quint64 old;
+        const PayloadData *payload = m_wheel.payload(refs[i],&json,&old);
+        quint64 seq = m_spool.append(payload,json);
+        if (!seq)
+        {
+            m_pDaemon->log(LOG_ALERT,"Spool full, " + QString::number(refs.size() - i) + " scheduled push payloads keep their old spool records.",LOG_EVENT_DRAIN);
+            return;
+        }
+        m_wheel.setSeq(refs[i],seq);
+        m_scheduled.remove(old);
+        m_scheduled.insert(seq,true);
+    }
+
+    m_iRejournalSeq = before;
+}
+
+/*
+ * True when the front payload of a ring came out of the timing wheel, its
+ * journal record is held until unschedule().
+ */
+bool CPayloadDrain::takeReleased(int ring, quint64 *seq)
+{
+    quint32 pos = m_pShared->frontPos(ring);
+    QList<Released> &released = m_released[ring];
+
+    while (!released.isEmpty() && (qint32)(released.first().pos - pos) < 0)
+        released.removeFirst();
+    if (released.isEmpty() || released.first().pos != pos)
+        return false;
+
+    *seq = released.first().seq;
+    released.removeFirst();
+    m_iReleasedSeq[ring] = *seq;
+    return true;
+}
+
+//the released front payload was journaled again or dropped
+void CPayloadDrain::unschedule(int ring)
+{
+    if (!m_iReleasedSeq[ring])
+        return;
+    m_scheduled.remove(m_iReleasedSeq[ring]);
+    m_iReleasedSeq[ring] = 0;
+}
+
+/*
+ * Moves due payloads from the timing wheel back into the shared queue, so
+ * they take the same path as any other payload. Without a release rate
+ * everything due goes at once, otherwise the budget grows with the rate
+ * and holds at most one tick's worth.
+ */
+void CPayloadDrain::releaseScheduled()
+{
+    quint64 now = monotonicNs();
+    m_wheel.advance((quint32)::time(0));
+
+    if (m_iReleaseRate > 0)
+    {
+        double cap = qMax(m_iReleaseRate / 10.0,1.0);
+        m_fReleaseBudget = qMin(m_fReleaseBudget + (now - m_iLastRelease) / 1e9 * m_iReleaseRate,cap);
+    }
+    m_iLastRelease = now;
+
+    const PayloadData *due;
+    const char *json;
+    quint64 seq;
+    int released = 0;
+
+    while ((m_iReleaseRate <= 0 || m_fReleaseBudget >= 1) && (due = m_wheel.due(&json,&seq)) != 0)
+    {
+        //arena or ring full, the next tick tries again
+        quint32 block = m_pShared->allocPayload(due->length,due->app);
+        if (block == PAYLOAD_NO_BLOCK)
+            break;
+        quint32 pos;
+        int ring = payloadRing(due->app,due->priority);
+        PayloadData *slot = m_pShared->claim(ring,&pos);
+        if (!slot)
+        {
+            m_pShared->freePayload(block,due->app);
+            break;
+        }
+
+        //already captured when it was scheduled, the journal record is kept
+        if (m_trace.isOpen() || seq)
+        {
+            Released r;
+            r.pos = pos;
+            r.seq = seq;
+            m_released[ring].append(r);
+        }
+
+        memcpy(m_pShared->payloadBytes(block),json,due->length);
+        memcpy(slot->device,due->device,PAYLOAD_TOKEN_SIZE);
+        slot->length = due->length;
+        slot->block = block;
+        slot->priority = due->priority;
+        slot->expiry = due->expiry;
+        slot->sendAt = 0;
+        slot->collapse = due->collapse;
+        slot->app = due->app;
+        slot->enqueued = now;
+        m_pShared->publish(slot,pos);
+
+        m_wheel.popDue();
+        m_fReleaseBudget -= 1;
+        released++;
+    }
+
+    if (m_wheel.count() == 0)
+        m_pWheelTimer->stop();
+
+    if (released)
+        checkPayloads();
+}
+
+static inline quint64 collapseIndexKey(const PayloadData *payload)
+{
+    //FNV-1a over the device and the collapse key hash
+    quint64 h = 14695981039346656037ULL;
+    for (int i=0;i<PAYLOAD_TOKEN_SIZE;i++)
+    {
+        h ^= payload->device[i];
+        h *= 1099511628211ULL;
+    }
+    for (int i=0;i<8;i++)
+    {
+        h ^= (payload->collapse >> (i * 8)) & 0xff;
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+bool CPayloadDrain::enqueue(CGatewayConnection *conn, const PayloadData *payload, const char *json, quint64 seq)
+{
+    quint32 pos;
+    if (!conn->enqueue(payload,json,seq,&pos))
+        return false;
+
+    int lane = conn->index() * PAYLOAD_CLASSES + payloadClass(payload->priority);
+    m_enqueued[lane]++;
+    statAdd(&m_pStats->enqueued);
+
+    if (payload->collapse)
+    {
+        if (m_collapse.isEmpty())
+        {
+            int capacity = 0;
+            for (int i=0;i<m_connections.size();i++)
+                capacity += m_connections[i]->queueSize() * PAYLOAD_CLASSES;
+            m_collapse.resize(capacity);
+        }
+        m_collapse.insert(collapseIndexKey(payload),lane,pos,m_consumed);
+    }
+    return true;
+}
+
+/*
+ * Replaces the queued payload with the same device and collapse key.
+ * Returns false when there is none or the connection took it already.
+ */
+bool CPayloadDrain::collapse(const PayloadData *payload, const char *json)
+{
+    int lane;
+    quint32 pos;
+
+    if (!payload->collapse || !m_collapse.find(collapseIndexKey(payload),&lane,&pos))
+        return false;
+    if (lane % PAYLOAD_CLASSES != payloadClass(payload->priority))
+        return false;
+
+    CGatewayConnection *conn = m_connections[lane / PAYLOAD_CLASSES];
+    if (conn->app() != payload->app)
+        return false;
+    if (!conn->replace(lane % PAYLOAD_CLASSES,pos,payload,json))
+        return false;
+
+    conn->schedule();
+    return true;
+}
+
+//starts the oldest pending broadcast job when none is running
+void CPayloadDrain::scanBroadcasts()
+{
+    if (m_pBroadcast)
+        return;
+
+    QDir dir(m_sBroadcastDir);
+    QStringList jobs = dir.entryList(QStringList("*.job"),QDir::Files,QDir::Name);
+
+    for (int i=0;i<jobs.size();i++)
+    {
+        QString path = dir.absoluteFilePath(jobs[i]);
+        CBroadcastJob *job = new CBroadcastJob();
+        QString error;
+
+        if (!job->load(path,&error))
+        {
+            m_pDaemon->log(LOG_ALERT,error);
+            //keep it for inspection, but out of the way
+            ::rename(path.toLocal8Bit().constData(),(path + ".failed").toLocal8Bit().constData());
+            job->remove();
+            delete job;
+            continue;
+        }
+
+        QByteArray app = job->app().toUtf8();
+        int index = m_pShared->findApp(app.constData(),app.size());
+        if (index < 0)
+        {
+            m_pDaemon->log(LOG_ALERT,"Unknown app " + job->app() + " in broadcast " + job->name() + ".");
+            ::rename(path.toLocal8Bit().constData(),(path + ".failed").toLocal8Bit().constData());
+            job->remove();
+            delete job;
+            continue;
+        }
+        job->setApp(index);
+
+        m_pBroadcast = job;
+        m_iBroadcastNext = job->progress();
+        m_iBroadcastBlocked = 0;
+        m_iBroadcastExpired = 0;
+        m_broadcastMarks.clear();
+        m_pBroadcastTimer->start();
+
+        QString msg = "Broadcasting " + job->name() + " to " + QString::number(job->count()) + " devices";
+        if (job->progress())
+            msg += ", resuming at " + QString::number(job->progress());
+        m_pDaemon->log(LOG_INFO,msg + ".");
+
+        QMetaObject::invokeMethod(this,"checkPayloads",Qt::QueuedConnection);
+        return;
+    }
+}
+
+/*
+ * Queues the next chunk of the running broadcast. Returns false when the
+ * job is fully queued or a connection queue is full.
+ */
+bool CPayloadDrain::feedBroadcast()
+{
+    if (!m_pBroadcast || m_iBroadcastNext >= m_pBroadcast->count())
+        return false;
+
+    PayloadData payload = m_pBroadcast->header();
+    const char *json = m_pBroadcast->payload();
+    quint64 end = qMin(m_iBroadcastNext + BROADCAST_CHUNK,m_pBroadcast->count());
+
+    payload.enqueued = monotonicNs();
+
+    if (payloadExpired(&payload,(quint32)::time(0)))
+    {
+        m_iBroadcastExpired = m_pBroadcast->count() - m_iBroadcastNext;
+        m_iBroadcastNext = m_pBroadcast->count();
+        return false;
+    }
+
+    for (;m_iBroadcastNext < end;m_iBroadcastNext++)
+    {
+        memcpy(payload.device,m_pBroadcast->token(m_iBroadcastNext),PAYLOAD_TOKEN_SIZE);
+
+        if (blocked(&payload))
+        {
+            m_iBroadcastBlocked++;
+            continue;
+        }
+
+        CGatewayConnection *conn = pickConnection(&payload);
+        if (!conn || !enqueue(conn,&payload,json,0))
+            return false;
+        conn->schedule();
+    }
+
+    return m_iBroadcastNext < m_pBroadcast->count();
+}
+
+/*
+ * Saves the progress of the running broadcast. A mark records the queue
+ * counts of every connection together with the broadcast position, the
+ * position is saved once each connection wrote that much.
+ */
+void CPayloadDrain::markBroadcast()
+{
+    if (!m_pBroadcast)
+        return;
+
+    if (m_broadcastMarks.isEmpty() || m_broadcastMarks.last().next < m_iBroadcastNext)
+    {
+        BroadcastMark mark;
+        mark.next = m_iBroadcastNext;
+        mark.enqueued = m_enqueued;
+        m_broadcastMarks.append(mark);
+    }
+
+    quint64 done = 0;
+    while (!m_broadcastMarks.isEmpty())
+    {
+        const BroadcastMark &mark = m_broadcastMarks.first();
+        int i;
+        for (i=0;i<mark.enqueued.size();i++)
+            if (m_connections[i / PAYLOAD_CLASSES]->processedCount(i % PAYLOAD_CLASSES) < mark.enqueued[i])
+                break;
+        if (i < mark.enqueued.size())
+            break;
+        done = mark.next;
+        m_broadcastMarks.removeFirst();
+    }
+
+    if (done)
+        m_pBroadcast->setProgress(done);
+
+    if (m_pBroadcast->progress() == m_pBroadcast->count())
+        finishBroadcast();
+}
+
+void CPayloadDrain::finishBroadcast()
+{
+    quint64 sent = m_pBroadcast->count() - m_iBroadcastBlocked - m_iBroadcastExpired;
+    QString msg = "Broadcast " + m_pBroadcast->name() + " sent to " + QString::number(sent) + " devices, skipped " + QString::number(m_iBroadcastBlocked) + " on the blocklist";
+    if (m_iBroadcastExpired)
+        msg += ", expired before reaching " + QString::number(m_iBroadcastExpired);
+    m_pDaemon->log(LOG_INFO,msg + ".");
+
+    m_pBroadcast->remove();
+    delete m_pBroadcast;
+    m_pBroadcast = 0;
+    m_broadcastMarks.clear();
+    m_pBroadcastTimer->stop();
+
+    scanBroadcasts();
+}
+
+//called after the connection threads stopped
+void CPayloadDrain::closeBroadcast()
+{
+    if (!m_pBroadcast)
+        return;
+
+    markBroadcast();
+
+    if (m_pBroadcast)
+        m_pDaemon->log(LOG_INFO,"Broadcast " + m_pBroadcast->name() + " interrupted at " + QString::number(m_pBroadcast->progress()) + " of " + QString::number(m_pBroadcast->count()) + " devices.");
+}
+
+void CPayloadDrain::spill()
+{
+    if (!m_spool.isOpen())
+    {
+        if (m_wheel.count())
+            m_pDaemon->log(LOG_ALERT,"Discarding " + QString::number(m_wheel.count()) + " scheduled push payloads, set spool_dir to keep them across restarts.");
+        return;
+    }
+
+    PayloadData *payload;
+    int count = 0;
+
+    for (int r=0;r<m_pShared->ringCount();r++)
+    {
+        bool held = m_iHeldSeq[r] != 0;
+
+        while ((payload = m_pShared->front(r)) != 0)
+        {
+            quint64 seq = m_iReleasedSeq[r];
+            if (!seq)
+                takeReleased(r,&seq);
+            m_iReleasedSeq[r] = 0;
+
+            //released ones keep the record written when they were scheduled
+            if (held)
+                held = false;
+            else if (!seq && !m_spool.append(payload,m_pShared->payloadBytes(payload->block)))
+                break;
+            m_pShared->freePayload(payload->block,payload->app);
+            m_pShared->pop(r);
+            count++;
+        }
+    }
+
+    //the journal records of scheduled payloads stay past the checkpoint
+    PayloadData scheduled;
+    QByteArray json;
+    quint64 seq;
+    while (m_wheel.take(&scheduled,&json,&seq))
+    {
+        if (seq)
+            continue;
+        if (!m_spool.append(&scheduled,json.constData()))
+        {
+            m_pDaemon->log(LOG_ALERT,"Spool full, discarding " + QString::number(m_wheel.count() + 1) + " scheduled push payloads.");
+            break;
+        }
+        count++;
+    }
+
+    if (count)
+        m_pDaemon->log(LOG_INFO,"Spooled " + QString::number(count) + " queued push payloads.");
+}
+
+void CPayloadDrain::closeSpool()
+{
+    if (!m_spool.isOpen())
+        return;
+
+    m_spool.sync(checkpoint());
+    m_spool.close();
+}
+
+void CPayloadDrain::checkPayloads()
+{
+    if (!anyConnectionReady())
+        return;
+
+    if (m_spool.isOpen())
+        replaySpool();
+
+    DrainCounts counts;
+    memset(&counts,0,sizeof(counts));
+    quint32 now = (quint32)::time(0);
+    quint32 count = m_pShared->size();
+    int apps = m_pools.size();
+
+    if (count != 0 && m_pShared->front() != 0)
+    {
+        QString msg = "Sending " + QString::number(count) + " push payloads.";
+
+        m_pDaemon->log(LOG_INFO,msg,LOG_EVENT_DRAIN);
+    }
+
+    //stale collapse index entries are told apart by these
+    if (!m_collapse.isEmpty())
+        for (int i=0;i<m_consumed.size();i++)
+            m_consumed[i] = (quint32)m_connections[i / PAYLOAD_CLASSES]->processedCount(i % PAYLOAD_CLASSES);
+
+    //every app gets another try when a connection calls, an app still
+    //replaying its spool records goes on with those first
+    for (int r=0;r<m_pShared->ringCount();r++)
+        m_stalled[r] = r / PAYLOAD_CLASSES < m_deferred.size() && !m_deferred[r / PAYLOAD_CLASSES].isEmpty();
+
+    for (int c=0;c<PAYLOAD_CLASSES;c++)
+    {
+        //what the rings of this class hold now, later payloads wait for the next pass
+        quint32 left[PAYLOAD_APPS_MAX];
+        for (int a=0;a<apps;a++)
+            left[a] = m_pShared->size(a * PAYLOAD_CLASSES + c);
+
+        bool pending = true;
+        while (pending)
+        {
+            pending = false;
+            for (int i=0;i<apps;i++)
+            {
+                int a = (m_iNextApp + i) % apps;
+                int r = a * PAYLOAD_CLASSES + c;
+                if (m_stalled[r] || left[a] == 0)
+                    continue;
+
+                quint32 quantum = qMin(left[a],(quint32)(m_pools[a].weight * DRAIN_QUANTUM));
+                quint32 taken = drainRing(r,quantum,now,&counts);
+                left[a] = taken < quantum ? 0 : left[a] - taken;
+                if (left[a] && !m_stalled[r])
+                    pending = true;
+            }
+        }
+    }
+    //no app is always first to fill the connection queues
+    if (apps)
+        m_iNextApp = (m_iNextApp + 1) % apps;
+
+    statAdd(&m_pStats->blocked,counts.dropped);
+    statAdd(&m_pStats->expired,counts.expired);
+    statAdd(&m_pStats->collapsed,counts.collapsed);
+    statAdd(&m_pStats->scheduled,counts.scheduled);
+    statAdd(&m_pStats->unspooled,counts.unspooled);
+    if (counts.full)
+        statAdd(&m_pStats->connectionQueueFull);
+
+    if (counts.dropped)
+        m_pDaemon->log(LOG_INFO,"Dropped " + QString::number(counts.dropped) + " payloads for devices on the blocklist.",LOG_EVENT_DRAIN);
+    if (counts.expired)
+        m_pDaemon->log(LOG_INFO,"Dropped " + QString::number(counts.expired) + " expired payloads.",LOG_EVENT_DRAIN);
+    if (counts.collapsed)
+        m_pDaemon->log(LOG_INFO,"Collapsed " + QString::number(counts.collapsed) + " payloads into queued ones.",LOG_EVENT_DRAIN);
+    if (counts.scheduled)
+        m_pDaemon->log(LOG_INFO,"Scheduled " + QString::number(counts.scheduled) + " payloads (" + QString::number(m_wheel.count()) + " waiting).",LOG_EVENT_DRAIN);
+    if (counts.unspooled)
+        m_pDaemon->log(LOG_ALERT,"Spool full, sent " + QString::number(counts.unspooled) + " push payloads without journaling them.",LOG_EVENT_DRAIN);
+
+    //written out whenever the drain catches up
+    if (m_trace.pending() && m_pShared->size() == 0 && !m_trace.flush())
+        m_pDaemon->log(LOG_ALERT,"Could not write capture file " + m_sCaptureFile + ", capture stopped.",LOG_EVENT_DRAIN);
+
+    //broadcasts only use what the shared queue leaves of the connection queues
+    bool broadcasting = false;
+    if (m_pBroadcast && !m_stalled[payloadRing(m_pBroadcast->header().app,m_pBroadcast->header().priority)])
+        broadcasting = feedBroadcast();
+
+    //all connections lost, the next ready() drains again
+    if (!anyConnectionReady())
+        return;
+
+    //more payloads arrived meanwhile, give the event loop a turn first, a
+    //stalled app or broadcast calls again through ready() or spaceAvailable()
+    if (broadcasting || !m_pShared->sleep(m_stalled))
+        QMetaObject::invokeMethod(this,"checkPayloads",Qt::QueuedConnection);
+}
+
+/*
+ * Hands the spool records past the checkpoint to the connections after a
+ * restart. Records of an app without a ready connection or with a full
+ * connection queue wait aside in their order, so other apps go on.
+ */
+void CPayloadDrain::replaySpool()
+{
+    quint32 now = (quint32)::time(0);
+
+    for (int a=0;a<m_deferred.size();a++)
+    {
+        QList<Deferred> &deferred = m_deferred[a];
+        while (!deferred.isEmpty())
+        {
+            Deferred &d = deferred.first();
+            CGatewayConnection *conn = pickConnection(&d.payload);
+            if (!conn || !enqueue(conn,&d.payload,d.json,d.seq))
+                break;
+            spooled(conn,&d.payload,d.seq);
+            conn->schedule();
+            deferred.removeFirst();
+        }
+    }
+
+    Deferred replay;
+    while (m_spool.peekReplay(&replay.payload,&replay.json,&replay.seq))
+    {
+        if (blocked(&replay.payload) || payloadExpired(&replay.payload,now))
+        {
+            m_spool.advanceReplay();
+            continue;
+        }
+
+        if (replay.payload.sendAt > now)
+        {
+            schedule(&replay.payload,replay.json,replay.seq);
+            m_spool.advanceReplay();
+            continue;
+        }
+
+        //a replayed record replaces the older one it collapsed before the crash
+        QList<Deferred> &deferred = m_deferred[replay.payload.app];
+        if (deferred.isEmpty() && collapse(&replay.payload,replay.json))
+        {
+            statAdd(&m_pStats->collapsed);
+            m_spool.advanceReplay();
+            continue;
+        }
+
+        CGatewayConnection *conn = deferred.isEmpty() ? pickConnection(&replay.payload) : 0;
+        if (conn && enqueue(conn,&replay.payload,replay.json,replay.seq))
+        {
+            spooled(conn,&replay.payload,replay.seq);
+            conn->schedule();
+        }
+        else
+            deferred.append(replay);
+
+        m_spool.advanceReplay();
+    }
+}
+
+/*
+ * Takes up to max payloads from the front of a ring. Marks the ring
+ * stalled when its app has no ready connection or a full connection
+ * queue, the front payload then stays in the ring.
+ */
+quint32 CPayloadDrain::drainRing(int r, quint32 max, quint32 now, DrainCounts *counts)
+{
+    PayloadData *payload;
+    quint32 n;
+
+    for (n=0;n<max && (payload = m_pShared->front(r)) != 0;n++)
+    {
+        quint64 seq = 0;
+        bool released = takeReleased(r,&seq);
+
+        if (m_trace.isOpen())
+            capture(r,payload,released);
+
+        //journaled first, the wheel is lost in a crash
+        if (!m_iHeldSeq[r] && payload->sendAt > now)
+        {
+            const char *json = m_pShared->payloadBytes(payload->block);
+            seq = m_spool.isOpen() ? m_spool.append(payload,json) : 0;
+            if (m_spool.isOpen() && !seq)
+                counts->unspooled++;
+            schedule(payload,json,seq);
+            m_pShared->freePayload(payload->block,payload->app);
+            m_pShared->pop(r);
+            counts->scheduled++;
+            continue;
+        }
+
+        if (!m_iHeldSeq[r] && (blocked(payload) || payloadExpired(payload,now)))
+        {
+            if (payloadExpired(payload,now))
+                counts->expired++;
+            else
+                counts->dropped++;
+            unschedule(r);
+            m_pShared->freePayload(payload->block,payload->app);
+            m_pShared->pop(r);
+            continue;
+        }
+
+        CGatewayConnection *conn = pickConnection(payload);
+        if (!conn)
+        {
+            m_stalled[r] = true;
+            break;
+        }
+
+        const char *json = m_pShared->payloadBytes(payload->block);
+        seq = m_iHeldSeq[r];
+        if (m_spool.isOpen() && !seq)
+        {
+            seq = m_spool.append(payload,json);
+            if (!seq)
+                counts->unspooled++;
+            m_iHeldSeq[r] = seq;
+        }
+        //the new record takes over from the one written when it was scheduled
+        unschedule(r);
+
+        //the replaced slot keeps its older spool sequence number, it holds
+        //the checkpoint before this record until the lane wrote it
+        if (collapse(payload,json))
+        {
+            m_iHeldSeq[r] = 0;
+            m_pShared->pop(r);
+            counts->collapsed++;
+            continue;
+        }
+
+        //connection queue full, wait for its spaceAvailable()
+        if (!enqueue(conn,payload,json,seq))
+        {
+            counts->full = true;
+            m_stalled[r] = true;
+            break;
+        }
+
+        m_iHeldSeq[r] = 0;
+        if (seq)
+            spooled(conn,payload,seq);
+        m_pShared->pop(r);
+        conn->schedule();
+    }
+
+    return n;
+}
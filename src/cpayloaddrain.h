@@ -0,0 +1,252 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CPAYLOADDRAIN_H
+#define CPAYLOADDRAIN_H
+
+#include <QObject>
+#include <QList>
+#include <QVector>
+#include <QMap>
+#include "cspool.h"
+#include "ctokenblocklist.h"
+#include "ctimingwheel.h"
+#include "ccollapseindex.h"
+#include "ctrace.h"
+#include "shared.h"
+#include "config.h"
+#include "stats.h"
+
+#define BROADCAST_CHUNK 4096
+//payloads an app of weight 1 takes from its ring per round robin turn
+#define DRAIN_QUANTUM 64
+
+class CAPNSd;
+class CGatewayConnection;
+class CBroadcastJob;
+class QSocketNotifier;
+class QTimer;
+class QFileSystemWatcher;
+
+/*
+ * Drains the shared payload queue in its own thread and hands every
+ * payload to a gateway connection of its app, the immediate rings before
+ * the power considerate ones. Sleeps on the wakeup fifo when the queue is
+ * empty and leaves payloads in the shared queue while the connection
+ * queues are full. Expired payloads are dropped.
+ *
+ * Every app has its own rings and connection pool. The rings of one class
+ * are drained weighted round robin, an app takes up to weight times
+ * DRAIN_QUANTUM payloads per turn, and an app whose connections are down
+ * or full is skipped until they call again, so it never holds up another.
+ *
+ * With a spool every drained payload is journaled before it is handed on,
+ * the checkpoint follows what each connection lane wrote to its socket.
+ * Payloads for devices on the blocklist are dropped before they are
+ * journaled or queued.
+ *
+ * A payload with a collapse key replaces the one queued before it for the
+ * same device and key, as long as that one is still waiting in its
+ * connection lane. Payloads still in the shared queue are not collapsed,
+ * they are only looked up once they are drained. The replaced slot keeps
+ * its older spool record, so after a crash both records are replayed and
+ * collapse again if they meet in a lane, otherwise both are sent.
+ *
+ * Payloads with a send-at time in the future wait in a timing wheel, due
+ * ones go back into the shared queue at scheduled_release_rate per second.
+ * With a spool they are journaled before they enter the wheel and the
+ * checkpoint stays at their record until they are journaled again on
+ * their way to a connection. Once the spool moved on to a new segment the
+ * wheel is journaled into it again, so a payload scheduled far ahead does
+ * not keep its old segment and every later one on disk.
+ *
+ * Broadcast jobs are fed from their token mapping whenever the shared
+ * queue is drained, one job at a time. Their progress is saved once the
+ * connections wrote everything queued up to a mark.
+ *
+ * With a capture file every payload taken from the shared queue is
+ * recorded once, except scheduled ones coming back out of the wheel.
+ */
+class CPayloadDrain : public QObject
+{
+    Q_OBJECT
+public:
+    CPayloadDrain(SharedPayload *shared, CAPNSd *daemon);
+    ~CPayloadDrain();
+
+    void setConnections(const QList<CGatewayConnection*> &connections, const Config &config);
+    bool openWakeupFifo();
+    bool openSpool(const QString &dir, qint64 segmentSize, int syncInterval, QString *error);
+    quint64 spooledCount() const { return m_spool.replayCount(); }
+    bool openBlocklist(const QString &path, QString *error);
+    int blocklistSize() const { return m_blocklist.size(); }
+    void setBroadcastDir(const QString &dir) { m_sBroadcastDir = dir; }
+    void setReleaseRate(int rate) { m_iReleaseRate = rate; }
+    //empty stops capturing
+    void setCapture(const QString &path);
+
+    //called after the drain thread stopped
+    void spill();
+    void closeSpool();
+    void closeBroadcast();
+
+public slots:
+    void start();
+    //release rate, sharding, pool sizes and weights of a reloaded snapshot, connections only grow
+    void applyConfig(const ConfigSnapshot &config, const QList<CGatewayConnection*> &connections);
+    void checkPayloads();
+    //token(32) time(4) records, from the feedback service and error responses
+    void blockTokens(const QByteArray &records);
+
+private slots:
+    void wakeup();
+    void syncSpool();
+    void scanBroadcasts();
+    void markBroadcast();
+    void releaseScheduled();
+
+private:
+    struct DrainCounts
+    {
+        int unspooled;
+        int dropped;
+        int expired;
+        int scheduled;
+        int collapsed;
+        bool full;
+    };
+
+    void setPools(const Config &config);
+    void replaySpool();
+    quint32 drainRing(int ring, quint32 max, quint32 now, DrainCounts *counts);
+    CGatewayConnection *pickConnection(const PayloadData *payload) const;
+    bool anyConnectionReady() const;
+    bool blocked(const PayloadData *payload) const;
+    void spooled(CGatewayConnection *conn, const PayloadData *payload, quint64 seq);
+    quint64 checkpoint() const;
+    void schedule(const PayloadData *payload, const char *json, quint64 seq);
+    void rejournalScheduled();
+    bool takeReleased(int ring, quint64 *seq);
+    void unschedule(int ring);
+    bool enqueue(CGatewayConnection *conn, const PayloadData *payload, const char *json, quint64 seq);
+    bool collapse(const PayloadData *payload, const char *json);
+    void capture(int ring, const PayloadData *payload, bool released);
+    bool feedBroadcast();
+    void finishBroadcast();
+
+    SharedPayload *m_pShared;
+    CAPNSd *m_pDaemon;
+    DaemonStats *m_pStats;
+    QList<CGatewayConnection*> m_connections;
+
+    struct AppPool
+    {
+        QList<CGatewayConnection*> connections;
+        //connections past this one are retired and get no new payloads
+        int active;
+        int weight;
+    };
+
+    //by app, a connection's lanes stay indexed by its global index
+    QVector<AppPool> m_pools;
+    int m_iSharding;
+    //app that goes first in the next round robin pass
+    int m_iNextApp;
+    //rings skipped until a connection of their app calls again
+    bool m_stalled[PAYLOAD_RINGS_MAX];
+
+    int m_iWakeFd;
+    int m_iWakeWriteFd;
+    QSocketNotifier *m_psnWake;
+
+    CSpool m_spool;
+    QTimer *m_pSyncTimer;
+    int m_iSyncInterval;
+    //spooled front payload of a ring a full connection queue refused
+    quint64 m_iHeldSeq[PAYLOAD_RINGS_MAX];
+    //per connection lane, index * PAYLOAD_CLASSES + class
+    QVector<quint64> m_firstSeq;
+    QVector<quint64> m_lastSeq;
+
+    CTokenBlocklist m_blocklist;
+
+    CCollapseIndex m_collapse;
+    QVector<quint32> m_consumed;
+
+    CTimingWheel m_wheel;
+    QTimer *m_pWheelTimer;
+    int m_iReleaseRate;
+    double m_fReleaseBudget;
+    quint64 m_iLastRelease;
+
+    QString m_sCaptureFile;
+    CTrace m_trace;
+    //ring position after the last captured payload
+    quint32 m_iCaptureNext[PAYLOAD_RINGS_MAX];
+
+    struct Released
+    {
+        quint32 pos;
+        quint64 seq;
+    };
+
+    //ring positions releaseScheduled() published to, with a capture or spool
+    QList<Released> m_released[PAYLOAD_RINGS_MAX];
+    //spool records of scheduled payloads not yet journaled again
+    QMap<quint64,bool> m_scheduled;
+    //segmentSeq() of the spool segment the wheel was last journaled into
+    quint64 m_iRejournalSeq;
+
+    struct Deferred
+    {
+        PayloadData payload;
+        //stays mapped, the checkpoint does not pass seq
+        const char *json;
+        quint64 seq;
+    };
+
+    //by app, replayed spool records waiting for a ready connection
+    QVector<QList<Deferred> > m_deferred;
+    //spool record of a ring's front payload that came out of the wheel
+    quint64 m_iReleasedSeq[PAYLOAD_RINGS_MAX];
+
+    //payloads handed to each connection lane, compared with processedCount()
+    QVector<quint64> m_enqueued;
+
+    struct BroadcastMark
+    {
+        quint64 next;
+        QVector<quint64> enqueued;
+    };
+
+    QString m_sBroadcastDir;
+    QFileSystemWatcher *m_pBroadcastWatcher;
+    QTimer *m_pBroadcastTimer;
+    CBroadcastJob *m_pBroadcast;
+    quint64 m_iBroadcastNext;
+    quint64 m_iBroadcastBlocked;
+    quint64 m_iBroadcastExpired;
+    QList<BroadcastMark> m_broadcastMarks;
+};
+
+Q_DECLARE_METATYPE(QList<CGatewayConnection*>)
+
+#endif // CPAYLOADDRAIN_H
@@ -0,0 +1,452 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "cspool.h"
+#include "config.h"
+#include "shared.h"
+#include "latency.h"
+#include <QDir>
+#include <QStringList>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+
+/*
+ * Segment: magic(4) version(4) index(8) followed by records.
+ * Record: length(4) checksum(4) seq(8) PayloadData json, padded to 8 bytes.
+ * A zero length ends the segment, segments are zero filled when created.
+ * The length is stored last so a torn record fails the checksum.
+ */
+
+#define SPOOL_MAGIC 0x41505350
+#define SPOOL_VERSION 6
+#define SPOOL_SEGMENT_HEADER 16
+#define SPOOL_RECORD_HEADER 16
+
+static inline qint64 spoolAlign(qint64 len)
+{
+    return (len + 7) & ~7LL;
+}
+
+static quint32 spoolChecksum(quint64 seq, const uchar *data, int len)
+{
+    //FNV-1a
+    quint32 h = 2166136261U;
+    for (int i=0;i<8;i++)
+    {
+        h ^= (uchar)(seq >> (i * 8));
+        h *= 16777619U;
+    }
+    for (int i=0;i<len;i++)
+    {
+        h ^= data[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+CSpool::CSpool()
+{
+    m_iSegmentSize = SPOOL_DEFAULT_SEGMENT_SIZE;
+    m_bOpen = false;
+    m_iNextSeq = 1;
+    m_iSegmentSeq = 1;
+    m_iCheckpoint = 1;
+    m_iCheckpointFd = -1;
+    m_bReplay = false;
+    m_iReplaySegment = 0;
+    m_iReplayOffset = 0;
+    m_iReplayCount = 0;
+}
+
+CSpool::~CSpool()
+{
+    close();
+}
+
+QString CSpool::segmentPath(quint64 index) const
+{
+    return m_sDir + "/spool-" + QString::number(index,16).rightJustified(16,'0') + ".dat";
+}
+
+bool CSpool::mapSegment(quint64 index, bool create, Segment *segment)
+{
+    QByteArray path = segmentPath(index).toLocal8Bit();
+    int fd = ::open(path.constData(),create ? (O_RDWR | O_CREAT | O_EXCL) : O_RDWR,0600);
+    if (fd < 0)
+        return false;
+
+    qint64 size = m_iSegmentSize;
+    if (create)
+    {
+        //a sparse file would raise SIGBUS on the first write to a page the disk has no room for
+        int err = ::posix_fallocate(fd,0,size);
+        if (err)
+        {
+            ::close(fd);
+            ::unlink(path.constData());
+            errno = err;
+            return false;
+        }
+    }
+    else
+    {
+        struct stat st;
+        if (::fstat(fd,&st) < 0 || st.st_size < SPOOL_SEGMENT_HEADER)
+        {
+            ::close(fd);
+            return false;
+        }
+        size = st.st_size;
+    }
+
+    void *map = ::mmap(0,size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    if (map == MAP_FAILED)
+    {
+        ::close(fd);
+        if (create)
+            ::unlink(path.constData());
+        return false;
+    }
+
+    segment->index = index;
+    segment->fd = fd;
+    segment->map = static_cast<uchar*>(map);
+    segment->size = size;
+    segment->used = SPOOL_SEGMENT_HEADER;
+    segment->synced = create ? 0 : size;
+    segment->lastSeq = 0;
+
+    if (create)
+    {
+        quint32 magic = SPOOL_MAGIC;
+        quint32 version = SPOOL_VERSION;
+        memcpy(segment->map,&magic,4);
+        memcpy(segment->map + 4,&version,4);
+        memcpy(segment->map + 8,&index,8);
+    }
+
+    return true;
+}
+
+void CSpool::unmapSegment(Segment *segment)
+{
+    ::munmap(segment->map,segment->size);
+    ::close(segment->fd);
+    segment->map = 0;
+    segment->fd = -1;
+}
+
+//finds the end of the segment and the first record to replay
+bool CSpool::scanSegment(Segment *segment, quint64 checkpoint)
+{
+    quint32 magic, version;
+    memcpy(&magic,segment->map,4);
+    memcpy(&version,segment->map + 4,4);
+    if (magic != SPOOL_MAGIC)
+    {
+        m_skipped.append("Skipping " + segmentPath(segment->index) + ", it is not a spool segment.");
+        return false;
+    }
+    if (version != SPOOL_VERSION)
+    {
+        m_skipped.append("Skipping spool segment " + segmentPath(segment->index) + " of version " + QString::number(version) +
+                         ", this build reads version " + QString::number(SPOOL_VERSION) + ".");
+        return false;
+    }
+
+    qint64 pos = SPOOL_SEGMENT_HEADER;
+    while (pos + SPOOL_RECORD_HEADER <= segment->size)
+    {
+        const uchar *p = segment->map + pos;
+        quint32 len, checksum;
+        quint64 seq;
+        memcpy(&len,p,4);
+        memcpy(&checksum,p + 4,4);
+        memcpy(&seq,p + 8,8);
+
+        if (len < sizeof(PayloadData) || len > sizeof(PayloadData) + PAYLOAD_MAX_SIZE || pos + SPOOL_RECORD_HEADER + len > segment->size)
+            break;
+        if (spoolChecksum(seq,p + SPOOL_RECORD_HEADER,len) != checksum)
+            break;
+
+        if (seq >= checkpoint)
+        {
+            if (!m_bReplay)
+            {
+                m_bReplay = true;
+                m_iReplaySegment = segment->index;
+                m_iReplayOffset = pos;
+            }
+            m_iReplayCount++;
+        }
+
+        if (seq >= m_iNextSeq)
+            m_iNextSeq = seq + 1;
+        segment->lastSeq = seq;
+        pos += spoolAlign(SPOOL_RECORD_HEADER + len);
+    }
+
+    segment->used = pos;
+    return true;
+}
+
+bool CSpool::open(const QString &dir, qint64 segmentSize, QString *error)
+{
+    close();
+
+    m_sDir = dir;
+    m_iSegmentSize = qMax(segmentSize,(qint64)(1024 * 1024));
+
+    if (!QDir().mkpath(dir))
+    {
+        *error = "Could not create spool directory " + dir;
+        return false;
+    }
+
+    QByteArray cppath = QString(dir + "/checkpoint").toLocal8Bit();
+    m_iCheckpointFd = ::open(cppath.constData(),O_RDWR | O_CREAT,0600);
+    if (m_iCheckpointFd < 0)
+    {
+        *error = "Could not open " + QString(cppath) + ": " + QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+
+    quint64 checkpoint = 0;
+    if (::pread(m_iCheckpointFd,&checkpoint,sizeof(checkpoint),0) != sizeof(checkpoint) || checkpoint == 0)
+        checkpoint = 1;
+    m_iCheckpoint = checkpoint;
+    m_iNextSeq = checkpoint;
+
+    QStringList files = QDir(dir).entryList(QStringList() << "spool-*.dat",QDir::Files,QDir::Name);
+    quint64 lastindex = 0;
+    Segment segment;
+    for (int i=0;i<files.size();i++)
+    {
+        bool ok;
+        quint64 index = files[i].mid(6,16).toULongLong(&ok,16);
+        if (!ok)
+            continue;
+        lastindex = qMax(lastindex,index);
+        if (!mapSegment(index,false,&segment))
+            continue;
+        //kept on disk for inspection, the next segment index is past it
+        if (!scanSegment(&segment,checkpoint))
+        {
+            unmapSegment(&segment);
+            continue;
+        }
+        m_segments.append(segment);
+    }
+
+    //always append to a fresh segment, a torn tail stays where it is
+    if (!mapSegment(lastindex + 1,true,&segment))
+    {
+        *error = "Could not create spool segment in " + dir + ": " + QString::fromLocal8Bit(strerror(errno));
+        close();
+        return false;
+    }
+    m_segments.append(segment);
+    m_iSegmentSeq = m_iNextSeq;
+
+    m_bOpen = true;
+    return true;
+}
+
+void CSpool::close()
+{
+    for (int i=0;i<m_segments.size();i++)
+        unmapSegment(&m_segments[i]);
+    m_segments.clear();
+    m_skipped.clear();
+
+    if (m_iCheckpointFd >= 0)
+        ::close(m_iCheckpointFd);
+    m_iCheckpointFd = -1;
+
+    m_bOpen = false;
+    m_bReplay = false;
+    m_iReplayCount = 0;
+}
+
+bool CSpool::rotate()
+{
+    quint64 index = m_segments.isEmpty() ? 1 : m_segments.last().index + 1;
+    Segment segment;
+    if (!mapSegment(index,true,&segment))
+        return false;
+    m_segments.append(segment);
+    m_iSegmentSeq = m_iNextSeq;
+    return true;
+}
+
+quint64 CSpool::append(const PayloadData *payload, const char *json)
+{
+    int len = sizeof(PayloadData) + payload->length;
+    qint64 need = spoolAlign(SPOOL_RECORD_HEADER + len);
+
+    if (m_segments.last().used + need > m_segments.last().size && !rotate())
+        return 0;
+
+    Segment &segment = m_segments.last();
+    uchar *p = segment.map + segment.used;
+    quint64 seq = m_iNextSeq++;
+
+    memcpy(p + SPOOL_RECORD_HEADER,payload,sizeof(PayloadData));
+    memcpy(p + SPOOL_RECORD_HEADER + sizeof(PayloadData),json,payload->length);
+    quint32 checksum = spoolChecksum(seq,p + SPOOL_RECORD_HEADER,len);
+    memcpy(p + 4,&checksum,4);
+    memcpy(p + 8,&seq,8);
+    __atomic_store_n(reinterpret_cast<quint32*>(p),(quint32)len,__ATOMIC_RELEASE);
+
+    segment.used += need;
+    segment.lastSeq = seq;
+    return seq;
+}
+
+bool CSpool::dirty() const
+{
+    for (int i=0;i<m_segments.size();i++)
+        if (m_segments[i].synced < m_segments[i].used)
+            return true;
+    return false;
+}
+
+void CSpool::writeCheckpoint(quint64 checkpoint)
+{
+    if (checkpoint <= m_iCheckpoint)
+        return;
+    if (::pwrite(m_iCheckpointFd,&checkpoint,sizeof(checkpoint),0) == sizeof(checkpoint))
+    {
+        ::fdatasync(m_iCheckpointFd);
+        m_iCheckpoint = checkpoint;
+    }
+}
+
+/*
+ * Group commit: one msync for everything appended since the last call,
+ * then the checkpoint. Segments the checkpoint has passed are removed.
+ */
+void CSpool::sync(quint64 checkpoint)
+{
+    if (!m_bOpen)
+        return;
+
+    static const qint64 pagemask = ::sysconf(_SC_PAGESIZE) - 1;
+
+    for (int i=0;i<m_segments.size();i++)
+    {
+        Segment &segment = m_segments[i];
+        if (segment.synced >= segment.used)
+            continue;
+        qint64 start = segment.synced & ~pagemask;
+        ::msync(segment.map + start,segment.used - start,MS_SYNC);
+        segment.synced = segment.used;
+    }
+
+    writeCheckpoint(checkpoint);
+
+    while (m_segments.size() > 1 && m_segments.first().lastSeq < checkpoint)
+    {
+        Segment segment = m_segments.takeFirst();
+        unmapSegment(&segment);
+        ::unlink(segmentPath(segment.index).toLocal8Bit().constData());
+    }
+}
+
+bool CSpool::peekReplay(PayloadData *payload, const char **json, quint64 *seq)
+{
+    while (m_bReplay)
+    {
+        int i = 0;
+        while (i < m_segments.size() && m_segments[i].index < m_iReplaySegment)
+            i++;
+
+        //caught up with the segment opened for this run
+        if (i >= m_segments.size() - 1)
+        {
+            m_bReplay = false;
+            m_iReplayCount = 0;
+            return false;
+        }
+
+        const Segment &segment = m_segments[i];
+        if (segment.index != m_iReplaySegment)
+        {
+            m_iReplaySegment = segment.index;
+            m_iReplayOffset = SPOOL_SEGMENT_HEADER;
+        }
+        if (m_iReplayOffset >= segment.used)
+        {
+            m_iReplaySegment = segment.index + 1;
+            m_iReplayOffset = SPOOL_SEGMENT_HEADER;
+            continue;
+        }
+
+        const uchar *p = segment.map + m_iReplayOffset;
+        memcpy(seq,p + 8,8);
+        memcpy(payload,p + SPOOL_RECORD_HEADER,sizeof(PayloadData));
+        *json = reinterpret_cast<const char*>(p + SPOOL_RECORD_HEADER + sizeof(PayloadData));
+        payload->block = PAYLOAD_NO_BLOCK;
+        payload->enqueued = monotonicNs();
+        return true;
+    }
+    return false;
+}
+
+void CSpool::advanceReplay()
+{
+    for (int i=0;i<m_segments.size();i++)
+    {
+        if (m_segments[i].index != m_iReplaySegment)
+            continue;
+        quint32 len;
+        memcpy(&len,m_segments[i].map + m_iReplayOffset,4);
+        m_iReplayOffset += spoolAlign(SPOOL_RECORD_HEADER + len);
+        if (m_iReplayCount > 0)
+            m_iReplayCount--;
+        return;
+    }
+}
+
+//sequence number of the next record to replay, nextSeq() when done
+quint64 CSpool::replaySeq() const
+{
+    if (!m_bReplay)
+        return m_iNextSeq;
+    for (int i=0;i<m_segments.size() - 1;i++)
+    {
+        const Segment &segment = m_segments[i];
+        if (segment.index < m_iReplaySegment)
+            continue;
+        qint64 offset = segment.index == m_iReplaySegment ? m_iReplayOffset : SPOOL_SEGMENT_HEADER;
+        if (offset >= segment.used)
+            continue;
+        quint64 seq;
+        memcpy(&seq,segment.map + offset + 8,8);
+        return seq;
+    }
+    return m_iNextSeq;
+}
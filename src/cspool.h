@@ -0,0 +1,102 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CSPOOL_H
+#define CSPOOL_H
+
+#include <QString>
+#include <QList>
+#include <QStringList>
+
+struct PayloadData;
+
+/*
+ * Append-only journal of drained payloads in memory mapped segment files.
+ * Every record gets a sequence number, sync() flushes the dirty part of the
+ * mapping in one go (group commit) and stores the consumer checkpoint, the
+ * first sequence number not yet written to a gateway connection. Segments
+ * entirely before the checkpoint are deleted. After a restart the records
+ * from the checkpoint on are handed out again by peekReplay(), their
+ * payload bytes stay mapped until the checkpoint passes them.
+ *
+ * Used from the drain thread only.
+ */
+class CSpool
+{
+public:
+    CSpool();
+    ~CSpool();
+
+    bool open(const QString &dir, qint64 segmentSize, QString *error);
+    void close();
+    bool isOpen() const { return m_bOpen; }
+
+    quint64 append(const PayloadData *payload, const char *json);
+    quint64 nextSeq() const { return m_iNextSeq; }
+    //first sequence number of the segment appended to
+    quint64 segmentSeq() const { return m_iSegmentSeq; }
+    bool dirty() const;
+    quint64 checkpoint() const { return m_iCheckpoint; }
+    void sync(quint64 checkpoint);
+
+    bool peekReplay(PayloadData *payload, const char **json, quint64 *seq);
+    void advanceReplay();
+    quint64 replaySeq() const;
+    quint64 replayCount() const { return m_iReplayCount; }
+    //segments open() left alone, they are never replayed nor deleted
+    const QStringList &skipped() const { return m_skipped; }
+
+private:
+    struct Segment
+    {
+        quint64 index;
+        int fd;
+        uchar *map;
+        qint64 size;
+        qint64 used;
+        qint64 synced;
+        quint64 lastSeq;
+    };
+
+    QString segmentPath(quint64 index) const;
+    bool mapSegment(quint64 index, bool create, Segment *segment);
+    void unmapSegment(Segment *segment);
+    bool scanSegment(Segment *segment, quint64 checkpoint);
+    bool rotate();
+    void writeCheckpoint(quint64 checkpoint);
+
+    QString m_sDir;
+    qint64 m_iSegmentSize;
+    bool m_bOpen;
+    QList<Segment> m_segments;
+    QStringList m_skipped;
+    quint64 m_iNextSeq;
+    quint64 m_iSegmentSeq;
+    quint64 m_iCheckpoint;
+    int m_iCheckpointFd;
+
+    bool m_bReplay;
+    quint64 m_iReplaySegment;
+    qint64 m_iReplayOffset;
+    quint64 m_iReplayCount;
+};
+
+#endif // CSPOOL_H
@@ -0,0 +1,114 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CSPSCQUEUE_H
+#define CSPSCQUEUE_H
+
+#include <QtGlobal>
+
+#define SPSC_CACHELINE 64
+
+/*
+ * Bounded single-producer single-consumer queue used to hand work between
+ * the pipeline threads. The producer fills the slot returned by claim()
+ * and calls publish(), the consumer reads front() and calls pop().
+ * resize() must not race with either side. Positions count published
+ * items, at() gives the producer the slot of one it published before.
+ */
+template <typename T>
+class CSpscQueue
+{
+public:
+    explicit CSpscQueue(quint32 capacity = 1024) : m_pData(0)
+    {
+        resize(capacity);
+    }
+
+    ~CSpscQueue()
+    {
+        delete [] m_pData;
+    }
+
+    void resize(quint32 capacity)
+    {
+        quint32 c = 2;
+        while (c < capacity)
+            c <<= 1;
+
+        delete [] m_pData;
+        m_pData = new T[c];
+        m_iCapacity = c;
+        m_iMask = c - 1;
+        m_iHead = 0;
+        m_iTail = 0;
+    }
+
+    quint32 capacity() const { return m_iCapacity; }
+    quint32 head() const { return m_iHead; }
+    quint32 tail() const { return __atomic_load_n(&m_iTail,__ATOMIC_ACQUIRE); }
+    T *at(quint32 pos) { return &m_pData[pos & m_iMask]; }
+
+    quint32 size() const
+    {
+        return __atomic_load_n(&m_iHead,__ATOMIC_ACQUIRE) - __atomic_load_n(&m_iTail,__ATOMIC_ACQUIRE);
+    }
+
+    //producer
+    T *claim()
+    {
+        if (m_iHead - __atomic_load_n(&m_iTail,__ATOMIC_ACQUIRE) >= m_iCapacity)
+            return 0;
+        return &m_pData[m_iHead & m_iMask];
+    }
+
+    void publish()
+    {
+        __atomic_store_n(&m_iHead,m_iHead + 1,__ATOMIC_RELEASE);
+    }
+
+    //consumer
+    T *front()
+    {
+        if (m_iTail == __atomic_load_n(&m_iHead,__ATOMIC_ACQUIRE))
+            return 0;
+        return &m_pData[m_iTail & m_iMask];
+    }
+
+    void pop()
+    {
+        __atomic_store_n(&m_iTail,m_iTail + 1,__ATOMIC_RELEASE);
+    }
+
+private:
+    CSpscQueue(const CSpscQueue &);
+    CSpscQueue &operator=(const CSpscQueue &);
+
+    T *m_pData;
+    quint32 m_iCapacity;
+    quint32 m_iMask;
+    char m_pad0[SPSC_CACHELINE];
+    quint32 m_iHead;
+    char m_pad1[SPSC_CACHELINE];
+    quint32 m_iTail;
+    char m_pad2[SPSC_CACHELINE];
+};
+
+#endif // CSPSCQUEUE_H
@@ -0,0 +1,168 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "cstatsserver.h"
+#include "capnsd.h"
+#include "stats.h"
+#include "latency.h"
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QHostAddress>
+#include <QTimer>
+#include <syslog.h>
+
+//request line and headers, anything longer is answered right away
+#define STATS_MAX_REQUEST 8192
+//seconds a client has to send its request
+#define STATS_IDLE_TIMEOUT 10
+
+CStatsServer::CStatsServer(DaemonStats *stats, const SharedPayload *shared, CAPNSd *daemon) :
+    QObject(daemon), m_pStats(stats), m_pShared(shared), m_pDaemon(daemon)
+{
+    m_pLocalServer = 0;
+    m_pTcpServer = 0;
+
+    m_pIdleTimer = new QTimer(this);
+    m_pIdleTimer->setInterval(1000);
+    connect(m_pIdleTimer,SIGNAL(timeout()),this,SLOT(closeIdle()));
+}
+
+void CStatsServer::listen(const QString &socketPath, quint16 tcpPort)
+{
+    if (!socketPath.isEmpty())
+    {
+        QLocalServer::removeServer(socketPath);
+        m_pLocalServer = new QLocalServer(this);
+        connect(m_pLocalServer,SIGNAL(newConnection()),this,SLOT(newLocalConnection()));
+        if (m_pLocalServer->listen(socketPath))
+            m_pDaemon->log(LOG_INFO,"Serving metrics on " + socketPath + ".");
+        else
+            m_pDaemon->log(LOG_ALERT,"Could not listen on " + socketPath + ": " + m_pLocalServer->errorString());
+    }
+
+    if (tcpPort != 0)
+    {
+        m_pTcpServer = new QTcpServer(this);
+        connect(m_pTcpServer,SIGNAL(newConnection()),this,SLOT(newTcpConnection()));
+        if (m_pTcpServer->listen(QHostAddress::LocalHost,tcpPort))
+            m_pDaemon->log(LOG_INFO,"Serving metrics on 127.0.0.1:" + QString::number(tcpPort) + ".");
+        else
+            m_pDaemon->log(LOG_ALERT,"Could not listen on 127.0.0.1:" + QString::number(tcpPort) + ": " + m_pTcpServer->errorString());
+    }
+}
+
+void CStatsServer::newLocalConnection()
+{
+    QLocalSocket *socket;
+    while ((socket = m_pLocalServer->nextPendingConnection()) != 0)
+        addClient(socket);
+}
+
+void CStatsServer::newTcpConnection()
+{
+    QTcpSocket *socket;
+    while ((socket = m_pTcpServer->nextPendingConnection()) != 0)
+        addClient(socket);
+}
+
+void CStatsServer::addClient(QIODevice *device)
+{
+    Request request;
+    request.since = monotonicNs();
+    m_requests.insert(device,request);
+    connect(device,SIGNAL(readyRead()),this,SLOT(readyRead()));
+    connect(device,SIGNAL(disconnected()),this,SLOT(disconnected()));
+    if (!m_pIdleTimer->isActive())
+        m_pIdleTimer->start();
+}
+
+void CStatsServer::readyRead()
+{
+    QIODevice *device = qobject_cast<QIODevice*>(sender());
+    if (!device || !m_requests.contains(device))
+        return;
+
+    QByteArray &request = m_requests[device].data;
+    request.append(device->readAll());
+    if (!request.contains("\r\n\r\n") && !request.contains("\n\n") && request.size() < STATS_MAX_REQUEST)
+        return;
+
+    //request line: method, path with an optional query, version
+    QList<QByteArray> line = request.left(request.indexOf('\n')).trimmed().split(' ');
+    QByteArray path = line.size() > 1 ? line[1] : QByteArray();
+    if (path.contains('?'))
+        path = path.left(path.indexOf('?'));
+
+    if (line[0] == "GET" && path == "/metrics")
+        respond(device,"200 OK","text/plain; version=0.0.4",statsPrometheus(m_pStats,m_pShared));
+    else
+        respond(device,"404 Not Found","text/plain","Not found, the metrics are at /metrics.\n");
+}
+
+void CStatsServer::respond(QIODevice *device, const QByteArray &status, const QByteArray &type, const QByteArray &body)
+{
+    QByteArray response = "HTTP/1.0 " + status + "\r\nContent-Type: " + type + "\r\nContent-Length: ";
+    response += QByteArray::number(body.size()) + "\r\nConnection: close\r\n\r\n";
+    response += body;
+
+    m_requests.remove(device);
+    disconnect(device,SIGNAL(readyRead()),this,SLOT(readyRead()));
+    device->write(response);
+    closeClient(device);
+}
+
+//both socket types close once what was written is sent
+void CStatsServer::closeClient(QIODevice *device)
+{
+    QLocalSocket *local = qobject_cast<QLocalSocket*>(device);
+    if (local)
+        local->disconnectFromServer();
+    else
+        static_cast<QTcpSocket*>(device)->disconnectFromHost();
+}
+
+void CStatsServer::closeIdle()
+{
+    quint64 now = monotonicNs();
+    QList<QObject*> idle;
+    for (QHash<QObject*,Request>::const_iterator it = m_requests.constBegin();it != m_requests.constEnd();++it)
+        if (now - it.value().since > STATS_IDLE_TIMEOUT * 1000000000ULL)
+            idle.append(it.key());
+
+    for (int i=0;i<idle.size();i++)
+    {
+        QIODevice *device = static_cast<QIODevice*>(idle[i]);
+        m_requests.remove(device);
+        disconnect(device,SIGNAL(readyRead()),this,SLOT(readyRead()));
+        closeClient(device);
+    }
+
+    if (m_requests.isEmpty())
+        m_pIdleTimer->stop();
+}
+
+void CStatsServer::disconnected()
+{
+    m_requests.remove(sender());
+    sender()->deleteLater();
+}
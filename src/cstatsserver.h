@@ -0,0 +1,80 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CSTATSSERVER_H
+#define CSTATSSERVER_H
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QHash>
+
+struct DaemonStats;
+struct SharedPayload;
+class CAPNSd;
+class QLocalServer;
+class QTcpServer;
+class QIODevice;
+class QTimer;
+
+/*
+ * Serves the stats block in the Prometheus text format over HTTP/1.0 on
+ * 127.0.0.1:stats_port and the UNIX socket stats_socket. GET /metrics
+ * gets the metrics, any other request a 404, and the connection is
+ * closed. Clients that send no full request in time are dropped.
+ * Runs in the main thread, it only copies the counters.
+ */
+class CStatsServer : public QObject
+{
+    Q_OBJECT
+public:
+    CStatsServer(DaemonStats *stats, const SharedPayload *shared, CAPNSd *daemon);
+
+    void listen(const QString &socketPath, quint16 tcpPort);
+
+private slots:
+    void newLocalConnection();
+    void newTcpConnection();
+    void readyRead();
+    void disconnected();
+    void closeIdle();
+
+private:
+    struct Request
+    {
+        QByteArray data;
+        quint64 since;
+    };
+
+    void addClient(QIODevice *device);
+    void respond(QIODevice *device, const QByteArray &status, const QByteArray &type, const QByteArray &body);
+    void closeClient(QIODevice *device);
+
+    DaemonStats *m_pStats;
+    const SharedPayload *m_pShared;
+    CAPNSd *m_pDaemon;
+    QLocalServer *m_pLocalServer;
+    QTcpServer *m_pTcpServer;
+    QTimer *m_pIdleTimer;
+    QHash<QObject*,Request> m_requests;
+};
+
+#endif // CSTATSSERVER_H
@@ -0,0 +1,225 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "ctimingwheel.h"
+#include <string.h>
+
+CTimingWheel::CTimingWheel()
+{
+    memset(m_aSlots,0,sizeof(m_aSlots));
+    m_iFree = 0;
+    m_iAllocated = 0;
+    m_iDueHead = 0;
+    m_iDueTail = 0;
+    m_iNow = 0;
+    m_iCount = 0;
+    m_iDueCount = 0;
+}
+
+CTimingWheel::~CTimingWheel()
+{
+    for (int i=0;i<m_chunks.size();i++)
+        delete [] m_chunks[i];
+}
+
+void CTimingWheel::start(quint32 now)
+{
+    m_iNow = now;
+}
+
+quint32 CTimingWheel::allocEntry()
+{
+    if (m_iFree)
+    {
+        quint32 ref = m_iFree;
+        m_iFree = entry(ref).next;
+        return ref;
+    }
+
+    if (m_iAllocated == (quint32)m_chunks.size() * WHEEL_CHUNK)
+        m_chunks.append(new Entry[WHEEL_CHUNK]);
+    return ++m_iAllocated;
+}
+
+void CTimingWheel::freeEntry(quint32 ref)
+{
+    Entry &e = entry(ref);
+    e.json = QByteArray();
+    e.next = m_iFree;
+    m_iFree = ref;
+    m_iCount--;
+}
+
+void CTimingWheel::add(const PayloadData *payload, const char *json, quint64 seq)
+{
+    quint32 ref = allocEntry();
+    Entry &e = entry(ref);
+
+    memcpy(&e.payload,payload,sizeof(PayloadData));
+    e.payload.block = PAYLOAD_NO_BLOCK;
+    e.json = QByteArray(json,payload->length);
+    e.seq = seq;
+    m_iCount++;
+
+    place(ref);
+}
+
+void CTimingWheel::place(quint32 ref)
+{
+    Entry &e = entry(ref);
+    quint32 when = e.payload.sendAt;
+
+    if (when <= m_iNow)
+    {
+        appendDue(ref);
+        return;
+    }
+
+    quint32 delta = when - m_iNow;
+    if (delta >= 1U << (WHEEL_BITS * WHEEL_LEVELS))
+    {
+        delta = (1U << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+        when = m_iNow + delta;
+    }
+
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= 1U << (WHEEL_BITS * (level + 1)))
+        level++;
+
+    int slot = (when >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    e.next = m_aSlots[level][slot];
+    m_aSlots[level][slot] = ref;
+}
+
+void CTimingWheel::appendDue(quint32 ref)
+{
+    entry(ref).next = 0;
+    if (m_iDueTail)
+        entry(m_iDueTail).next = ref;
+    else
+        m_iDueHead = ref;
+    m_iDueTail = ref;
+    m_iDueCount++;
+}
+
+//spreads the entries of a slot over the lower levels
+void CTimingWheel::cascade(int level, int slot)
+{
+    quint32 ref = m_aSlots[level][slot];
+    m_aSlots[level][slot] = 0;
+
+    while (ref)
+    {
+        quint32 next = entry(ref).next;
+        place(ref);
+        ref = next;
+    }
+}
+
+void CTimingWheel::advance(quint32 now)
+{
+    //nothing waiting in the slots, no need to step through the gap
+    if (m_iCount == m_iDueCount && m_iNow < now)
+        m_iNow = now;
+
+    while (m_iNow < now)
+    {
+        m_iNow++;
+
+        for (int level=1;level<WHEEL_LEVELS;level++)
+        {
+            if (m_iNow & ((1U << (WHEEL_BITS * level)) - 1))
+                break;
+            cascade(level,(m_iNow >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+        }
+
+        //level 0 slots only hold entries due in exactly this second
+        cascade(0,m_iNow & (WHEEL_SLOTS - 1));
+    }
+}
+
+const PayloadData *CTimingWheel::due(const char **json, quint64 *seq)
+{
+    if (!m_iDueHead)
+        return 0;
+    Entry &e = entry(m_iDueHead);
+    *json = e.json.constData();
+    if (seq)
+        *seq = e.seq;
+    return &e.payload;
+}
+
+void CTimingWheel::popDue()
+{
+    quint32 ref = m_iDueHead;
+    m_iDueHead = entry(ref).next;
+    if (!m_iDueHead)
+        m_iDueTail = 0;
+    m_iDueCount--;
+    freeEntry(ref);
+}
+
+bool CTimingWheel::take(PayloadData *payload, QByteArray *json, quint64 *seq)
+{
+    if (!m_iDueHead)
+    {
+        for (int level=0;level<WHEEL_LEVELS && !m_iDueHead;level++)
+            for (int slot=0;slot<WHEEL_SLOTS && !m_iDueHead;slot++)
+                if (m_aSlots[level][slot])
+                {
+                    quint32 ref = m_aSlots[level][slot];
+                    m_aSlots[level][slot] = entry(ref).next;
+                    appendDue(ref);
+                }
+        if (!m_iDueHead)
+            return false;
+    }
+
+    Entry &e = entry(m_iDueHead);
+    memcpy(payload,&e.payload,sizeof(PayloadData));
+    *json = e.json;
+    if (seq)
+        *seq = e.seq;
+    popDue();
+    return true;
+}
+
+QVector<quint32> CTimingWheel::journaledBefore(quint64 seq)
+{
+    QVector<quint32> refs;
+    for (int level=0;level<WHEEL_LEVELS;level++)
+        for (int slot=0;slot<WHEEL_SLOTS;slot++)
+            for (quint32 ref=m_aSlots[level][slot];ref;ref=entry(ref).next)
+                if (entry(ref).seq && entry(ref).seq < seq)
+                    refs.append(ref);
+    for (quint32 ref=m_iDueHead;ref;ref=entry(ref).next)
+        if (entry(ref).seq && entry(ref).seq < seq)
+            refs.append(ref);
+    return refs;
+}
+
+const PayloadData *CTimingWheel::payload(quint32 ref, const char **json, quint64 *seq)
+{
+    Entry &e = entry(ref);
+    *json = e.json.constData();
+    *seq = e.seq;
+    return &e.payload;
+}
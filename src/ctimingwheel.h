@@ -0,0 +1,96 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CTIMINGWHEEL_H
+#define CTIMINGWHEEL_H
+
+#include <QByteArray>
+#include <QVector>
+#include "shared.h"
+
+#define WHEEL_LEVELS 4
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_CHUNK 4096
+
+/*
+ * Holds payloads until their send-at time (PayloadData::sendAt, UNIX epoch
+ * seconds). Four levels of 64 one second slots cover about 194 days,
+ * entries further out are parked in the last level and placed again when
+ * it cascades. Adding an entry and moving a due one out are O(1), entries
+ * live in chunks and are linked through their index.
+ *
+ * Due entries queue in arrival order until the caller takes them. An entry
+ * keeps the spool sequence number of its journal record, 0 for none, which
+ * the caller may move to a newer record.
+ */
+class CTimingWheel
+{
+public:
+    CTimingWheel();
+    ~CTimingWheel();
+
+    void start(quint32 now);
+    //copies the payload and its bytes, block is not kept
+    void add(const PayloadData *payload, const char *json, quint64 seq = 0);
+    void advance(quint32 now);
+
+    quint32 count() const { return m_iCount; }
+    quint32 dueCount() const { return m_iDueCount; }
+    const PayloadData *due(const char **json, quint64 *seq = 0);
+    void popDue();
+    //empties the wheel, due entries first
+    bool take(PayloadData *payload, QByteArray *json, quint64 *seq = 0);
+
+    //entries journaled before seq, the references hold until the wheel changes
+    QVector<quint32> journaledBefore(quint64 seq);
+    const PayloadData *payload(quint32 ref, const char **json, quint64 *seq);
+    void setSeq(quint32 ref, quint64 seq) { entry(ref).seq = seq; }
+
+private:
+    struct Entry
+    {
+        PayloadData payload;
+        QByteArray json;
+        quint64 seq;
+        quint32 next;
+    };
+
+    //references are index + 1, 0 ends a list
+    Entry &entry(quint32 ref) { return m_chunks[(ref - 1) / WHEEL_CHUNK][(ref - 1) % WHEEL_CHUNK]; }
+    quint32 allocEntry();
+    void freeEntry(quint32 ref);
+    void place(quint32 ref);
+    void appendDue(quint32 ref);
+    void cascade(int level, int slot);
+
+    QVector<Entry*> m_chunks;
+    quint32 m_aSlots[WHEEL_LEVELS][WHEEL_SLOTS];
+    quint32 m_iFree;
+    quint32 m_iAllocated;
+    quint32 m_iDueHead;
+    quint32 m_iDueTail;
+    quint32 m_iNow;
+    quint32 m_iCount;
+    quint32 m_iDueCount;
+};
+
+#endif // CTIMINGWHEEL_H
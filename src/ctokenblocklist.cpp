@@ -0,0 +1,160 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "ctokenblocklist.h"
+#include <QtEndian>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define BLOCKLIST_RECORD_SIZE (PAYLOAD_TOKEN_SIZE + 4)
+
+CTokenBlocklist::CTokenBlocklist()
+{
+    m_table.resize(1024);
+    memset(m_table.data(),0,sizeof(Entry) * m_table.size());
+    m_iMask = m_table.size() - 1;
+    m_iSize = 0;
+    m_pFile = 0;
+}
+
+CTokenBlocklist::~CTokenBlocklist()
+{
+    if (m_pFile)
+        fclose(m_pFile);
+}
+
+bool CTokenBlocklist::open(const QString &path, QString *error)
+{
+    QByteArray name = path.toLocal8Bit();
+    m_pFile = fopen(name.constData(),"a+b");
+    if (!m_pFile)
+    {
+        *error = "Could not open " + path + ": " + QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+
+    uchar record[BLOCKLIST_RECORD_SIZE];
+    rewind(m_pFile);
+    while (fread(record,BLOCKLIST_RECORD_SIZE,1,m_pFile) == 1)
+        insert(record,qFromBigEndian<quint32>(record + PAYLOAD_TOKEN_SIZE));
+
+    //a torn last record is overwritten by the next append
+    fseek(m_pFile,0,SEEK_END);
+    long size = ftell(m_pFile);
+    if (size % BLOCKLIST_RECORD_SIZE)
+    {
+        if (ftruncate(fileno(m_pFile),size - size % BLOCKLIST_RECORD_SIZE) < 0)
+        {
+            //appends still work, the torn record shifts them
+        }
+        fseek(m_pFile,0,SEEK_END);
+    }
+
+    return true;
+}
+
+void CTokenBlocklist::flush()
+{
+    if (m_pFile)
+        fflush(m_pFile);
+}
+
+quint32 CTokenBlocklist::hash(const uchar *token)
+{
+    //tokens are random already, mix the first 8 bytes
+    quint64 h;
+    memcpy(&h,token,sizeof(h));
+    h *= 0x9e3779b97f4a7c15ULL;
+    return (quint32)(h >> 32);
+}
+
+bool CTokenBlocklist::insert(const uchar *token, quint32 time)
+{
+    if (time == 0)
+        time = 1;
+
+    quint32 i = hash(token) & m_iMask;
+    while (m_table[i].time != 0)
+    {
+        if (memcmp(m_table[i].token,token,PAYLOAD_TOKEN_SIZE) == 0)
+        {
+            if (time > m_table[i].time)
+                m_table[i].time = time;
+            return false;
+        }
+        i = (i + 1) & m_iMask;
+    }
+
+    memcpy(m_table[i].token,token,PAYLOAD_TOKEN_SIZE);
+    m_table[i].time = time;
+    m_iSize++;
+
+    if (m_iSize * 2 > m_table.size())
+        grow();
+    return true;
+}
+
+void CTokenBlocklist::grow()
+{
+    QVector<Entry> old = m_table;
+    m_table.resize(old.size() * 2);
+    memset(m_table.data(),0,sizeof(Entry) * m_table.size());
+    m_iMask = m_table.size() - 1;
+
+    for (int n=0;n<old.size();n++)
+    {
+        if (old[n].time == 0)
+            continue;
+        quint32 i = hash(old[n].token) & m_iMask;
+        while (m_table[i].time != 0)
+            i = (i + 1) & m_iMask;
+        m_table[i] = old[n];
+    }
+}
+
+//returns true if the token was not listed yet
+bool CTokenBlocklist::add(const uchar *token, quint32 time)
+{
+    if (!insert(token,time))
+        return false;
+
+    if (m_pFile)
+    {
+        uchar record[BLOCKLIST_RECORD_SIZE];
+        memcpy(record,token,PAYLOAD_TOKEN_SIZE);
+        qToBigEndian<quint32>(time,record + PAYLOAD_TOKEN_SIZE);
+        fwrite(record,BLOCKLIST_RECORD_SIZE,1,m_pFile);
+    }
+    return true;
+}
+
+bool CTokenBlocklist::contains(const uchar *token) const
+{
+    quint32 i = hash(token) & m_iMask;
+    while (m_table[i].time != 0)
+    {
+        if (memcmp(m_table[i].token,token,PAYLOAD_TOKEN_SIZE) == 0)
+            return true;
+        i = (i + 1) & m_iMask;
+    }
+    return false;
+}
@@ -0,0 +1,70 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CTOKENBLOCKLIST_H
+#define CTOKENBLOCKLIST_H
+
+#include <QString>
+#include <QVector>
+#include <stdio.h>
+#include "shared.h"
+
+/*
+ * Set of device tokens Apple reported as no longer valid, open addressing
+ * with linear probing over a power of two table kept at most half full.
+ * Optionally backed by a file of token(32) time(4) records which is read
+ * by open() and appended to by add().
+ *
+ * Used from the drain thread only.
+ */
+class CTokenBlocklist
+{
+public:
+    CTokenBlocklist();
+    ~CTokenBlocklist();
+
+    bool open(const QString &path, QString *error);
+    void flush();
+
+    bool add(const uchar *token, quint32 time);
+    bool contains(const uchar *token) const;
+    int size() const { return m_iSize; }
+    bool isEmpty() const { return m_iSize == 0; }
+
+private:
+    struct Entry
+    {
+        uchar token[PAYLOAD_TOKEN_SIZE];
+        //feedback timestamp, 0 marks a free entry
+        quint32 time;
+    };
+
+    static quint32 hash(const uchar *token);
+    bool insert(const uchar *token, quint32 time);
+    void grow();
+
+    QVector<Entry> m_table;
+    quint32 m_iMask;
+    int m_iSize;
+    FILE *m_pFile;
+};
+
+#endif // CTOKENBLOCKLIST_H
@@ -0,0 +1,135 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "ctrace.h"
+#include "shared.h"
+#include "latency.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+CTrace::CTrace()
+{
+    m_iFd = -1;
+    m_iStart = 0;
+    m_iUsed = 0;
+    m_iCount = 0;
+}
+
+CTrace::~CTrace()
+{
+    close();
+}
+
+bool CTrace::open(const QString &path, QString *error)
+{
+    close();
+
+    QByteArray p = path.toLocal8Bit();
+    int fd = ::open(p.constData(),O_WRONLY | O_CREAT | O_TRUNC,0600);
+    if (fd < 0)
+    {
+        *error = "Could not create capture file " + path + ": " + QString::fromLocal8Bit(strerror(errno));
+        return false;
+    }
+
+    //record times are monotonic, the header maps them to wall clock time
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME,&ts);
+    m_iStart = monotonicNs();
+
+    TraceHeader header;
+    memset(&header,0,sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.recordSize = sizeof(TraceRecord);
+    header.started = (quint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    if (::write(fd,&header,sizeof(header)) != sizeof(header))
+    {
+        *error = "Could not write capture file " + path + ": " + QString::fromLocal8Bit(strerror(errno));
+        ::close(fd);
+        return false;
+    }
+
+    m_sPath = path;
+    m_iFd = fd;
+    m_buffer.resize(TRACE_BUFFER);
+    m_iUsed = 0;
+    m_iCount = 0;
+    return true;
+}
+
+void CTrace::close()
+{
+    if (m_iFd < 0)
+        return;
+
+    flush();
+    if (m_iFd >= 0)
+        ::close(m_iFd);
+    m_iFd = -1;
+}
+
+void CTrace::append(const PayloadData *payload)
+{
+    if (m_iUsed + (int)sizeof(TraceRecord) > m_buffer.size() && !flush())
+        return;
+
+    TraceRecord *record = reinterpret_cast<TraceRecord*>(m_buffer.data() + m_iUsed);
+    //queued before the capture started
+    record->time = payload->enqueued > m_iStart ? payload->enqueued - m_iStart : 0;
+    record->collapse = payload->collapse;
+    quint32 now = (quint32)::time(0);
+    record->delay = payload->sendAt > now ? payload->sendAt - now : 0;
+    record->length = payload->length;
+    record->priority = payload->priority;
+    record->app = payload->app;
+    memcpy(record->device,payload->device,PAYLOAD_TOKEN_SIZE);
+
+    m_iUsed += sizeof(TraceRecord);
+    m_iCount++;
+}
+
+bool CTrace::flush()
+{
+    const char *p = m_buffer.constData();
+    int left = m_iUsed;
+    while (left > 0)
+    {
+        ssize_t n = ::write(m_iFd,p,left);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            ::close(m_iFd);
+            m_iFd = -1;
+            m_iUsed = 0;
+            return false;
+        }
+        p += n;
+        left -= n;
+    }
+    m_iUsed = 0;
+    return true;
+}
@@ -0,0 +1,94 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef CTRACE_H
+#define CTRACE_H
+
+#include <QtGlobal>
+#include <QString>
+#include <QByteArray>
+
+struct PayloadData;
+
+/*
+ * Capture of the traffic the daemon takes in, for replaying it with
+ * APNSd replay. Only what shapes the load is kept, the payload bytes are
+ * not: a replayed payload is filler of the recorded length.
+ *
+ * File: header, then records in the order the drain took the payloads
+ * from the shared queue. That is the ingest order within a priority class,
+ * the two classes may be interleaved out of time order. Host byte order.
+ *
+ * Used from the drain thread only.
+ */
+
+#define TRACE_MAGIC 0x41504e54
+#define TRACE_VERSION 1
+#define TRACE_BUFFER (64 * 1024)
+
+struct TraceHeader
+{
+    quint32 magic;
+    quint32 version;
+    quint32 recordSize;
+    quint32 reserved;
+    quint64 started; //UNIX epoch ns of the first possible record
+};
+
+struct TraceRecord
+{
+    quint64 time; //ns after started the producer queued it
+    quint64 collapse; //collapseKeyHash(), 0 = none
+    quint32 delay; //send_at seconds after time, 0 = immediately
+    quint16 length; //payload bytes
+    quint8 priority;
+    quint8 app; //profile index, 0 in captures of a single app daemon
+    uchar device[32];
+};
+
+class CTrace
+{
+public:
+    CTrace();
+    ~CTrace();
+
+    //truncates path and writes a new header
+    bool open(const QString &path, QString *error);
+    void close();
+    bool isOpen() const { return m_iFd >= 0; }
+
+    void append(const PayloadData *payload);
+    //false when the file could not be written, the capture is closed then
+    bool flush();
+    bool pending() const { return m_iUsed > 0; }
+    quint64 count() const { return m_iCount; }
+    QString path() const { return m_sPath; }
+
+private:
+    QString m_sPath;
+    int m_iFd;
+    quint64 m_iStart;
+    QByteArray m_buffer;
+    int m_iUsed;
+    quint64 m_iCount;
+};
+
+#endif // CTRACE_H
@@ -0,0 +1,98 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef HEXDECODE_H
+#define HEXDECODE_H
+
+#include <QtGlobal>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Decodes a 64 character hex device token into 32 bytes. Returns false if
+ * any character is not a hex digit, out is undefined then. The SSE2 version
+ * handles 16 characters per step.
+ */
+static inline int hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static inline bool decodeHexTokenScalar(const char *hex, uchar *out)
+{
+    for (int i=0;i<32;i++)
+    {
+        int h = hexValue(hex[i * 2]);
+        int l = hexValue(hex[i * 2 + 1]);
+        if (h < 0 || l < 0)
+            return false;
+        out[i] = (uchar)((h << 4) | l);
+    }
+    return true;
+}
+
+#ifdef __SSE2__
+static inline bool decodeHexToken(const char *hex, uchar *out)
+{
+    const __m128i digit0 = _mm_set1_epi8('0' - 1);
+    const __m128i digit9 = _mm_set1_epi8('9' + 1);
+    const __m128i alphaa = _mm_set1_epi8('a' - 1);
+    const __m128i alphaf = _mm_set1_epi8('f' + 1);
+    const __m128i lowercase = _mm_set1_epi8(0x20);
+    const __m128i digitbase = _mm_set1_epi8('0');
+    const __m128i alphabase = _mm_set1_epi8('a' - 10);
+    const __m128i lowbyte = _mm_set1_epi16(0x00ff);
+
+    for (int i=0;i<4;i++)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(hex + i * 16));
+        __m128i l = _mm_or_si128(v,lowercase);
+
+        //signed compares, bytes >= 0x80 fail both ranges
+        __m128i isdigit = _mm_and_si128(_mm_cmpgt_epi8(v,digit0),_mm_cmplt_epi8(v,digit9));
+        __m128i isalpha = _mm_and_si128(_mm_cmpgt_epi8(l,alphaa),_mm_cmplt_epi8(l,alphaf));
+        if (_mm_movemask_epi8(_mm_or_si128(isdigit,isalpha)) != 0xffff)
+            return false;
+
+        __m128i nibbles = _mm_or_si128(_mm_and_si128(isdigit,_mm_sub_epi8(v,digitbase)),
+                                       _mm_and_si128(isalpha,_mm_sub_epi8(l,alphabase)));
+
+        //each 16 bit lane holds high nibble | low nibble << 8
+        __m128i bytes = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(nibbles,lowbyte),4),_mm_srli_epi16(nibbles,8));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + i * 8),_mm_packus_epi16(bytes,bytes));
+    }
+    return true;
+}
+#else
+static inline bool decodeHexToken(const char *hex, uchar *out)
+{
+    return decodeHexTokenScalar(hex,out);
+}
+#endif
+
+#endif // HEXDECODE_H
@@ -0,0 +1,103 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <QtGlobal>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Log-linear latency histogram. Values are nanoseconds, every power of two
+ * is split in 16 buckets so percentiles are accurate to ~6%.
+ * Plain data only, so it can be embedded anywhere.
+ */
+
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB_COUNT (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_COUNT)
+
+static inline quint64 monotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (quint64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+struct LatencyHistogram
+{
+    quint64 count;
+    quint64 sum;
+    quint64 max;
+    quint32 buckets[LATENCY_BUCKETS];
+
+    static int bucketOf(quint64 v)
+    {
+        if (v < LATENCY_SUB_COUNT)
+            return (int)v;
+        int shift = 63 - __builtin_clzll(v) - LATENCY_SUB_BITS;
+        return (shift + 1) * LATENCY_SUB_COUNT + (int)((v >> shift) & (LATENCY_SUB_COUNT - 1));
+    }
+
+    static quint64 bucketHigh(int b)
+    {
+        if (b < LATENCY_SUB_COUNT)
+            return b;
+        int shift = b / LATENCY_SUB_COUNT - 1;
+        quint64 low = (quint64)(LATENCY_SUB_COUNT + b % LATENCY_SUB_COUNT) << shift;
+        return low + ((1ULL << shift) - 1);
+    }
+
+    void reset()
+    {
+        memset(this,0,sizeof(LatencyHistogram));
+    }
+
+    void record(quint64 ns)
+    {
+        count++;
+        sum += ns;
+        if (ns > max)
+            max = ns;
+        buckets[bucketOf(ns)]++;
+    }
+
+    //q in [0,1], returns the upper bound of the bucket holding that quantile
+    quint64 percentile(double q) const
+    {
+        if (count == 0)
+            return 0;
+        quint64 target = (quint64)(q * count + 0.5);
+        if (target == 0)
+            target = 1;
+        quint64 seen = 0;
+        for (int b=0;b<LATENCY_BUCKETS;b++)
+        {
+            seen += buckets[b];
+            if (seen >= target)
+                return bucketHigh(b) < max ? bucketHigh(b) : max;
+        }
+        return max;
+    }
+};
+
+#endif // LATENCY_H
@@ -31,9 +31,28 @@
 #include <signal.h>
 #include "capnsd.h"
 #include "shared.h"
+#include "latency.h"
+#include "hexdecode.h"
+#include "cbroadcastjob.h"
+#include "stats.h"
+#include "ctrace.h"
 #include <QTimer>
 #include <QString>
+#include <QStringList>
 #include <QByteArray>
+#include <QSettings>
+#include <QVector>
+#include <QFileInfo>
+#include <QDir>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+
+#define PUSH_BATCH_SIZE 1024
+#define PUSH_BATCH_TIMEOUT 30
+#define REPLAY_WINDOW 65536
+#define REPLAY_LATE_NS 10000000ULL
 
 static int setup_unix_signal_handlers()
 {
@@ -57,10 +76,475 @@ static int setup_unix_signal_handlers()
     return 0;
 }
 
+//counts a push the full queue refused in the daemon stats, if it runs
+static void count_queue_full()
+{
+    QSharedMemory statsshare(STATS_SEGMENT);
+    if (!statsshare.attach())
+        return;
+    DaemonStats *stats = static_cast<DaemonStats*>(statsshare.data());
+    if (stats->valid(statsshare.size()))
+        statAddShared(&stats->pushQueueFull);
+    statsshare.detach();
+}
+
+//copies the stats block, the daemon keeps writing while it is read
+static int print_stats(bool prometheus)
+{
+    QSharedMemory statsshare(STATS_SEGMENT);
+    if (!statsshare.attach(QSharedMemory::ReadOnly))
+    {
+        std::cout << statsshare.errorString().toStdString() << "\n";
+        std::cout << "APNSd service not running?\n";
+        return EXIT_FAILURE;
+    }
+
+    const DaemonStats *shared = static_cast<const DaemonStats*>(statsshare.constData());
+    if (!shared->valid(statsshare.size()))
+    {
+        std::cout << "Stats block has an unknown layout. (APNSd version mismatch?)\n";
+        statsshare.detach();
+        return EXIT_FAILURE;
+    }
+
+    DaemonStats *copy = new DaemonStats;
+    memcpy(copy,shared,sizeof(DaemonStats));
+    statsshare.detach();
+
+    //arena use per app, left out when the payload segment is gone
+    QSharedMemory payloadshare("APNSdShared");
+    const SharedPayload *data = 0;
+    if (payloadshare.attach(QSharedMemory::ReadOnly))
+    {
+        data = static_cast<const SharedPayload*>(payloadshare.constData());
+        if (!data->valid(payloadshare.size()))
+            data = 0;
+    }
+
+    QByteArray out = prometheus ? statsPrometheus(copy,data) : statsText(copy,data);
+    delete copy;
+    if (payloadshare.isAttached())
+        payloadshare.detach();
+    std::cout.write(out.constData(),out.size());
+    return EXIT_SUCCESS;
+}
+
+//10 or 5, range checked before narrowing so 266 does not pass as 10
+static bool parse_priority(const char *arg, quint8 *priority)
+{
+    char *end;
+    long value = strtol(arg,&end,10);
+    if (end == arg || *end != 0 || value < 0 || value > 10)
+        return false;
+    *priority = (quint8)value;
+    return *priority == PAYLOAD_PRIORITY_IMMEDIATE || *priority == PAYLOAD_PRIORITY_CONSERVE;
+}
+
+/*
+ * Parses "<device_id> <base64 json> [priority] [expiry] [send_at]
+ * [collapse_key] [app]", returns false for a malformed line or an unknown
+ * app. A collapse key of - is none.
+ */
+static bool parse_batch_line(const SharedPayload *data, char *line, PayloadData *payload, QByteArray *jsonstr)
+{
+    char *save;
+    char *token = strtok_r(line," \t\r\n",&save);
+    char *json = strtok_r(0," \t\r\n",&save);
+    char *priority = strtok_r(0," \t\r\n",&save);
+    char *expiry = strtok_r(0," \t\r\n",&save);
+    char *sendat = strtok_r(0," \t\r\n",&save);
+    char *collapse = strtok_r(0," \t\r\n",&save);
+    char *app = strtok_r(0," \t\r\n",&save);
+
+    if (!token || !json || strlen(token) != 64 || strtok_r(0," \t\r\n",&save))
+        return false;
+    if (!decodeHexToken(token,payload->device))
+        return false;
+
+    *jsonstr = QByteArray::fromBase64(QByteArray::fromRawData(json,strlen(json)));
+    if (jsonstr->size() > PAYLOAD_MAX_SIZE || jsonstr->size() == 0)
+        return false;
+
+    payload->priority = PAYLOAD_PRIORITY_IMMEDIATE;
+    if (priority && !parse_priority(priority,&payload->priority))
+        return false;
+    payload->expiry = expiry ? (quint32)strtoul(expiry,0,10) : 0;
+    payload->sendAt = sendat ? (quint32)strtoul(sendat,0,10) : 0;
+    if (collapse && strcmp(collapse,"-") == 0)
+        collapse = 0;
+    if (collapse && strlen(collapse) > PAYLOAD_COLLAPSE_KEY_MAX)
+        return false;
+    payload->collapse = collapse ? collapseKeyHash(collapse,strlen(collapse)) : 0;
+    int index = app ? data->findApp(app,strlen(app)) : 0;
+    if (index < 0)
+        return false;
+    payload->app = index;
+    payload->length = jsonstr->size();
+    payload->block = PAYLOAD_NO_BLOCK;
+    return true;
+}
+
+/*
+ * Streams records into the shared queue, reserving slots for up to
+ * PUSH_BATCH_SIZE records at a time. Waits while the queue or the payload
+ * arena is full and gives up when it did not move for PUSH_BATCH_TIMEOUT
+ * seconds.
+ */
+static int push_batch(SharedPayload *data, FILE *in)
+{
+    QVector<PayloadData> batch;
+    QVector<QByteArray> jsons;
+    batch.resize(PUSH_BATCH_SIZE);
+    jsons.resize(PUSH_BATCH_SIZE);
+    //a 4096 byte payload takes 5464 base64 characters
+    char line[8192];
+    quint64 queued = 0;
+    quint64 invalid = 0;
+    quint64 lineno = 0;
+    bool eof = false;
+
+    while (!eof)
+    {
+        int count = 0;
+        while (count < PUSH_BATCH_SIZE)
+        {
+            if (!fgets(line,sizeof(line),in))
+            {
+                eof = true;
+                break;
+            }
+            lineno++;
+            size_t len = strlen(line);
+            if (len == sizeof(line) - 1 && line[len - 1] != '\n')
+            {
+                //no record is that long, skip the rest of the line
+                int c;
+                while ((c = fgetc(in)) != EOF && c != '\n')
+                    ;
+                std::cout << "Invalid record on line " << lineno << ", the line is too long.\n";
+                invalid++;
+                continue;
+            }
+            if (line[strspn(line," \t\r\n")] == 0 || line[0] == '#')
+                continue;
+            if (!parse_batch_line(data,line,&batch[count],&jsons[count]))
+            {
+                std::cout << "Invalid record on line " << lineno << ".\n";
+                invalid++;
+                continue;
+            }
+            count++;
+        }
+
+        int done = 0;
+        int allocated = 0;
+        quint64 waitstart = 0;
+        while (done < count)
+        {
+            for (;allocated < count;allocated++)
+            {
+                PayloadData *payload = &batch[allocated];
+                payload->block = data->allocPayload(payload->length,payload->app);
+                if (payload->block == PAYLOAD_NO_BLOCK)
+                    break;
+                memcpy(data->payloadBytes(payload->block),jsons[allocated].constData(),payload->length);
+            }
+
+            //slots are reserved for a run of records of the same app and class
+            int ring = payloadRing(batch[done].app,batch[done].priority);
+            int run = done;
+            while (run < allocated && payloadRing(batch[run].app,batch[run].priority) == ring)
+                run++;
+
+            quint32 pos;
+            quint32 n = run > done ? data->claimBatch(ring,run - done,&pos) : 0;
+
+            if (n == 0)
+            {
+                quint64 now = monotonicNs();
+                if (waitstart == 0)
+                    waitstart = now;
+                else if (now - waitstart > PUSH_BATCH_TIMEOUT * 1000000000ULL)
+                {
+                    //blocks of the records that never made it into the queue
+                    for (int i=done;i<allocated;i++)
+                        data->freePayload(batch[i].block,batch[i].app);
+                    std::cout << "Payload queue is full. Queued " << queued << " payloads.\n";
+                    count_queue_full();
+                    return EXIT_FAILURE;
+                }
+                data->wakeConsumer();
+                usleep(1000);
+                continue;
+            }
+            waitstart = 0;
+
+            quint64 enqueued = monotonicNs();
+            for (quint32 i=0;i<n;i++)
+            {
+                const PayloadData *payload = &batch[done + i];
+                PayloadData *slot = data->slot(ring,pos + i);
+                memcpy(slot->device,payload->device,PAYLOAD_TOKEN_SIZE);
+                slot->length = payload->length;
+                slot->block = payload->block;
+                slot->priority = payload->priority;
+                slot->expiry = payload->expiry;
+                slot->sendAt = payload->sendAt;
+                slot->collapse = payload->collapse;
+                slot->app = payload->app;
+                slot->enqueued = enqueued;
+                data->publish(slot,pos + i);
+            }
+            data->wakeConsumer();
+
+            done += n;
+            queued += n;
+        }
+    }
+
+    if (ferror(in))
+    {
+        std::cout << "Read error: " << strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Queued " << queued << " payloads";
+    if (invalid)
+        std::cout << ", skipped " << invalid << " invalid records";
+    std::cout << ".\n";
+
+    return invalid ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+//min heap on the record time
+static bool replay_later(const TraceRecord &a, const TraceRecord &b)
+{
+    return a.time > b.time;
+}
+
+//filler json of exactly len bytes
+static void replay_json(char *json, int len)
+{
+    if (len < 20)
+    {
+        memset(json,' ',len);
+        json[0] = '{';
+        json[len - 1] = '}';
+        return;
+    }
+    memcpy(json,"{\"aps\":{\"alert\":\"",17);
+    memset(json + 17,'x',len - 20);
+    memcpy(json + len - 3,"\"}}",3);
+}
+
+/*
+ * Feeds a capture file into the shared queue, record times divided by
+ * speed (0 = as fast as the queue takes them). Records are reordered in a
+ * window of REPLAY_WINDOW, the capture interleaves the priority classes.
+ * Waits while the queue is full and gives up when it did not move for
+ * PUSH_BATCH_TIMEOUT seconds.
+ */
+static int replay(SharedPayload *data, FILE *in, double speed)
+{
+    TraceHeader header;
+    if (fread(&header,sizeof(header),1,in) != 1 || header.magic != TRACE_MAGIC || header.version != TRACE_VERSION
+            || header.recordSize != sizeof(TraceRecord))
+    {
+        std::cout << "Not an APNSd capture file.\n";
+        return EXIT_FAILURE;
+    }
+
+    QVector<TraceRecord> window;
+    window.reserve(REPLAY_WINDOW);
+    char json[PAYLOAD_MAX_SIZE];
+    quint64 queued = 0;
+    quint64 late = 0;
+    quint64 maxlag = 0;
+    quint64 span = 0;
+    quint64 waitstart = 0;
+    bool eof = false;
+    quint64 start = monotonicNs();
+
+    for (;;)
+    {
+        TraceRecord record;
+        while (!eof && window.size() < REPLAY_WINDOW)
+        {
+            if (fread(&record,sizeof(record),1,in) != 1)
+            {
+                eof = true;
+                break;
+            }
+            if (record.length == 0 || record.length > PAYLOAD_MAX_SIZE)
+                continue;
+            window.append(record);
+            std::push_heap(window.begin(),window.end(),replay_later);
+        }
+        if (window.isEmpty())
+            break;
+
+        const TraceRecord &next = window.first();
+        quint64 due = speed > 0 ? start + (quint64)(next.time / speed) : 0;
+        quint64 now = monotonicNs();
+        if (now < due)
+        {
+            data->wakeConsumer();
+            quint64 wait = due - now;
+            usleep(wait > 100000000ULL ? 100000 : (useconds_t)(wait / 1000));
+            continue;
+        }
+
+        //apps the running daemon does not have go to the default one
+        quint8 app = next.app < data->apps ? next.app : 0;
+        quint32 block = data->allocPayload(next.length,app);
+        quint32 pos;
+        PayloadData *slot = block != PAYLOAD_NO_BLOCK ? data->claim(payloadRing(app,next.priority),&pos) : 0;
+        if (!slot)
+        {
+            if (block != PAYLOAD_NO_BLOCK)
+                data->freePayload(block,app);
+            if (waitstart == 0)
+                waitstart = now;
+            else if (now - waitstart > PUSH_BATCH_TIMEOUT * 1000000000ULL)
+            {
+                std::cout << "Payload queue is full. Replayed " << queued << " payloads.\n";
+                count_queue_full();
+                return EXIT_FAILURE;
+            }
+            data->wakeConsumer();
+            usleep(1000);
+            continue;
+        }
+        waitstart = 0;
+
+        replay_json(json,next.length);
+        memcpy(data->payloadBytes(block),json,next.length);
+        memcpy(slot->device,next.device,PAYLOAD_TOKEN_SIZE);
+        slot->length = next.length;
+        slot->block = block;
+        slot->priority = next.priority;
+        slot->expiry = 0;
+        slot->sendAt = next.delay ? (quint32)::time(0) + (quint32)(speed > 0 ? next.delay / speed : 0) : 0;
+        slot->collapse = next.collapse;
+        slot->app = app;
+        slot->enqueued = now;
+        data->publish(slot,pos);
+
+        if (speed > 0 && now - due > REPLAY_LATE_NS)
+            late++;
+        if (speed > 0 && now - due > maxlag)
+            maxlag = now - due;
+        span = qMax(span,next.time);
+        queued++;
+        if ((queued & 255) == 0)
+            data->wakeConsumer();
+
+        std::pop_heap(window.begin(),window.end(),replay_later);
+        window.resize(window.size() - 1);
+    }
+    data->wakeConsumer();
+
+    if (ferror(in))
+    {
+        std::cout << "Read error: " << strerror(errno) << "\n";
+        return EXIT_FAILURE;
+    }
+
+    printf("Replayed %llu payloads in %.2f s, the capture covers %.2f s.\n",(unsigned long long)queued,
+           (monotonicNs() - start) / 1e9,span / 1e9);
+    if (speed > 0)
+        printf("%llu payloads more than 10 ms behind schedule, at most %.1f ms.\n",(unsigned long long)late,maxlag / 1e6);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Hands a broadcast to the daemon as a job file in its broadcast
+ * directory, the rename makes it appear complete.
+ */
+static int broadcast(const char *tokens, const char *json64, int argc, char *argv[])
+{
+    QFileInfo tokenfile(QString::fromLocal8Bit(tokens));
+
+    if (!tokenfile.isFile() || tokenfile.size() == 0 || tokenfile.size() % PAYLOAD_TOKEN_SIZE)
+    {
+        std::cout << "Token file must hold 32 byte binary device tokens.\n";
+        return EXIT_FAILURE;
+    }
+
+    QByteArray jsonstr = QByteArray::fromBase64(QByteArray(json64));
+    if (jsonstr.size() > PAYLOAD_MAX_SIZE || jsonstr.size() == 0)
+    {
+        std::cout << "Payload is empty or too large (PAYLOAD_MAX_SIZE is max).\n";
+        return EXIT_FAILURE;
+    }
+
+    quint8 priority = PAYLOAD_PRIORITY_IMMEDIATE;
+    quint32 expiry = 0;
+
+    if (argc >= 5)
+    {
+        if (!parse_priority(argv[4],&priority))
+        {
+            std::cout << "Invalid priority (use 10 or 5).\n";
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (argc >= 6)
+        expiry = (quint32)strtoul(argv[5],0,10);
+
+    //checked by the daemon when it picks up the job
+    QString app = argc >= 7 ? QString::fromLocal8Bit(argv[6]) : QString();
+
+    QString error;
+    Config *config = Config::load(APNSD_CONFIG_FILE,&error,false);
+    if (!config)
+    {
+        std::cout << error.toStdString() << "\n";
+        return EXIT_FAILURE;
+    }
+    QString dir = config->broadcastDir;
+    delete config;
+    //names sort in submission order
+    QString name = dir + "/" + QString::number((quint64)time(0)).rightJustified(12,'0') + "-" + QString::number(getpid());
+
+    {
+        QSettings job(name + ".job.tmp",QSettings::IniFormat);
+        job.setValue("tokens",tokenfile.absoluteFilePath());
+        job.setValue("payload",jsonstr.toBase64());
+        job.setValue("priority",(int)priority);
+        job.setValue("expiry",(uint)expiry);
+        if (!app.isEmpty())
+            job.setValue("app",app);
+        job.sync();
+
+        if (job.status() != QSettings::NoError)
+        {
+            std::cout << "Could not write the broadcast job to " << dir.toStdString() << ".\n";
+            ::unlink((name + ".job.tmp").toLocal8Bit().constData());
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (::rename((name + ".job.tmp").toLocal8Bit().constData(),(name + ".job").toLocal8Bit().constData()) < 0)
+    {
+        std::cout << "Could not queue the broadcast job: " << strerror(errno) << "\n";
+        ::unlink((name + ".job.tmp").toLocal8Bit().constData());
+        return EXIT_FAILURE;
+    }
+
+    std::cout << "Queued broadcast to " << tokenfile.size() / PAYLOAD_TOKEN_SIZE << " devices.\n";
+    return EXIT_SUCCESS;
+}
+
 void usage()
 {
     std::cout << "APNSd v0.1\n";
-    std::cout << "APNSd push <device_id> <json string>; send push payload\n";
+    std::cout << "APNSd push <device_id> <json string> [priority] [expiry] [send_at] [collapse_key|-] [app]; send push payload\n";
+    std::cout << "APNSd push-batch [file]; send one push payload per line of file or stdin\n";
+    std::cout << "APNSd broadcast <token file> <json string> [priority] [expiry] [app]; send one push payload to every device in a file of 32 byte tokens\n";
+    std::cout << "APNSd replay <capture file> [speed|max]; queue captured traffic again, at its own pace by default\n";
+    std::cout << "APNSd stats [prometheus]; print the counters and latencies of the running daemon\n";
     std::cout << "APNSd d; start as daemon\n";
 }
 
@@ -72,7 +556,7 @@ int main(int argc, char *argv[])
     {
         if (strcmp(argv[1],"push") == 0)
         {
-            if (argc != 4)
+            if (argc < 4 || argc > 9)
             {
                 std::cout << "Missing payload or device identifier.\n";
                 usage();
@@ -88,38 +572,214 @@ int main(int argc, char *argv[])
                 return EXIT_FAILURE;
             }
 
-            if (strlen(argv[2]) != 64)
+            uchar device[PAYLOAD_TOKEN_SIZE];
+            if (strlen(argv[2]) != 64 || !decodeHexToken(argv[2],device))
             {
                 std::cout << "Invalid device identifier.\n";
                 return EXIT_FAILURE;
             }
 
             QByteArray jsonstrd(argv[3]);
-            QString jsonstr = QString::fromUtf8(QByteArray::fromBase64(jsonstrd));
+            QByteArray jsonstr = QByteArray::fromBase64(jsonstrd);
 
-            if (strlen(jsonstr.toStdString().c_str()) >= PAYLOAD_JSONSTR_SIZE)
+            if (jsonstr.size() > PAYLOAD_MAX_SIZE || jsonstr.size() == 0)
             {
-                std::cout << "Payload is too large (PAYLOAD_JSONSTR_SIZE is max).\n";
+                std::cout << "Payload is empty or too large (PAYLOAD_MAX_SIZE is max).\n";
                 return EXIT_FAILURE;
             }
 
+            quint8 priority = PAYLOAD_PRIORITY_IMMEDIATE;
+            quint32 expiry = 0;
+            quint32 sendat = 0;
+            quint64 collapse = 0;
+
+            if (argc >= 5)
+            {
+                if (!parse_priority(argv[4],&priority))
+                {
+                    std::cout << "Invalid priority (use 10 or 5).\n";
+                    return EXIT_FAILURE;
+                }
+            }
+
+            if (argc >= 6)
+                expiry = (quint32)strtoul(argv[5],0,10);
+
+            if (argc >= 7)
+                sendat = (quint32)strtoul(argv[6],0,10);
+
+            if (argc >= 8 && strcmp(argv[7],"-") != 0)
+            {
+                if (strlen(argv[7]) == 0 || strlen(argv[7]) > PAYLOAD_COLLAPSE_KEY_MAX)
+                {
+                    std::cout << "Collapse key is empty or longer than 64 bytes.\n";
+                    return EXIT_FAILURE;
+                }
+                collapse = collapseKeyHash(argv[7],strlen(argv[7]));
+            }
+
             SharedPayload *data = static_cast<SharedPayload*>(payloadshare.data());
-            payloadshare.lock();
 
-            if (data->size >= PAYLOAD_ARRAY_SIZE)
-                std::cout << "Payload queue is full.\n";
-            else
+            if (!data->valid(payloadshare.size()))
+            {
+                std::cout << "Shared payload queue has an unknown layout. (APNSd version mismatch?)\n";
+                payloadshare.detach();
+                return EXIT_FAILURE;
+            }
+
+            int app = argc >= 9 ? data->findApp(argv[8],strlen(argv[8])) : 0;
+            if (app < 0)
             {
-                int index = data->size++;
-                memcpy(data->data[index].device,argv[2],64);
-                strcpy(data->data[index].json,jsonstr.toStdString().c_str());
+                std::cout << "Unknown app " << argv[8] << ".\n";
+                payloadshare.detach();
+                return EXIT_FAILURE;
             }
 
-            payloadshare.unlock();
+            quint32 block = data->allocPayload(jsonstr.size(),app);
+            quint32 pos;
+            PayloadData *slot = block != PAYLOAD_NO_BLOCK ? data->claim(payloadRing(app,priority),&pos) : 0;
+
+            if (!slot)
+            {
+                if (block != PAYLOAD_NO_BLOCK)
+                    data->freePayload(block,app);
+                std::cout << "Payload queue is full.\n";
+                payloadshare.detach();
+                count_queue_full();
+                return EXIT_FAILURE;
+            }
+
+            memcpy(data->payloadBytes(block),jsonstr.constData(),jsonstr.size());
+            memcpy(slot->device,device,PAYLOAD_TOKEN_SIZE);
+            slot->length = jsonstr.size();
+            slot->block = block;
+            slot->priority = priority;
+            slot->expiry = expiry;
+            slot->sendAt = sendat;
+            slot->collapse = collapse;
+            slot->app = app;
+            slot->enqueued = monotonicNs();
+            data->publish(slot,pos);
+            data->wakeConsumer();
+
             payloadshare.detach();
 
             return EXIT_SUCCESS;
         }
+        else if (strcmp(argv[1],"push-batch") == 0)
+        {
+            if (argc > 3)
+            {
+                usage();
+                return EXIT_FAILURE;
+            }
+
+            FILE *in = stdin;
+            if (argc == 3 && strcmp(argv[2],"-") != 0)
+            {
+                in = fopen(argv[2],"r");
+                if (!in)
+                {
+                    std::cout << "Could not open " << argv[2] << ": " << strerror(errno) << "\n";
+                    return EXIT_FAILURE;
+                }
+            }
+
+            QSharedMemory payloadshare("APNSdShared");
+            if (!payloadshare.attach())
+            {
+                std::cout << payloadshare.errorString().toStdString() << "\n";
+                std::cout << "APNSd service not running?\n";
+                return EXIT_FAILURE;
+            }
+
+            SharedPayload *data = static_cast<SharedPayload*>(payloadshare.data());
+
+            if (!data->valid(payloadshare.size()))
+            {
+                std::cout << "Shared payload queue has an unknown layout. (APNSd version mismatch?)\n";
+                payloadshare.detach();
+                return EXIT_FAILURE;
+            }
+
+            int ret = push_batch(data,in);
+
+            payloadshare.detach();
+            if (in != stdin)
+                fclose(in);
+
+            return ret;
+        }
+        else if (strcmp(argv[1],"replay") == 0)
+        {
+            if (argc < 3 || argc > 4)
+            {
+                usage();
+                return EXIT_FAILURE;
+            }
+
+            double speed = 1;
+            if (argc == 4)
+                speed = strcmp(argv[3],"max") == 0 ? 0 : atof(argv[3]);
+            if (speed < 0 || (argc == 4 && speed == 0 && strcmp(argv[3],"max") != 0))
+            {
+                std::cout << "Invalid speed (use a factor like 1, 10 or 0.5, or max).\n";
+                return EXIT_FAILURE;
+            }
+
+            FILE *in = fopen(argv[2],"r");
+            if (!in)
+            {
+                std::cout << "Could not open " << argv[2] << ": " << strerror(errno) << "\n";
+                return EXIT_FAILURE;
+            }
+
+            QSharedMemory payloadshare("APNSdShared");
+            if (!payloadshare.attach())
+            {
+                std::cout << payloadshare.errorString().toStdString() << "\n";
+                std::cout << "APNSd service not running?\n";
+                fclose(in);
+                return EXIT_FAILURE;
+            }
+
+            SharedPayload *data = static_cast<SharedPayload*>(payloadshare.data());
+
+            if (!data->valid(payloadshare.size()))
+            {
+                std::cout << "Shared payload queue has an unknown layout. (APNSd version mismatch?)\n";
+                payloadshare.detach();
+                fclose(in);
+                return EXIT_FAILURE;
+            }
+
+            int ret = replay(data,in,speed);
+
+            payloadshare.detach();
+            fclose(in);
+
+            return ret;
+        }
+        else if (strcmp(argv[1],"broadcast") == 0)
+        {
+            if (argc < 4 || argc > 7)
+            {
+                std::cout << "Missing payload or token file.\n";
+                usage();
+                return EXIT_FAILURE;
+            }
+
+            return broadcast(argv[2],argv[3],argc,argv);
+        }
+        else if (strcmp(argv[1],"stats") == 0)
+        {
+            if (argc > 3 || (argc == 3 && strcmp(argv[2],"prometheus") != 0))
+            {
+                usage();
+                return EXIT_FAILURE;
+            }
+            return print_stats(argc == 3);
+        }
         else if (strcmp(argv[1],"d") == 0)
         {
             bDaemon = true;
@@ -179,12 +839,35 @@ int main(int argc, char *argv[])
 
     setup_unix_signal_handlers();
 
+    QCoreApplication a(argc, argv);
+
+    QCoreApplication::setApplicationName("APNSd");
+    QCoreApplication::setApplicationVersion("0.1");
+
+    //the shared segment is laid out from the same snapshot the daemon runs with
+    QString error;
+    Config *config = 0;
+    if (Config::createDefault(APNSD_CONFIG_FILE))
+        error = "Missing settings. Settings file recreated.";
+    else
+        config = Config::load(APNSD_CONFIG_FILE,&error);
+    if (!config)
+    {
+        if (bDaemon)
+            syslog(LOG_ALERT,"%s",error.toStdString().c_str());
+        else
+            std::cout << error.toStdString() << "\n";
+        return EXIT_FAILURE;
+    }
+    ConfigSnapshot snapshot(config);
+    int apps = config->apps.size();
+
     QSharedMemory payloadshare("APNSdShared");
 
-    if (!payloadshare.create(sizeof(SharedPayload)))
+    if (!payloadshare.create(SharedPayload::segmentSize(config->payloadQueueSize,apps,config->arenaSize)))
     {
         if (bDaemon)
-            syslog(LOG_ALERT,payloadshare.errorString().toStdString().c_str());
+            syslog(LOG_ALERT,"%s",payloadshare.errorString().toStdString().c_str());
         else
             std::cout << payloadshare.errorString().toStdString() << "\n";
         if (payloadshare.attach())
@@ -192,23 +875,36 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    SharedPayload *data = new (payloadshare.data()) SharedPayload;
+    SharedPayload *data = static_cast<SharedPayload*>(payloadshare.data());
+
+    memset(payloadshare.data(),0,payloadshare.size());
+    for (int i=0;i<apps;i++)
+        qstrncpy(data->appNames[i],config->apps[i].name.toUtf8().constData(),PAYLOAD_APP_NAME_MAX);
+    data->init(config->payloadQueueSize,apps,config->arenaSize,config->arenaQuota);
+
+    QSharedMemory statsshare(STATS_SEGMENT);
 
-    for (int i=0;i<PAYLOAD_ARRAY_SIZE;i++)
+    if (!statsshare.create(sizeof(DaemonStats)))
     {
-        memset(data->data[i].device,0,64);
-        memset(data->data[i].json,0,PAYLOAD_JSONSTR_SIZE);
+        if (bDaemon)
+            syslog(LOG_ALERT,"%s",statsshare.errorString().toStdString().c_str());
+        else
+            std::cout << statsshare.errorString().toStdString() << "\n";
+        if (statsshare.attach())
+            statsshare.detach();
+        payloadshare.detach();
+        return EXIT_FAILURE;
     }
 
-    QCoreApplication a(argc, argv);
-
-    QCoreApplication::setApplicationName("APNSd");
-    QCoreApplication::setApplicationVersion("0.1");
+    DaemonStats *stats = static_cast<DaemonStats*>(statsshare.data());
+    stats->init(CONNECTION_POOL_MAX);
 
-    CAPNSd server(&payloadshare,data,bDaemon);
+    CAPNSd server(snapshot,&payloadshare,data,stats,bDaemon);
     QTimer::singleShot(0,&server,SLOT(setup()));
 
     a.exec();
+    server.shutdown();
+    statsshare.detach();
     payloadshare.detach();
     closelog();
     return EXIT_SUCCESS;
@@ -22,26 +22,520 @@
 #ifndef SHARED_H
 #define SHARED_H
 
+#include <QtGlobal>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
 /*
- * 100 items max
- * 256 char json str max +1 for \0
+ * Payload queue shared between the daemon and APNSd push.
+ *
+ * Each priority class has its own bounded multi-producer single-consumer
+ * ring. Producers claim a slot by advancing head with a compare-and-swap
+ * and publish it by storing the slot sequence, the daemon is the only
+ * consumer and advances tail. No QSharedMemory::lock() is needed on either
+ * side. The daemon empties the immediate ring before it takes from the
+ * power considerate one.
+ *
+ * The capacity of each ring is chosen by the daemon when it creates the
+ * segment (queue_size in /etc/APNSd.cfg) and is always a power of two.
+ *
+ * Every app profile has its own pair of rings, so payloads of an app whose
+ * connections are stuck never sit in front of another app's. Producers
+ * look the profile up by name in appNames, profile 0 is the default one.
+ *
+ * An idle daemon sets the sleeping flag and waits on the wakeup fifo, the
+ * first producer that sees the flag clears it and writes a byte to the fifo.
+ * Producers never touch the fifo while the daemon is busy draining.
+ *
+ * Device tokens are stored decoded, producers reject tokens that are not
+ * 64 hex characters before they claim a slot. The magic changes with the
+ * slot layout.
+ *
+ * Payload bytes live in an arena behind the slots, split into size classes
+ * of 64 to 4096 byte blocks (arena_size in /etc/APNSd.cfg, an equal share
+ * of bytes per class). Each class keeps its free blocks on a lock-free
+ * stack whose head carries a tag against ABA. A producer allocates a block
+ * before it claims a slot, the daemon frees it once the payload is encoded.
  */
 
-#define PAYLOAD_ARRAY_SIZE 100
-#define PAYLOAD_JSONSTR_SIZE 257
+#define PAYLOAD_QUEUE_MAGIC 0x41504e5a
+#define PAYLOAD_QUEUE_DEFAULT_SIZE 16384
+#define PAYLOAD_QUEUE_MAX_SIZE 1048576
+#define PAYLOAD_TOKEN_SIZE 32
+#define PAYLOAD_MAX_SIZE 4096
+#define PAYLOAD_COLLAPSE_KEY_MAX 64
+
+#define PAYLOAD_ARENA_DEFAULT_SIZE (8 * 1024 * 1024)
+#define PAYLOAD_ARENA_MIN_SIZE (256 * 1024)
+#define PAYLOAD_ARENA_MAX_SIZE (1024 * 1024 * 1024)
+#define PAYLOAD_ARENA_CLASSES 7
+#define PAYLOAD_ARENA_MIN_BLOCK 64
+#define PAYLOAD_NO_BLOCK 0xffffffffU
+
+#define PAYLOAD_PRIORITY_IMMEDIATE 10
+#define PAYLOAD_PRIORITY_CONSERVE 5
+
+//one ring per class, lower classes are drained first
+#define PAYLOAD_CLASSES 2
+#define PAYLOAD_CLASS_IMMEDIATE 0
+#define PAYLOAD_CLASS_CONSERVE 1
+
+//app profiles, each with a ring per class
+#define PAYLOAD_APPS_MAX 64
+#define PAYLOAD_APP_NAME_MAX 32
+#define PAYLOAD_RINGS_MAX (PAYLOAD_APPS_MAX * PAYLOAD_CLASSES)
+
+#define SHARED_CACHELINE 64
+
+#define APNSD_WAKEUP_FIFO "/tmp/APNSdWakeup"
 
 struct PayloadData
 {
-    char device[64];
-    char json[PAYLOAD_JSONSTR_SIZE];
+    quint32 sequence;
+    quint8 app; //profile index, 0 = default
+    quint64 enqueued; //CLOCK_MONOTONIC ns, set by the producer
+    quint64 collapse; //collapseKeyHash() of the collapse key, 0 = none
+    quint32 expiry; //UNIX epoch seconds, 0 = do not store
+    quint32 sendAt; //UNIX epoch seconds, 0 = now
+    quint8 priority; //10 = immediately, 5 = power considerate
+    uchar device[PAYLOAD_TOKEN_SIZE];
+    quint16 length; //payload bytes
+    quint32 block; //arena block holding them
+};
+
+/*
+ * A newer payload with the same device and collapse key replaces an older
+ * one that is still queued. Keys are compared by their FNV-1a hash.
+ */
+static inline quint64 collapseKeyHash(const char *key, int len)
+{
+    quint64 h = 14695981039346656037ULL;
+    for (int i=0;i<len;i++)
+    {
+        h ^= (uchar)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+static inline int payloadClass(quint8 priority)
+{
+    return priority == PAYLOAD_PRIORITY_CONSERVE ? PAYLOAD_CLASS_CONSERVE : PAYLOAD_CLASS_IMMEDIATE;
+}
+
+static inline int payloadRing(int app, quint8 priority)
+{
+    return app * PAYLOAD_CLASSES + payloadClass(priority);
+}
+
+//Apple would discard it anyway, now is UNIX epoch seconds
+static inline bool payloadExpired(const PayloadData *payload, quint32 now)
+{
+    return payload->expiry != 0 && payload->expiry < now;
+}
+
+struct PayloadRing
+{
+    quint32 head; //next slot to claim, advanced by producers
+    char pad0[SHARED_CACHELINE - sizeof(quint32)];
+
+    quint32 tail; //next slot to consume, advanced by the daemon only
+    char pad1[SHARED_CACHELINE - sizeof(quint32)];
+};
+
+struct ArenaClass
+{
+    quint64 freelist; //tag << 32 | top block index + 1, 0 = empty
+    quint32 blockSize;
+    quint32 count;
+    quint64 offset; //of the first block, from the start of the segment
+    char pad[SHARED_CACHELINE - 3 * sizeof(quint64)];
+};
+
+//arena use of one app, a stalled app stops at the quota instead of filling the arena
+struct AppArena
+{
+    quint64 used; //bytes of the blocks the app holds
+    quint64 failures; //allocPayload() calls that got no block
+    char pad[SHARED_CACHELINE - 2 * sizeof(quint64)];
 };
 
 struct SharedPayload
 {
-    PayloadData data[PAYLOAD_ARRAY_SIZE];
-    int size;
+    quint32 magic;
+    quint32 capacity;
+    quint32 mask;
+    quint32 apps;
+    quint64 appQuota; //arena bytes one app may hold, 0 = no limit
+    char pad0[SHARED_CACHELINE - 4 * sizeof(quint32) - sizeof(quint64)];
+
+    PayloadRing rings[PAYLOAD_RINGS_MAX];
+
+    //NUL padded, written before init()
+    char appNames[PAYLOAD_APPS_MAX][PAYLOAD_APP_NAME_MAX];
+
+    quint32 sleeping; //set by the daemon when it waits on the wakeup fifo
+    char pad3[SHARED_CACHELINE - sizeof(quint32)];
+
+    ArenaClass classes[PAYLOAD_ARENA_CLASSES];
+    AppArena appArena[PAYLOAD_APPS_MAX];
+
+    PayloadData data[1]; //capacity slots per ring
+
+    static quint32 roundCapacity(quint32 capacity)
+    {
+        if (capacity < 2)
+            capacity = 2;
+        if (capacity > PAYLOAD_QUEUE_MAX_SIZE)
+            capacity = PAYLOAD_QUEUE_MAX_SIZE;
+        quint32 c = 1;
+        while (c < capacity)
+            c <<= 1;
+        return c;
+    }
+
+    static size_t arenaOffset(quint32 capacity, quint32 apps)
+    {
+        size_t offset = offsetof(SharedPayload,data) + sizeof(PayloadData) * capacity * apps * PAYLOAD_CLASSES;
+        return (offset + SHARED_CACHELINE - 1) & ~(size_t)(SHARED_CACHELINE - 1);
+    }
+
+    static size_t segmentSize(quint32 capacity, quint32 apps, size_t arenaSize)
+    {
+        return arenaOffset(capacity,apps) + arenaSize;
+    }
+
+    static size_t roundArenaSize(quint64 arenaSize)
+    {
+        if (arenaSize < PAYLOAD_ARENA_MIN_SIZE)
+            arenaSize = PAYLOAD_ARENA_MIN_SIZE;
+        if (arenaSize > PAYLOAD_ARENA_MAX_SIZE)
+            arenaSize = PAYLOAD_ARENA_MAX_SIZE;
+        return arenaSize & ~(quint64)(PAYLOAD_MAX_SIZE - 1);
+    }
+
+    void init(quint32 cap, quint32 appCount, size_t arenaSize, quint64 quota)
+    {
+        size_t offset = arenaOffset(cap,appCount);
+        size_t share = arenaSize / PAYLOAD_ARENA_CLASSES;
+        quint32 blocksize = PAYLOAD_ARENA_MIN_BLOCK;
+        for (int c=0;c<PAYLOAD_ARENA_CLASSES;c++)
+        {
+            ArenaClass &ac = classes[c];
+            ac.blockSize = blocksize;
+            ac.count = share / blocksize;
+            ac.offset = offset;
+            uchar *base = reinterpret_cast<uchar*>(this) + offset;
+            //free blocks link to the next one by index + 1
+            for (quint32 i=0;i<ac.count;i++)
+                *reinterpret_cast<quint32*>(base + (size_t)i * blocksize) = i + 1 < ac.count ? i + 2 : 0;
+            ac.freelist = ac.count ? 1 : 0;
+            offset += (size_t)ac.count * blocksize;
+            blocksize <<= 1;
+        }
+
+        capacity = cap;
+        mask = cap - 1;
+        apps = appCount;
+        appQuota = quota;
+        sleeping = 0;
+        for (int r=0;r<ringCount();r++)
+        {
+            rings[r].head = 0;
+            rings[r].tail = 0;
+            for (quint32 i=0;i<cap;i++)
+                data[r * cap + i].sequence = i;
+        }
+        __atomic_store_n(&magic,(quint32)PAYLOAD_QUEUE_MAGIC,__ATOMIC_RELEASE);
+    }
+
+    bool valid(size_t segsize) const
+    {
+        if (__atomic_load_n(&magic,__ATOMIC_ACQUIRE) != PAYLOAD_QUEUE_MAGIC)
+            return false;
+        if (apps == 0 || apps > PAYLOAD_APPS_MAX)
+            return false;
+        if (capacity == 0 || (capacity & mask) != 0 || arenaOffset(capacity,apps) > segsize)
+            return false;
+        for (int c=0;c<PAYLOAD_ARENA_CLASSES;c++)
+            if (classes[c].offset + (size_t)classes[c].count * classes[c].blockSize > segsize)
+                return false;
+        return true;
+    }
+
+    int ringCount() const
+    {
+        return apps * PAYLOAD_CLASSES;
+    }
+
+    //profile index of an app name, 0 for an empty one, -1 when unknown
+    int findApp(const char *name, int len) const
+    {
+        if (len == 0)
+            return 0;
+        if (len >= PAYLOAD_APP_NAME_MAX)
+            return -1;
+        for (quint32 i=0;i<apps;i++)
+            if (strncmp(appNames[i],name,len) == 0 && appNames[i][len] == 0)
+                return i;
+        return -1;
+    }
+
+    /*
+     * Arena. allocPayload() returns a block of at least len bytes for an
+     * app, from a larger class if the fitting one ran out, or
+     * PAYLOAD_NO_BLOCK when the arena is full or the app holds its quota.
+     * Any thread may free a block, with the app it was allocated for.
+     */
+    quint32 allocPayload(quint32 len, int app)
+    {
+        quint32 block = takeBlock(len);
+        if (block != PAYLOAD_NO_BLOCK)
+        {
+            quint64 size = classes[block >> 28].blockSize;
+            quint64 used = __atomic_add_fetch(&appArena[app].used,size,__ATOMIC_RELAXED);
+            if (!appQuota || used <= appQuota)
+                return block;
+            __atomic_sub_fetch(&appArena[app].used,size,__ATOMIC_RELAXED);
+            putBlock(block);
+        }
+        __atomic_add_fetch(&appArena[app].failures,1,__ATOMIC_RELAXED);
+        return PAYLOAD_NO_BLOCK;
+    }
+
+    void freePayload(quint32 block, int app)
+    {
+        __atomic_sub_fetch(&appArena[app].used,(quint64)classes[block >> 28].blockSize,__ATOMIC_RELAXED);
+        putBlock(block);
+    }
+
+    quint32 takeBlock(quint32 len)
+    {
+        int c = 0;
+        while (c < PAYLOAD_ARENA_CLASSES && classes[c].blockSize < len)
+            c++;
+
+        for (;c<PAYLOAD_ARENA_CLASSES;c++)
+        {
+            ArenaClass &ac = classes[c];
+            quint64 old = __atomic_load_n(&ac.freelist,__ATOMIC_ACQUIRE);
+            while ((quint32)old != 0)
+            {
+                quint32 index = (quint32)old - 1;
+                //may read a block another producer just took, the CAS fails then
+                quint32 next = __atomic_load_n(reinterpret_cast<quint32*>(blockData(c,index)),__ATOMIC_RELAXED);
+                quint64 top = (((old >> 32) + 1) << 32) | next;
+                if (__atomic_compare_exchange_n(&ac.freelist,&old,top,true,__ATOMIC_ACQUIRE,__ATOMIC_ACQUIRE))
+                    return ((quint32)c << 28) | index;
+            }
+        }
+        return PAYLOAD_NO_BLOCK;
+    }
+
+    void putBlock(quint32 block)
+    {
+        int c = block >> 28;
+        quint32 index = block & 0x0fffffff;
+        ArenaClass &ac = classes[c];
+        quint32 *link = reinterpret_cast<quint32*>(blockData(c,index));
+
+        quint64 old = __atomic_load_n(&ac.freelist,__ATOMIC_RELAXED);
+        quint64 top;
+        do
+        {
+            __atomic_store_n(link,(quint32)old,__ATOMIC_RELAXED);
+            top = (((old >> 32) + 1) << 32) | (index + 1);
+        }
+        while (!__atomic_compare_exchange_n(&ac.freelist,&old,top,true,__ATOMIC_RELEASE,__ATOMIC_RELAXED));
+    }
+
+    char *payloadBytes(quint32 block)
+    {
+        return reinterpret_cast<char*>(blockData(block >> 28,block & 0x0fffffff));
+    }
+
+    uchar *blockData(int c, quint32 index)
+    {
+        return reinterpret_cast<uchar*>(this) + classes[c].offset + (size_t)index * classes[c].blockSize;
+    }
+
+    quint32 size(int ring) const
+    {
+        return __atomic_load_n(&rings[ring].head,__ATOMIC_RELAXED) - __atomic_load_n(&rings[ring].tail,__ATOMIC_RELAXED);
+    }
+
+    quint32 size() const
+    {
+        quint32 n = 0;
+        for (int r=0;r<ringCount();r++)
+            n += size(r);
+        return n;
+    }
+
+    /*
+     * Producer side. claim() returns a free slot of the ring for the
+     * payloadClass() (or 0 when it is full) which must be filled in and
+     * handed back to publish().
+     */
+    PayloadData *claim(int ring, quint32 *ppos)
+    {
+        quint32 &head = rings[ring].head;
+        quint32 pos = __atomic_load_n(&head,__ATOMIC_RELAXED);
+        for (;;)
+        {
+            PayloadData *slot = this->slot(ring,pos);
+            quint32 seq = __atomic_load_n(&slot->sequence,__ATOMIC_ACQUIRE);
+            qint32 diff = (qint32)(seq - pos);
+
+            if (diff == 0)
+            {
+                if (__atomic_compare_exchange_n(&head,&pos,pos + 1,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+                {
+                    *ppos = pos;
+                    return slot;
+                }
+            }
+            else if (diff < 0)
+                return 0;
+            else
+                pos = __atomic_load_n(&head,__ATOMIC_RELAXED);
+        }
+    }
+
+    /*
+     * Reserves up to want consecutive slots with one head update, returns
+     * how many (0 when full). Slot pos + i is published with
+     * publish(slot(ring, pos + i), pos + i).
+     */
+    quint32 claimBatch(int ring, quint32 want, quint32 *ppos)
+    {
+        quint32 &head = rings[ring].head;
+        quint32 pos = __atomic_load_n(&head,__ATOMIC_RELAXED);
+        for (;;)
+        {
+            quint32 n = capacity - (pos - __atomic_load_n(&rings[ring].tail,__ATOMIC_RELAXED));
+            if (n > capacity)
+            {
+                //stale head
+                pos = __atomic_load_n(&head,__ATOMIC_RELAXED);
+                continue;
+            }
+            if (n > want)
+                n = want;
+
+            //the consumer frees slots in order, if the last is free all are
+            while (n > 0)
+            {
+                quint32 last = pos + n - 1;
+                quint32 seq = __atomic_load_n(&slot(ring,last)->sequence,__ATOMIC_ACQUIRE);
+                if (seq == last)
+                    break;
+                if ((qint32)(seq - last) > 0)
+                    break;
+                n >>= 1;
+            }
+
+            if (n == 0)
+                return 0;
+
+            if (__atomic_compare_exchange_n(&head,&pos,pos + n,true,__ATOMIC_RELAXED,__ATOMIC_RELAXED))
+            {
+                *ppos = pos;
+                return n;
+            }
+        }
+    }
+
+    PayloadData *slot(int ring, quint32 pos)
+    {
+        return &data[ring * capacity + (pos & mask)];
+    }
+
+    void publish(PayloadData *slot, quint32 pos)
+    {
+        __atomic_store_n(&slot->sequence,pos + 1,__ATOMIC_RELEASE);
+    }
+
+    //call after publishing, wakes the daemon if it went to sleep
+    void wakeConsumer()
+    {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&sleeping,__ATOMIC_RELAXED))
+            return;
+        if (!__atomic_exchange_n(&sleeping,0,__ATOMIC_SEQ_CST))
+            return;
+
+        int fd = ::open(APNSD_WAKEUP_FIFO,O_WRONLY | O_NONBLOCK);
+        if (fd < 0)
+            return;
+        char a = 1;
+        if (::write(fd,&a,sizeof(a)) < 0)
+        {
+            //fifo full, a wakeup is pending anyway
+        }
+        ::close(fd);
+    }
+
+    /*
+     * Consumer side, daemon only. front() returns the oldest published slot
+     * of a ring or 0, pop() hands it back to the producers.
+     */
+    PayloadData *front(int ring)
+    {
+        quint32 tail = rings[ring].tail;
+        PayloadData *slot = this->slot(ring,tail);
+        if (__atomic_load_n(&slot->sequence,__ATOMIC_ACQUIRE) != tail + 1)
+            return 0;
+        return slot;
+    }
+
+    //any published slot
+    PayloadData *front()
+    {
+        for (int r=0;r<ringCount();r++)
+        {
+            PayloadData *slot = front(r);
+            if (slot)
+                return slot;
+        }
+        return 0;
+    }
+
+    //ring position of front(ring)
+    quint32 frontPos(int ring) const
+    {
+        return rings[ring].tail;
+    }
+
+    void pop(int ring)
+    {
+        quint32 tail = rings[ring].tail;
+        PayloadData *slot = this->slot(ring,tail);
+        __atomic_store_n(&slot->sequence,tail + capacity,__ATOMIC_RELEASE);
+        __atomic_store_n(&rings[ring].tail,tail + 1,__ATOMIC_RELAXED);
+    }
 
-    SharedPayload() : size(0) {}
+    /*
+     * Called by the daemon once the queue is drained. Returns false if a
+     * payload was published meanwhile, the caller should drain again.
+     * Rings flagged in skip hold payloads that wait for something else.
+     */
+    bool sleep(const bool *skip = 0)
+    {
+        __atomic_store_n(&sleeping,1,__ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        for (int r=0;r<ringCount();r++)
+        {
+            if ((!skip || !skip[r]) && front(r) != 0)
+            {
+                __atomic_store_n(&sleeping,0,__ATOMIC_RELAXED);
+                return false;
+            }
+        }
+        return true;
+    }
 };
 
 #endif // SHARED_H
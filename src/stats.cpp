@@ -0,0 +1,169 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include "stats.h"
+#include "shared.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+static void appendf(QByteArray *out, const char *format, ...) __attribute__((format(printf,2,3)));
+
+static void appendf(QByteArray *out, const char *format, ...)
+{
+    char line[256];
+    va_list args;
+    va_start(args,format);
+    int n = vsnprintf(line,sizeof(line),format,args);
+    va_end(args);
+    out->append(line,qMin(n,(int)sizeof(line) - 1));
+}
+
+//connections that are configured or ever connected
+static bool reported(const DaemonStats *stats, int i)
+{
+    return i < (int)stats->connections || stats->conn[i].connects || stats->conn[i].sent;
+}
+
+static void counter(QByteArray *out, const char *name, const char *help, quint64 value)
+{
+    appendf(out,"# HELP %s %s\n# TYPE %s counter\n%s %llu\n",name,help,name,name,(unsigned long long)value);
+}
+
+static void summary(QByteArray *out, const DaemonStats *stats, const char *name, const char *help, size_t offset)
+{
+    static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+    appendf(out,"# HELP %s %s\n# TYPE %s summary\n",name,help,name);
+    for (int i=0;i<STATS_CONNECTIONS;i++)
+    {
+        if (!reported(stats,i))
+            continue;
+        const StatsHistogram *h = reinterpret_cast<const StatsHistogram*>(reinterpret_cast<const char*>(&stats->conn[i]) + offset);
+        for (int q=0;q<4;q++)
+            appendf(out,"%s{conn=\"%d\",app=\"%s\",quantile=\"%g\"} %.9f\n",name,i,stats->conn[i].app,quantiles[q],h->percentile(quantiles[q]) / 1e9);
+        appendf(out,"%s_sum{conn=\"%d\",app=\"%s\"} %.9f\n",name,i,stats->conn[i].app,h->sum / 1e9);
+        appendf(out,"%s_count{conn=\"%d\",app=\"%s\"} %llu\n",name,i,stats->conn[i].app,(unsigned long long)h->count);
+    }
+}
+
+static void connectionCounter(QByteArray *out, const DaemonStats *stats, const char *name, const char *help, size_t offset)
+{
+    appendf(out,"# HELP %s %s\n# TYPE %s counter\n",name,help,name);
+    for (int i=0;i<STATS_CONNECTIONS;i++)
+        if (reported(stats,i))
+            appendf(out,"%s{conn=\"%d\",app=\"%s\"} %llu\n",name,i,stats->conn[i].app,*reinterpret_cast<const unsigned long long*>(reinterpret_cast<const char*>(&stats->conn[i]) + offset));
+}
+
+static void appArena(QByteArray *out, const SharedPayload *shared)
+{
+    appendf(out,"# HELP apnsd_arena_used_bytes Arena bytes held by an app.\n# TYPE apnsd_arena_used_bytes gauge\n");
+    for (quint32 a=0;a<shared->apps;a++)
+        appendf(out,"apnsd_arena_used_bytes{app=\"%.*s\"} %llu\n",PAYLOAD_APP_NAME_MAX,shared->appNames[a],
+                (unsigned long long)__atomic_load_n(&shared->appArena[a].used,__ATOMIC_RELAXED));
+    appendf(out,"# HELP apnsd_arena_failures_total Arena allocations refused to an app.\n# TYPE apnsd_arena_failures_total counter\n");
+    for (quint32 a=0;a<shared->apps;a++)
+        appendf(out,"apnsd_arena_failures_total{app=\"%.*s\"} %llu\n",PAYLOAD_APP_NAME_MAX,shared->appNames[a],
+                (unsigned long long)__atomic_load_n(&shared->appArena[a].failures,__ATOMIC_RELAXED));
+}
+
+QByteArray statsPrometheus(const DaemonStats *stats, const SharedPayload *shared)
+{
+    QByteArray out;
+
+    appendf(&out,"# HELP apnsd_start_time_seconds Daemon start time.\n# TYPE apnsd_start_time_seconds gauge\napnsd_start_time_seconds %llu\n",(unsigned long long)stats->started);
+    counter(&out,"apnsd_enqueued_total","Payloads handed to a connection queue.",stats->enqueued);
+    counter(&out,"apnsd_blocked_total","Payloads dropped for devices on the blocklist.",stats->blocked);
+    counter(&out,"apnsd_expired_total","Payloads dropped after their expiry.",stats->expired);
+    counter(&out,"apnsd_collapsed_total","Payloads that replaced a queued one.",stats->collapsed);
+    counter(&out,"apnsd_scheduled_total","Payloads held for a send_at time.",stats->scheduled);
+    counter(&out,"apnsd_connection_queue_full_total","Drain passes stopped by a full connection queue.",stats->connectionQueueFull);
+    counter(&out,"apnsd_unspooled_total","Payloads sent without journaling them because the spool was full.",stats->unspooled);
+    counter(&out,"apnsd_ingest_accepted_total","Ingest items published to the shared queue.",stats->ingestAccepted);
+    counter(&out,"apnsd_ingest_rejected_total","Ingest items rejected as invalid.",stats->ingestRejected);
+    counter(&out,"apnsd_ingest_stalls_total","Ingest batches that waited for a full shared queue.",stats->ingestStalls);
+    counter(&out,"apnsd_push_queue_full_total","APNSd push calls refused by a full shared queue.",stats->pushQueueFull);
+
+    connectionCounter(&out,stats,"apnsd_sent_total","Frames written to the gateway.",offsetof(ConnectionStats,sent));
+    connectionCounter(&out,stats,"apnsd_written_bytes_total","Bytes written to the gateway.",offsetof(ConnectionStats,bytes));
+    connectionCounter(&out,stats,"apnsd_connection_expired_total","Payloads a connection dropped after their expiry.",offsetof(ConnectionStats,expired));
+    connectionCounter(&out,stats,"apnsd_connects_total","TLS handshakes completed.",offsetof(ConnectionStats,connects));
+    connectionCounter(&out,stats,"apnsd_reconnects_total","Reconnects scheduled after a failure.",offsetof(ConnectionStats,reconnects));
+
+    appendf(&out,"# HELP apnsd_error_responses_total Error responses by status code.\n# TYPE apnsd_error_responses_total counter\n");
+    for (int i=0;i<STATS_CONNECTIONS;i++)
+        for (int s=0;s<STATS_STATUS_CODES;s++)
+            if (stats->conn[i].status[s])
+                appendf(&out,"apnsd_error_responses_total{conn=\"%d\",app=\"%s\",status=\"%d\"} %llu\n",i,stats->conn[i].app,s,(unsigned long long)stats->conn[i].status[s]);
+
+    summary(&out,stats,"apnsd_enqueue_write_seconds","Time from enqueue to the socket write.",offsetof(ConnectionStats,enqueueWrite));
+    summary(&out,stats,"apnsd_handshake_seconds","Time from connect to an encrypted connection.",offsetof(ConnectionStats,handshake));
+
+    if (shared)
+        appArena(&out,shared);
+
+    return out;
+}
+
+QByteArray statsText(const DaemonStats *stats, const SharedPayload *shared)
+{
+    QByteArray out;
+
+    appendf(&out,"uptime %llu s\n",(unsigned long long)(::time(0) - stats->started));
+    appendf(&out,"enqueued %llu, blocked %llu, expired %llu, collapsed %llu, scheduled %llu\n",
+            (unsigned long long)stats->enqueued,(unsigned long long)stats->blocked,(unsigned long long)stats->expired,
+            (unsigned long long)stats->collapsed,(unsigned long long)stats->scheduled);
+    appendf(&out,"connection queue full %llu, unspooled %llu\n",(unsigned long long)stats->connectionQueueFull,(unsigned long long)stats->unspooled);
+    appendf(&out,"ingest accepted %llu, rejected %llu, stalls %llu, push queue full %llu\n",
+            (unsigned long long)stats->ingestAccepted,(unsigned long long)stats->ingestRejected,
+            (unsigned long long)stats->ingestStalls,(unsigned long long)stats->pushQueueFull);
+
+    for (int i=0;i<STATS_CONNECTIONS;i++)
+    {
+        if (!reported(stats,i))
+            continue;
+        const ConnectionStats &c = stats->conn[i];
+        appendf(&out,"connection %d (%s): sent %llu, %llu bytes, expired %llu, connects %llu, reconnects %llu, error responses %llu\n",i,c.app,
+                (unsigned long long)c.sent,(unsigned long long)c.bytes,(unsigned long long)c.expired,
+                (unsigned long long)c.connects,(unsigned long long)c.reconnects,(unsigned long long)c.errorResponses);
+        for (int s=0;s<STATS_STATUS_CODES;s++)
+            if (c.status[s])
+                appendf(&out,"  status %d: %llu\n",s,(unsigned long long)c.status[s]);
+        if (c.enqueueWrite.count)
+            appendf(&out,"  enqueue->write (us): p50 %llu p99 %llu p99.9 %llu max %llu\n",
+                    (unsigned long long)c.enqueueWrite.percentile(0.5) / 1000,(unsigned long long)c.enqueueWrite.percentile(0.99) / 1000,
+                    (unsigned long long)c.enqueueWrite.percentile(0.999) / 1000,(unsigned long long)c.enqueueWrite.max / 1000);
+        if (c.handshake.count)
+            appendf(&out,"  handshake (ms): p50 %llu p99 %llu max %llu\n",
+                    (unsigned long long)c.handshake.percentile(0.5) / 1000000,(unsigned long long)c.handshake.percentile(0.99) / 1000000,
+                    (unsigned long long)c.handshake.max / 1000000);
+    }
+
+    if (shared)
+    {
+        for (quint32 a=0;a<shared->apps;a++)
+            appendf(&out,"app %.*s: arena %llu bytes (quota %llu), allocation failures %llu\n",PAYLOAD_APP_NAME_MAX,shared->appNames[a],
+                    (unsigned long long)__atomic_load_n(&shared->appArena[a].used,__ATOMIC_RELAXED),(unsigned long long)shared->appQuota,
+                    (unsigned long long)__atomic_load_n(&shared->appArena[a].failures,__ATOMIC_RELAXED));
+    }
+
+    return out;
+}
@@ -0,0 +1,158 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#ifndef STATS_H
+#define STATS_H
+
+#include <QtGlobal>
+#include <QByteArray>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include "latency.h"
+
+/*
+ * Counters and latency histograms in their own shared memory segment, so
+ * APNSd stats and the metrics endpoint read them without touching the
+ * payload queue or the daemon threads.
+ *
+ * Every field has one writing thread (a connection, the drain or the
+ * ingest thread) that updates it with relaxed atomic stores, readers copy
+ * the block as it is. Only pushQueueFull is written by other processes and
+ * uses an atomic add. Counters count from the daemon start.
+ */
+
+#define STATS_MAGIC 0x41505332
+#define STATS_SEGMENT "APNSdStats"
+#define STATS_CONNECTIONS 128
+#define STATS_APP_NAME_MAX 32
+#define STATS_STATUS_CODES 256
+
+//single writer
+static inline void statAdd(quint64 *counter, quint64 n = 1)
+{
+    __atomic_store_n(counter,__atomic_load_n(counter,__ATOMIC_RELAXED) + n,__ATOMIC_RELAXED);
+}
+
+//any thread or process
+static inline void statAddShared(quint64 *counter, quint64 n = 1)
+{
+    __atomic_add_fetch(counter,n,__ATOMIC_RELAXED);
+}
+
+//LatencyHistogram buckets, 64 bit counts that do not wrap over the daemon lifetime
+struct StatsHistogram
+{
+    quint64 count;
+    quint64 sum;
+    quint64 max;
+    quint64 buckets[LATENCY_BUCKETS];
+
+    void record(quint64 ns)
+    {
+        statAdd(&count);
+        statAdd(&sum,ns);
+        if (ns > max)
+            __atomic_store_n(&max,ns,__ATOMIC_RELAXED);
+        statAdd(&buckets[LatencyHistogram::bucketOf(ns)]);
+    }
+
+    //q in [0,1], upper bound of the bucket holding that quantile
+    quint64 percentile(double q) const
+    {
+        if (count == 0)
+            return 0;
+        quint64 target = (quint64)(q * count + 0.5);
+        if (target == 0)
+            target = 1;
+        quint64 seen = 0;
+        for (int b=0;b<LATENCY_BUCKETS;b++)
+        {
+            seen += buckets[b];
+            if (seen >= target)
+                return LatencyHistogram::bucketHigh(b) < max ? LatencyHistogram::bucketHigh(b) : max;
+        }
+        return max;
+    }
+};
+
+struct ConnectionStats
+{
+    //app profile name, set before the connection thread starts
+    char app[STATS_APP_NAME_MAX];
+    quint64 sent;
+    quint64 bytes;
+    quint64 expired;
+    quint64 connects;
+    quint64 reconnects;
+    quint64 errorResponses;
+    quint64 status[STATS_STATUS_CODES];
+    StatsHistogram enqueueWrite;
+    StatsHistogram handshake;
+};
+
+struct DaemonStats
+{
+    quint32 magic;
+    quint32 connections;
+    quint64 started;
+
+    //drain thread
+    quint64 enqueued;
+    quint64 blocked;
+    quint64 expired;
+    quint64 collapsed;
+    quint64 scheduled;
+    quint64 connectionQueueFull;
+    quint64 unspooled;
+
+    //ingest thread
+    quint64 ingestAccepted;
+    quint64 ingestRejected;
+    quint64 ingestStalls;
+
+    //APNSd push and push-batch giving up on a full queue
+    quint64 pushQueueFull;
+
+    ConnectionStats conn[STATS_CONNECTIONS];
+
+    void init(int connections)
+    {
+        memset(this,0,sizeof(DaemonStats));
+        this->connections = connections;
+        started = ::time(0);
+        __atomic_store_n(&magic,STATS_MAGIC,__ATOMIC_RELEASE);
+    }
+
+    bool valid(size_t segsize) const
+    {
+        return segsize >= sizeof(DaemonStats) && __atomic_load_n(&magic,__ATOMIC_ACQUIRE) == STATS_MAGIC;
+    }
+};
+
+struct SharedPayload;
+
+//Prometheus text exposition format, with the arena use per app when shared is set
+QByteArray statsPrometheus(const DaemonStats *stats, const SharedPayload *shared = 0);
+//APNSd stats output
+QByteArray statsText(const DaemonStats *stats, const SharedPayload *shared = 0);
+
+#endif // STATS_H
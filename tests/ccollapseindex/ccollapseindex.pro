@@ -0,0 +1,23 @@
+#-------------------------------------------------
+#
+# CCollapseIndex lookups and stale entries
+#
+#-------------------------------------------------
+
+QT       += core testlib
+
+QT       -= gui
+
+TARGET = tst_ccollapseindex
+CONFIG   += console testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += tst_ccollapseindex.cpp \
+    ../../src/ccollapseindex.cpp
+
+HEADERS += \
+    ../../src/ccollapseindex.h
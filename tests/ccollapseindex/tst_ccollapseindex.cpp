@@ -0,0 +1,155 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QtTest>
+#include "ccollapseindex.h"
+
+//two lanes, nothing consumed yet
+#define LANES 2
+
+class TestCollapseIndex : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void emptyUntilResized()
+    {
+        CCollapseIndex index;
+        QVector<quint32> consumed(LANES,0);
+        int lane;
+        quint32 pos;
+
+        QVERIFY(index.isEmpty());
+        index.insert(5,0,0,consumed);
+        QVERIFY(!index.find(5,&lane,&pos));
+    }
+
+    void findLatest()
+    {
+        CCollapseIndex index;
+        QVector<quint32> consumed(LANES,0);
+        int lane;
+        quint32 pos;
+
+        index.resize(8);
+        index.insert(5,1,3,consumed);
+        QVERIFY(index.find(5,&lane,&pos));
+        QCOMPARE(lane,1);
+        QCOMPARE(pos,3U);
+
+        //a newer payload for the same key moves the entry
+        index.insert(5,0,9,consumed);
+        QVERIFY(index.find(5,&lane,&pos));
+        QCOMPARE(lane,0);
+        QCOMPARE(pos,9U);
+
+        QVERIFY(!index.find(6,&lane,&pos));
+    }
+
+    //keys with the same low bits probe on to the next free entry
+    void collidingKeys()
+    {
+        CCollapseIndex index;
+        QVector<quint32> consumed(LANES,0);
+        int lane;
+        quint32 pos;
+
+        index.resize(8);
+        quint64 keys[] = { 1, 17, 33, 1 + (1ULL << 40) };
+        for (int i=0;i<4;i++)
+            index.insert(keys[i],0,i,consumed);
+        for (int i=0;i<4;i++)
+        {
+            QVERIFY(index.find(keys[i],&lane,&pos));
+            QCOMPARE(pos,(quint32)i);
+        }
+    }
+
+    //entries the lane consumed past are reused by a colliding key or dropped on a rebuild
+    void staleForgotten()
+    {
+        CCollapseIndex index;
+        QVector<quint32> consumed(LANES,0);
+        int lane;
+        quint32 pos;
+
+        index.resize(8);
+        index.insert(1000,0,0,consumed);
+        index.insert(2000,1,0,consumed);
+        consumed[0] = 1;
+
+        //16 entries, the rebuild comes with the ninth key
+        for (quint32 k=1;k<=8;k++)
+            index.insert(k,1,k,consumed);
+
+        QVERIFY(!index.find(1000,&lane,&pos));
+        QVERIFY(index.find(2000,&lane,&pos));
+        for (quint32 k=1;k<=8;k++)
+            QVERIFY(index.find(k,&lane,&pos));
+    }
+
+    //positions wrap, an entry just before the wrap is stale once the lane passed it
+    void staleAcrossWrap()
+    {
+        CCollapseIndex index;
+        QVector<quint32> consumed(LANES,0xfffffff0U);
+        int lane;
+        quint32 pos;
+
+        index.resize(8);
+        index.insert(1000,0,0xfffffffeU,consumed);
+        index.insert(2000,1,0xfffffffeU,consumed);
+        consumed[0] = 4;
+
+        for (quint32 k=1;k<=8;k++)
+            index.insert(k,1,0xfffffff0U + k,consumed);
+
+        QVERIFY(!index.find(1000,&lane,&pos));
+        QVERIFY(index.find(2000,&lane,&pos));
+        QCOMPARE(pos,0xfffffffeU);
+    }
+
+    //a long run of consumed payloads keeps reusing entries instead of filling the table
+    void churn()
+    {
+        CCollapseIndex index;
+        QVector<quint32> consumed(LANES,0);
+        int lane;
+        quint32 pos;
+
+        index.resize(8);
+        for (quint32 p=0;p<100000;p++)
+        {
+            index.insert(p * 7919 + 1,0,p,consumed);
+            consumed[0] = p + 1 > 4 ? p + 1 - 4 : 0;
+        }
+
+        for (quint32 p=99996;p<100000;p++)
+        {
+            QVERIFY(index.find(p * 7919 + 1,&lane,&pos));
+            QCOMPARE(pos,p);
+        }
+    }
+};
+
+QTEST_APPLESS_MAIN(TestCollapseIndex)
+
+#include "tst_ccollapseindex.moc"
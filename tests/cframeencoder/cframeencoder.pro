@@ -0,0 +1,23 @@
+#-------------------------------------------------
+#
+# CFrameEncoder byte layout
+#
+#-------------------------------------------------
+
+QT       += core testlib
+
+QT       -= gui
+
+TARGET = tst_cframeencoder
+CONFIG   += console testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += tst_cframeencoder.cpp \
+    ../../src/cframeencoder.cpp
+
+HEADERS += \
+    ../../src/cframeencoder.h
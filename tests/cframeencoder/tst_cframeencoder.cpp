@@ -0,0 +1,176 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QtTest>
+#include <string.h>
+#include "cframeencoder.h"
+#include "shared.h"
+
+//"é€" in UTF-8, two characters in five bytes
+#define NON_ASCII_JSON "{\"aps\":{\"alert\":\"\xc3\xa9\xe2\x82\xac\"}}"
+
+class TestFrameEncoder : public QObject
+{
+    Q_OBJECT
+
+    static PayloadData payload(const char *json)
+    {
+        PayloadData p;
+        memset(&p,0,sizeof(p));
+        for (int i=0;i<PAYLOAD_TOKEN_SIZE;i++)
+            p.device[i] = (uchar)(0xa0 + i);
+        p.length = strlen(json);
+        p.expiry = 0x01020304;
+        p.priority = PAYLOAD_PRIORITY_CONSERVE;
+        return p;
+    }
+
+    //big endian fields written out by hand, independent of the encoder
+    static void be(QByteArray *out, quint32 value, int bytes)
+    {
+        for (int i=bytes-1;i>=0;i--)
+            out->append((char)((value >> (i * 8)) & 0xff));
+    }
+
+    static QByteArray v0(const PayloadData &p, const char *json)
+    {
+        QByteArray out;
+        out.append((char)0);
+        be(&out,32,2);
+        out.append(reinterpret_cast<const char*>(p.device),32);
+        be(&out,p.length,2);
+        out.append(json,p.length);
+        return out;
+    }
+
+    static QByteArray v2(const PayloadData &p, const char *json, quint32 ident)
+    {
+        QByteArray items;
+        items.append((char)1);
+        be(&items,32,2);
+        items.append(reinterpret_cast<const char*>(p.device),32);
+        items.append((char)2);
+        be(&items,p.length,2);
+        items.append(json,p.length);
+        items.append((char)3);
+        be(&items,4,2);
+        be(&items,ident,4);
+        items.append((char)4);
+        be(&items,4,2);
+        be(&items,p.expiry,4);
+        items.append((char)5);
+        be(&items,1,2);
+        items.append((char)p.priority);
+
+        QByteArray out;
+        out.append((char)2);
+        be(&out,items.size(),4);
+        out.append(items.constData(),items.size());
+        return out;
+    }
+
+    static QByteArray encoded(const CFrameEncoder &encoder)
+    {
+        return QByteArray(encoder.data(),encoder.size());
+    }
+
+private slots:
+    void v0Layout()
+    {
+        const char *json = "{\"aps\":{\"badge\":1}}";
+        PayloadData p = payload(json);
+        CFrameEncoder encoder;
+        encoder.encode(&p,json);
+
+        QCOMPARE(encoder.frames(),1);
+        QCOMPARE(encoder.size(),37 + (int)strlen(json));
+        QVERIFY(encoded(encoder) == v0(p,json));
+    }
+
+    void v2Layout()
+    {
+        const char *json = "{\"aps\":{\"badge\":1}}";
+        PayloadData p = payload(json);
+        CFrameEncoder encoder;
+        encoder.setProtocol(2);
+        encoder.encode(&p,json,0x0a0b0c0d);
+
+        QCOMPARE(encoder.frames(),1);
+        QCOMPARE(encoder.size(),5 + 56 + (int)strlen(json));
+        QVERIFY(encoded(encoder) == v2(p,json,0x0a0b0c0d));
+    }
+
+    //the length fields count UTF-8 bytes, not characters
+    void nonAsciiLength()
+    {
+        const char *json = NON_ASCII_JSON;
+        PayloadData p = payload(json);
+        QCOMPARE((int)p.length,25);
+
+        CFrameEncoder encoder;
+        encoder.encode(&p,json);
+        const uchar *d = reinterpret_cast<const uchar*>(encoder.data());
+        QCOMPARE((d[35] << 8) | d[36],25);
+        QVERIFY(encoded(encoder) == v0(p,json));
+
+        encoder.clear();
+        encoder.setProtocol(2);
+        encoder.encode(&p,json,7);
+        d = reinterpret_cast<const uchar*>(encoder.data());
+        QCOMPARE((quint32)((d[1] << 24) | (d[2] << 16) | (d[3] << 8) | d[4]),(quint32)(56 + 25));
+        QCOMPARE((d[5 + 35 + 1] << 8) | d[5 + 35 + 2],25);
+        QVERIFY(encoded(encoder) == v2(p,json,7));
+    }
+
+    //frames go back to back, the buffer grows past its reserve
+    void batch()
+    {
+        const char *first = "{}";
+        const char *second = NON_ASCII_JSON;
+        PayloadData a = payload(first);
+        PayloadData b = payload(second);
+        b.priority = PAYLOAD_PRIORITY_IMMEDIATE;
+
+        CFrameEncoder encoder(16);
+        encoder.setProtocol(2);
+        encoder.encode(&a,first,1);
+        encoder.encode(&b,second,2);
+        encoder.encode(&a,first,3);
+
+        QByteArray expected = v2(a,first,1);
+        QByteArray next = v2(b,second,2);
+        expected.append(next.constData(),next.size());
+        next = v2(a,first,3);
+        expected.append(next.constData(),next.size());
+        QCOMPARE(encoder.frames(),3);
+        QVERIFY(encoded(encoder) == expected);
+
+        encoder.clear();
+        QCOMPARE(encoder.size(),0);
+        QCOMPARE(encoder.frames(),0);
+        encoder.encode(&b,second,4);
+        QVERIFY(encoded(encoder) == v2(b,second,4));
+    }
+};
+
+QTEST_APPLESS_MAIN(TestFrameEncoder)
+
+#include "tst_cframeencoder.moc"
@@ -0,0 +1,23 @@
+#-------------------------------------------------
+#
+# CInflightWindow eviction and lookups
+#
+#-------------------------------------------------
+
+QT       += core testlib
+
+QT       -= gui
+
+TARGET = tst_cinflightwindow
+CONFIG   += console testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += tst_cinflightwindow.cpp \
+    ../../src/cinflightwindow.cpp
+
+HEADERS += \
+    ../../src/cinflightwindow.h
@@ -0,0 +1,167 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QtTest>
+#include "cinflightwindow.h"
+
+class TestInflightWindow : public QObject
+{
+    Q_OBJECT
+
+    //frame filled with its own identifier so the contents can be checked
+    static QByteArray frame(quint32 ident, int len)
+    {
+        return QByteArray(len,(char)('a' + ident % 26));
+    }
+
+    static void add(CInflightWindow &window, quint32 ident, int len)
+    {
+        QByteArray f = frame(ident,len);
+        window.add(ident,f.constData(),f.size());
+    }
+
+    static bool holds(const CInflightWindow &window, int i, quint32 ident, int len)
+    {
+        return window.ident(i) == ident && window.frameSize(i) == len &&
+               QByteArray(window.frame(i),len) == frame(ident,len);
+    }
+
+private slots:
+    void addAndFind()
+    {
+        CInflightWindow window(8,1024);
+        for (quint32 i=10;i<15;i++)
+            add(window,i,20);
+
+        QCOMPARE(window.count(),5);
+        QCOMPARE(window.indexOf(10),0);
+        QCOMPARE(window.indexOf(14),4);
+        QCOMPARE(window.indexOf(9),-1);
+        QCOMPARE(window.indexOf(15),-1);
+        for (int i=0;i<5;i++)
+            QVERIFY(holds(window,i,10 + i,20));
+    }
+
+    void frameLimit()
+    {
+        CInflightWindow window(4,1024);
+        for (quint32 i=1;i<=6;i++)
+            add(window,i,10);
+
+        QCOMPARE(window.count(),4);
+        QCOMPARE(window.ident(0),3U);
+        QCOMPARE(window.indexOf(2),-1);
+        for (int i=0;i<4;i++)
+            QVERIFY(holds(window,i,3 + i,10));
+    }
+
+    void byteLimit()
+    {
+        CInflightWindow window(16,100);
+        for (quint32 i=1;i<=3;i++)
+            add(window,i,30);
+
+        //does not fit behind the third frame, wraps over the first
+        add(window,4,30);
+        QCOMPARE(window.count(),3);
+        QCOMPARE(window.ident(0),2U);
+        QVERIFY(holds(window,0,2,30));
+        QVERIFY(holds(window,1,3,30));
+        QVERIFY(holds(window,2,4,30));
+
+        //fits behind the fourth one, over the second and third
+        add(window,5,40);
+        QCOMPARE(window.count(),2);
+        QCOMPARE(window.ident(0),4U);
+        QVERIFY(holds(window,0,4,30));
+        QVERIFY(holds(window,1,5,40));
+    }
+
+    void tooLarge()
+    {
+        CInflightWindow window(16,100);
+        add(window,1,30);
+        add(window,2,101);
+
+        //nothing older can be replayed once a frame is missing
+        QCOMPARE(window.count(),0);
+        QCOMPARE(window.indexOf(1),-1);
+        add(window,3,30);
+        QCOMPARE(window.count(),1);
+        QVERIFY(holds(window,0,3,30));
+    }
+
+    void discardThrough()
+    {
+        CInflightWindow window(8,1024);
+        for (quint32 i=1;i<=6;i++)
+            add(window,i,10);
+
+        window.discardThrough(3);
+        QCOMPARE(window.count(),3);
+        QCOMPARE(window.ident(0),4U);
+        QCOMPARE(window.indexOf(5),1);
+
+        //older identifiers are already gone
+        window.discardThrough(2);
+        QCOMPARE(window.count(),3);
+
+        window.discardThrough(6);
+        QCOMPARE(window.count(),0);
+    }
+
+    void identWrap()
+    {
+        CInflightWindow window(8,1024);
+        for (quint32 i=0xfffffffeU;i!=3;i++)
+            add(window,i,10);
+
+        QCOMPARE(window.count(),5);
+        QCOMPARE(window.indexOf(0xffffffffU),1);
+        QCOMPARE(window.indexOf(2),4);
+
+        window.discardThrough(0);
+        QCOMPARE(window.count(),2);
+        QCOMPARE(window.ident(0),1U);
+    }
+
+    void clearAndResize()
+    {
+        CInflightWindow window(8,1024);
+        add(window,1,10);
+        window.clear();
+        QCOMPARE(window.count(),0);
+        QCOMPARE(window.indexOf(1),-1);
+
+        add(window,7,10);
+        window.resize(2,64);
+        QCOMPARE(window.count(),0);
+        for (quint32 i=1;i<=3;i++)
+            add(window,i,20);
+        QCOMPARE(window.count(),2);
+        QVERIFY(holds(window,0,2,20));
+        QVERIFY(holds(window,1,3,20));
+    }
+};
+
+QTEST_APPLESS_MAIN(TestInflightWindow)
+
+#include "tst_cinflightwindow.moc"
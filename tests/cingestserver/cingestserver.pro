@@ -0,0 +1,57 @@
+#-------------------------------------------------
+#
+# CIngestServer framing and batch parsing
+#
+#-------------------------------------------------
+
+QT       += core network testlib
+
+QT       -= gui
+
+TARGET = tst_cingestserver
+CONFIG   += console testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+#CAPNSd provides the log and the stats, it pulls in the whole daemon
+SOURCES += tst_cingestserver.cpp \
+    ../../src/capnsd.cpp \
+    ../../src/cframeencoder.cpp \
+    ../../src/cinflightwindow.cpp \
+    ../../src/cgatewayconnection.cpp \
+    ../../src/cpayloaddrain.cpp \
+    ../../src/cspool.cpp \
+    ../../src/cingestserver.cpp \
+    ../../src/ctokenblocklist.cpp \
+    ../../src/cbroadcastjob.cpp \
+    ../../src/ctimingwheel.cpp \
+    ../../src/ccollapseindex.cpp \
+    ../../src/config.cpp \
+    ../../src/clogger.cpp \
+    ../../src/stats.cpp \
+    ../../src/cstatsserver.cpp \
+    ../../src/ctrace.cpp
+
+HEADERS += \
+    ../../src/capnsd.h \
+    ../../src/shared.h \
+    ../../src/latency.h \
+    ../../src/cframeencoder.h \
+    ../../src/cinflightwindow.h \
+    ../../src/cgatewayconnection.h \
+    ../../src/cpayloaddrain.h \
+    ../../src/cspscqueue.h \
+    ../../src/cspool.h \
+    ../../src/cingestserver.h \
+    ../../src/ctokenblocklist.h \
+    ../../src/cbroadcastjob.h \
+    ../../src/ctimingwheel.h \
+    ../../src/ccollapseindex.h \
+    ../../src/config.h \
+    ../../src/clogger.h \
+    ../../src/stats.h \
+    ../../src/cstatsserver.h \
+    ../../src/ctrace.h
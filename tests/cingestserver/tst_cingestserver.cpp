@@ -0,0 +1,492 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QtTest>
+#include <QDir>
+#include <QFile>
+#include <QList>
+#include <QVector>
+#include <QLocalSocket>
+#include <QtEndian>
+#include "cingestserver.h"
+#include "capnsd.h"
+#include "shared.h"
+#include "stats.h"
+
+#define CAPACITY 4
+
+static void appendInt(QByteArray &a, quint32 v, int bytes)
+{
+    for (int i=bytes-1;i>=0;i--)
+        a.append((char)((v >> (i * 8)) & 0xff));
+}
+
+//the device token of item n
+static QByteArray token(int n)
+{
+    return QByteArray(PAYLOAD_TOKEN_SIZE,(char)(0xa0 + n));
+}
+
+//one item in the layout of a batch type
+static QByteArray item(int type, int n, quint8 priority, const QByteArray &payload, quint32 sendAt = 0, const QByteArray &key = QByteArray())
+{
+    QByteArray a = token(n);
+    a.append((char)priority);
+    appendInt(a,1000 + n,4);
+    if (type != INGEST_BATCH)
+        appendInt(a,sendAt,4);
+    if (type == INGEST_COLLAPSE_BATCH || type == INGEST_APP_BATCH)
+    {
+        a.append((char)key.size());
+        a.append(key);
+    }
+    appendInt(a,payload.size(),2);
+    a.append(payload);
+    return a;
+}
+
+//a whole frame, count may differ from the items given
+static QByteArray frame(int type, quint32 id, const QList<QByteArray> &items, int count = -1, const QByteArray &app = QByteArray())
+{
+    QByteArray body;
+    body.append((char)type);
+    appendInt(body,id,4);
+    appendInt(body,count < 0 ? items.size() : count,2);
+    if (type == INGEST_APP_BATCH)
+    {
+        body.append((char)app.size());
+        body.append(app);
+    }
+    for (int i=0;i<items.size();i++)
+        body.append(items[i]);
+
+    QByteArray a;
+    appendInt(a,body.size(),4);
+    a.append(body);
+    return a;
+}
+
+static QByteArray payload(int n)
+{
+    return "{\"aps\":{\"alert\":\"" + QByteArray::number(n) + "\"}}";
+}
+
+class TestIngestServer : public QObject
+{
+    Q_OBJECT
+
+private:
+    struct Ack
+    {
+        quint32 id;
+        quint8 status;
+        quint16 accepted;
+        quint16 rejected;
+    };
+
+    QString m_sSocketPath;
+    QVector<quint64> m_memory;
+    SharedPayload *m_pShared;
+    DaemonStats *m_pStats;
+    CAPNSd *m_pDaemon;
+    CIngestServer *m_pServer;
+    QLocalSocket *m_pSocket;
+
+    //runs the event loop until the client has n bytes to read, for up to a second
+    bool waitForBytes(qint64 n)
+    {
+        for (int i=0;i<200 && m_pSocket->bytesAvailable() < n;i++)
+            QTest::qWait(5);
+        return m_pSocket->bytesAvailable() >= n;
+    }
+
+    bool waitForClose()
+    {
+        for (int i=0;i<200 && m_pSocket->state() != QLocalSocket::UnconnectedState;i++)
+            QTest::qWait(5);
+        return m_pSocket->state() == QLocalSocket::UnconnectedState;
+    }
+
+    void send(const QByteArray &bytes)
+    {
+        m_pSocket->write(bytes);
+        m_pSocket->flush();
+    }
+
+    bool readAck(Ack *ack)
+    {
+        if (!waitForBytes(14))
+            return false;
+        QByteArray a = m_pSocket->read(14);
+        const uchar *p = reinterpret_cast<const uchar*>(a.constData());
+        if (qFromBigEndian<quint32>(p) != 10 || p[4] != INGEST_ACK)
+            return false;
+        ack->id = qFromBigEndian<quint32>(p + 5);
+        ack->status = p[9];
+        ack->accepted = qFromBigEndian<quint16>(p + 10);
+        ack->rejected = qFromBigEndian<quint16>(p + 12);
+        return true;
+    }
+
+    //the payload of the oldest item of a ring, which is then handed back
+    QByteArray take(int ring, PayloadData *copy = 0)
+    {
+        PayloadData *slot = m_pShared->front(ring);
+        if (!slot)
+            return QByteArray();
+        QByteArray json(m_pShared->payloadBytes(slot->block),slot->length);
+        if (copy)
+            *copy = *slot;
+        m_pShared->freePayload(slot->block,slot->app);
+        m_pShared->pop(ring);
+        return json;
+    }
+
+    //a malformed frame is acked with status 1, nothing is published and the connection closes
+    void expectMalformed(const QByteArray &bytes, quint32 id)
+    {
+        send(bytes);
+
+        Ack ack;
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.id,id);
+        QCOMPARE(ack.status,(quint8)INGEST_MALFORMED);
+        QCOMPARE(ack.accepted,(quint16)0);
+        QVERIFY(waitForClose());
+        QVERIFY(m_pShared->front() == 0);
+        QCOMPARE(m_pStats->ingestAccepted,0ULL);
+    }
+
+private slots:
+    void initTestCase()
+    {
+        m_sSocketPath = QDir::tempPath() + "/tst_cingestserver.sock";
+        m_pStats = new DaemonStats;
+        m_pStats->init(0);
+        m_pDaemon = new CAPNSd(ConfigSnapshot(),0,0,m_pStats,false);
+    }
+
+    void cleanupTestCase()
+    {
+        delete m_pDaemon;
+        delete m_pStats;
+    }
+
+    void init()
+    {
+        size_t size = SharedPayload::segmentSize(CAPACITY,2,PAYLOAD_ARENA_MIN_SIZE);
+        m_memory.fill(0,size / sizeof(quint64) + 1);
+        m_pShared = reinterpret_cast<SharedPayload*>(m_memory.data());
+        strcpy(m_pShared->appNames[0],"default");
+        strcpy(m_pShared->appNames[1],"news");
+        m_pShared->init(CAPACITY,2,PAYLOAD_ARENA_MIN_SIZE,0);
+        m_pStats->init(0);
+
+        m_pServer = new CIngestServer(m_pShared,m_pDaemon);
+        m_pServer->setAddress(m_sSocketPath,0);
+        m_pServer->start();
+
+        m_pSocket = new QLocalSocket();
+        m_pSocket->connectToServer(m_sSocketPath);
+        QVERIFY(m_pSocket->waitForConnected(1000));
+        //lets the server accept it
+        QTest::qWait(10);
+    }
+
+    void cleanup()
+    {
+        delete m_pSocket;
+        delete m_pServer;
+        QFile::remove(m_sSocketPath);
+    }
+
+    void batch()
+    {
+        QList<QByteArray> items;
+        items << item(INGEST_BATCH,0,PAYLOAD_PRIORITY_IMMEDIATE,payload(0));
+        items << item(INGEST_BATCH,1,PAYLOAD_PRIORITY_CONSERVE,payload(1));
+        send(frame(INGEST_BATCH,42,items));
+
+        Ack ack;
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.id,42U);
+        QCOMPARE(ack.status,(quint8)INGEST_OK);
+        QCOMPARE(ack.accepted,(quint16)2);
+        QCOMPARE(ack.rejected,(quint16)0);
+        QCOMPARE(m_pStats->ingestAccepted,2ULL);
+
+        PayloadData slot;
+        QCOMPARE(take(payloadRing(0,PAYLOAD_PRIORITY_IMMEDIATE),&slot),payload(0));
+        QCOMPARE(QByteArray(reinterpret_cast<const char*>(slot.device),PAYLOAD_TOKEN_SIZE),token(0));
+        QCOMPARE(slot.expiry,1000U);
+        QCOMPARE(slot.sendAt,0U);
+        QCOMPARE(slot.collapse,0ULL);
+        QCOMPARE((int)slot.app,0);
+        QCOMPARE(take(payloadRing(0,PAYLOAD_PRIORITY_CONSERVE),&slot),payload(1));
+        QCOMPARE((int)slot.priority,PAYLOAD_PRIORITY_CONSERVE);
+        QVERIFY(m_pShared->front() == 0);
+    }
+
+    void appBatch()
+    {
+        QList<QByteArray> items;
+        items << item(INGEST_APP_BATCH,0,PAYLOAD_PRIORITY_IMMEDIATE,payload(0),1234,"score");
+        items << item(INGEST_APP_BATCH,1,PAYLOAD_PRIORITY_IMMEDIATE,payload(1));
+        send(frame(INGEST_APP_BATCH,7,items,-1,"news"));
+
+        Ack ack;
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.id,7U);
+        QCOMPARE(ack.status,(quint8)INGEST_OK);
+        QCOMPARE(ack.accepted,(quint16)2);
+
+        int ring = payloadRing(1,PAYLOAD_PRIORITY_IMMEDIATE);
+        PayloadData slot;
+        QCOMPARE(take(ring,&slot),payload(0));
+        QCOMPARE((int)slot.app,1);
+        QCOMPARE(slot.sendAt,1234U);
+        QCOMPARE(slot.collapse,collapseKeyHash("score",5));
+        QCOMPARE(take(ring,&slot),payload(1));
+        QCOMPARE(slot.collapse,0ULL);
+        QVERIFY(m_pShared->front() == 0);
+    }
+
+    void rejectedItems()
+    {
+        QList<QByteArray> items;
+        items << item(INGEST_COLLAPSE_BATCH,0,7,payload(0));
+        items << item(INGEST_COLLAPSE_BATCH,1,PAYLOAD_PRIORITY_IMMEDIATE,QByteArray());
+        items << item(INGEST_COLLAPSE_BATCH,2,PAYLOAD_PRIORITY_IMMEDIATE,QByteArray(PAYLOAD_MAX_SIZE + 1,'x'));
+        items << item(INGEST_COLLAPSE_BATCH,3,PAYLOAD_PRIORITY_IMMEDIATE,payload(3),0,QByteArray(PAYLOAD_COLLAPSE_KEY_MAX + 1,'k'));
+        items << item(INGEST_COLLAPSE_BATCH,4,PAYLOAD_PRIORITY_IMMEDIATE,payload(4));
+        send(frame(INGEST_COLLAPSE_BATCH,3,items));
+
+        Ack ack;
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.status,(quint8)INGEST_OK);
+        QCOMPARE(ack.accepted,(quint16)1);
+        QCOMPARE(ack.rejected,(quint16)4);
+        QCOMPARE(m_pStats->ingestRejected,4ULL);
+
+        QCOMPARE(take(payloadRing(0,PAYLOAD_PRIORITY_IMMEDIATE)),payload(4));
+        QVERIFY(m_pShared->front() == 0);
+    }
+
+    //a frame arriving in pieces is only processed once it is complete
+    void partialFrame()
+    {
+        QList<QByteArray> items;
+        items << item(INGEST_SCHEDULED_BATCH,0,PAYLOAD_PRIORITY_IMMEDIATE,payload(0),99);
+        QByteArray bytes = frame(INGEST_SCHEDULED_BATCH,5,items);
+
+        //within the length, then within the body
+        int cuts[] = { 3, 20, bytes.size() - 1 };
+        int done = 0;
+        for (int i=0;i<3;i++)
+        {
+            send(bytes.mid(done,cuts[i] - done));
+            done = cuts[i];
+            QTest::qWait(20);
+            QCOMPARE(m_pSocket->bytesAvailable(),0LL);
+            QVERIFY(m_pShared->front() == 0);
+        }
+        send(bytes.mid(done));
+
+        Ack ack;
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.id,5U);
+        QCOMPARE(ack.accepted,(quint16)1);
+
+        PayloadData slot;
+        QCOMPARE(take(payloadRing(0,PAYLOAD_PRIORITY_IMMEDIATE),&slot),payload(0));
+        QCOMPARE(slot.sendAt,99U);
+    }
+
+    //pipelined batches are acked in order, a frame may straddle two reads
+    void pipelined()
+    {
+        QList<QByteArray> first;
+        first << item(INGEST_BATCH,0,PAYLOAD_PRIORITY_CONSERVE,payload(0));
+        QList<QByteArray> second;
+        second << item(INGEST_BATCH,1,PAYLOAD_PRIORITY_CONSERVE,payload(1));
+        QByteArray bytes = frame(INGEST_BATCH,1,first) + frame(INGEST_BATCH,2,second);
+
+        send(bytes.left(bytes.size() - 10));
+        QTest::qWait(20);
+        send(bytes.right(10));
+
+        Ack ack;
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.id,1U);
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.id,2U);
+
+        int ring = payloadRing(0,PAYLOAD_PRIORITY_CONSERVE);
+        QCOMPARE(take(ring),payload(0));
+        QCOMPARE(take(ring),payload(1));
+    }
+
+    //a batch larger than the ring stops half published and continues once there is room
+    void stallAndResume()
+    {
+        QList<QByteArray> items;
+        for (int i=0;i<CAPACITY + 2;i++)
+            items << item(INGEST_BATCH,i,PAYLOAD_PRIORITY_IMMEDIATE,payload(i));
+        send(frame(INGEST_BATCH,9,items));
+
+        QTest::qWait(50);
+        QCOMPARE(m_pSocket->bytesAvailable(),0LL);
+        QVERIFY(m_pStats->ingestStalls >= 1);
+
+        int ring = payloadRing(0,PAYLOAD_PRIORITY_IMMEDIATE);
+        for (int i=0;i<CAPACITY;i++)
+            QCOMPARE(take(ring),payload(i));
+
+        Ack ack;
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.id,9U);
+        QCOMPARE(ack.status,(quint8)INGEST_OK);
+        QCOMPARE(ack.accepted,(quint16)(CAPACITY + 2));
+
+        //the published items are not sent again
+        for (int i=CAPACITY;i<CAPACITY + 2;i++)
+            QCOMPARE(take(ring),payload(i));
+        QVERIFY(m_pShared->front() == 0);
+    }
+
+    void unknownApp()
+    {
+        QList<QByteArray> items;
+        items << item(INGEST_APP_BATCH,0,PAYLOAD_PRIORITY_IMMEDIATE,payload(0));
+        items << item(INGEST_APP_BATCH,1,PAYLOAD_PRIORITY_IMMEDIATE,payload(1));
+        send(frame(INGEST_APP_BATCH,11,items,-1,"nosuch"));
+
+        Ack ack;
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.id,11U);
+        QCOMPARE(ack.status,(quint8)INGEST_UNKNOWN_APP);
+        QCOMPARE(ack.accepted,(quint16)0);
+        QCOMPARE(ack.rejected,(quint16)2);
+        QVERIFY(m_pShared->front() == 0);
+
+        //the connection stays usable
+        send(frame(INGEST_APP_BATCH,12,items,-1,"default"));
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.id,12U);
+        QCOMPARE(ack.status,(quint8)INGEST_OK);
+        QCOMPARE(ack.accepted,(quint16)2);
+        QCOMPARE(ack.rejected,(quint16)0);
+    }
+
+    void unknownType()
+    {
+        QByteArray bytes;
+        appendInt(bytes,7,4);
+        bytes.append((char)9);
+        appendInt(bytes,13,4);
+        appendInt(bytes,0,2);
+        expectMalformed(bytes,0);
+    }
+
+    void frameTooLong()
+    {
+        QByteArray bytes;
+        appendInt(bytes,INGEST_MAX_FRAME + 1,4);
+        bytes.append((char)INGEST_BATCH);
+        expectMalformed(bytes,0);
+    }
+
+    void shortHeader()
+    {
+        QByteArray bytes;
+        appendInt(bytes,5,4);
+        bytes.append((char)INGEST_BATCH);
+        appendInt(bytes,14,4);
+        expectMalformed(bytes,14);
+    }
+
+    void appNameOverrun()
+    {
+        QByteArray bytes;
+        appendInt(bytes,11,4);
+        bytes.append((char)INGEST_APP_BATCH);
+        appendInt(bytes,15,4);
+        appendInt(bytes,0,2);
+        bytes.append((char)20);
+        bytes.append("new");
+        expectMalformed(bytes,15);
+    }
+
+    //the count says two items, the frame ends after the first
+    void itemOverrun()
+    {
+        QList<QByteArray> items;
+        items << item(INGEST_BATCH,0,PAYLOAD_PRIORITY_IMMEDIATE,payload(0));
+        expectMalformed(frame(INGEST_BATCH,16,items,2),16);
+    }
+
+    void trailingBytes()
+    {
+        QList<QByteArray> items;
+        items << item(INGEST_BATCH,0,PAYLOAD_PRIORITY_IMMEDIATE,payload(0));
+        items << QByteArray(1,'x');
+        expectMalformed(frame(INGEST_BATCH,17,items,1),17);
+    }
+
+    //the collapse key length points past the end of the frame
+    void collapseKeyOverrun()
+    {
+        QByteArray last = item(INGEST_COLLAPSE_BATCH,0,PAYLOAD_PRIORITY_IMMEDIATE,payload(0),0,"key");
+        last[41] = (char)200;
+        QList<QByteArray> items;
+        items << last;
+        expectMalformed(frame(INGEST_COLLAPSE_BATCH,18,items),18);
+    }
+
+    //batches before a malformed frame stay published, the ones after it are not read
+    void malformedAfterGood()
+    {
+        QList<QByteArray> items;
+        items << item(INGEST_BATCH,0,PAYLOAD_PRIORITY_IMMEDIATE,payload(0));
+        QByteArray bytes = frame(INGEST_BATCH,19,items);
+        bytes += frame(INGEST_BATCH,20,items,3);
+        bytes += frame(INGEST_BATCH,21,items);
+        send(bytes);
+
+        Ack ack;
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.id,19U);
+        QCOMPARE(ack.status,(quint8)INGEST_OK);
+        QVERIFY(readAck(&ack));
+        QCOMPARE(ack.id,20U);
+        QCOMPARE(ack.status,(quint8)INGEST_MALFORMED);
+        QVERIFY(waitForClose());
+        QCOMPARE(m_pSocket->bytesAvailable(),0LL);
+
+        int ring = payloadRing(0,PAYLOAD_PRIORITY_IMMEDIATE);
+        QCOMPARE(take(ring),payload(0));
+        QVERIFY(m_pShared->front() == 0);
+    }
+};
+
+QTEST_MAIN(TestIngestServer)
+
+#include "tst_cingestserver.moc"
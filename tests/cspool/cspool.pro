@@ -0,0 +1,25 @@
+#-------------------------------------------------
+#
+# CSpool journal, checkpoint and replay
+#
+#-------------------------------------------------
+
+QT       += core network testlib
+
+QT       -= gui
+
+TARGET = tst_cspool
+CONFIG   += console testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += tst_cspool.cpp \
+    ../../src/cspool.cpp
+
+HEADERS += \
+    ../../src/cspool.h \
+    ../../src/shared.h \
+    ../../src/config.h
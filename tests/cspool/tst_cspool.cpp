@@ -0,0 +1,266 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QtTest>
+#include <QDir>
+#include <QFile>
+#include <QStringList>
+#include "cspool.h"
+#include "shared.h"
+#include <unistd.h>
+
+//the smallest segment open() allows, a few hundred full payloads
+#define SEGMENT_SIZE (1024 * 1024)
+
+class TestSpool : public QObject
+{
+    Q_OBJECT
+
+private:
+    QString m_sDir;
+
+    static void removeDir(const QString &path)
+    {
+        QDir dir(path);
+        QStringList files = dir.entryList(QDir::Files);
+        for (int i=0;i<files.size();i++)
+            dir.remove(files[i]);
+        QDir().rmdir(path);
+    }
+
+    QStringList segments() const
+    {
+        return QDir(m_sDir).entryList(QStringList("spool-*.dat"),QDir::Files,QDir::Name);
+    }
+
+    static quint64 append(CSpool *spool, const QByteArray &json, int app = 0)
+    {
+        PayloadData payload;
+        memset(&payload,0,sizeof(payload));
+        payload.app = app;
+        payload.priority = PAYLOAD_PRIORITY_IMMEDIATE;
+        payload.length = json.size();
+        payload.block = 3;
+        return spool->append(&payload,json.constData());
+    }
+
+    //overwrites bytes of the first segment
+    bool patch(qint64 offset, const QByteArray &bytes) const
+    {
+        QFile file(m_sDir + "/" + segments().first());
+        if (!file.open(QIODevice::ReadWrite) || !file.seek(offset))
+            return false;
+        return file.write(bytes) == bytes.size();
+    }
+
+    //offset of a payload in the first segment
+    qint64 find(const QByteArray &json) const
+    {
+        QFile file(m_sDir + "/" + segments().first());
+        if (!file.open(QIODevice::ReadOnly))
+            return -1;
+        return file.readAll().indexOf(json);
+    }
+
+    //sequence numbers replayed by a fresh spool on the directory, the bytes stay in the spool
+    QList<quint64> replay(QList<QByteArray> *jsons = 0, QList<int> *apps = 0)
+    {
+        CSpool spool;
+        QString error;
+        QList<quint64> seqs;
+        if (!spool.open(m_sDir,SEGMENT_SIZE,&error))
+            return seqs;
+
+        PayloadData payload;
+        const char *json;
+        quint64 seq;
+        while (spool.peekReplay(&payload,&json,&seq) && payload.block == PAYLOAD_NO_BLOCK)
+        {
+            seqs.append(seq);
+            if (jsons)
+                jsons->append(QByteArray(json,payload.length));
+            if (apps)
+                apps->append(payload.app);
+            spool.advanceReplay();
+        }
+        return seqs;
+    }
+
+private slots:
+    void init()
+    {
+        m_sDir = QDir::tempPath() + "/tst_cspool-" + QString::number((int)::getpid());
+        removeDir(m_sDir);
+    }
+
+    void cleanup()
+    {
+        removeDir(m_sDir);
+    }
+
+    //records nobody checkpointed come back in order with their bytes and app
+    void replayAfterRestart()
+    {
+        {
+            CSpool spool;
+            QString error;
+            QVERIFY(spool.open(m_sDir,SEGMENT_SIZE,&error));
+            QCOMPARE(append(&spool,"a",0),(quint64)1);
+            QCOMPARE(append(&spool,"bb",2),(quint64)2);
+            QCOMPARE(append(&spool,"ccc",1),(quint64)3);
+            spool.sync(1);
+        }
+
+        QList<QByteArray> jsons;
+        QList<int> apps;
+        QCOMPARE(replay(&jsons,&apps),QList<quint64>() << 1 << 2 << 3);
+        QCOMPARE(jsons,QList<QByteArray>() << "a" << "bb" << "ccc");
+        QCOMPARE(apps,QList<int>() << 0 << 2 << 1);
+    }
+
+    void checkpointSkipsWritten()
+    {
+        {
+            CSpool spool;
+            QString error;
+            QVERIFY(spool.open(m_sDir,SEGMENT_SIZE,&error));
+            for (int i=0;i<5;i++)
+                append(&spool,"x");
+            spool.sync(4);
+            QCOMPARE(spool.checkpoint(),(quint64)4);
+        }
+
+        QCOMPARE(replay(),QList<quint64>() << 4 << 5);
+    }
+
+    //the checkpoint never moves back
+    void checkpointMonotonic()
+    {
+        CSpool spool;
+        QString error;
+        QVERIFY(spool.open(m_sDir,SEGMENT_SIZE,&error));
+        for (int i=0;i<5;i++)
+            append(&spool,"x");
+        spool.sync(5);
+        spool.sync(2);
+        QCOMPARE(spool.checkpoint(),(quint64)5);
+    }
+
+    //sequence numbers go on after a restart, replayed or not
+    void seqContinues()
+    {
+        {
+            CSpool spool;
+            QString error;
+            QVERIFY(spool.open(m_sDir,SEGMENT_SIZE,&error));
+            append(&spool,"x");
+            append(&spool,"y");
+            spool.sync(3);
+        }
+
+        CSpool spool;
+        QString error;
+        QVERIFY(spool.open(m_sDir,SEGMENT_SIZE,&error));
+        QCOMPARE(spool.replayCount(),(quint64)0);
+        QCOMPARE(append(&spool,"z"),(quint64)3);
+    }
+
+    //whole segments before the checkpoint are deleted, the current one stays
+    void segmentsRemoved()
+    {
+        CSpool spool;
+        QString error;
+        QVERIFY(spool.open(m_sDir,SEGMENT_SIZE,&error));
+        QByteArray json(PAYLOAD_MAX_SIZE,'j');
+        for (int i=0;i<600;i++)
+            QVERIFY(append(&spool,json) != 0);
+        QVERIFY(segments().size() > 2);
+
+        spool.sync(300);
+        QVERIFY(segments().size() > 1);
+        spool.sync(spool.nextSeq());
+        QCOMPARE(segments().size(),1);
+    }
+
+    //segmentSeq() follows the segment appended to
+    void segmentSeq()
+    {
+        CSpool spool;
+        QString error;
+        QVERIFY(spool.open(m_sDir,SEGMENT_SIZE,&error));
+        QCOMPARE(spool.segmentSeq(),(quint64)1);
+
+        QByteArray json(PAYLOAD_MAX_SIZE,'j');
+        int first = segments().size();
+        quint64 seq = 0;
+        while (segments().size() == first)
+            seq = append(&spool,json);
+        QCOMPARE(spool.segmentSeq(),seq);
+    }
+
+    //a torn record ends the replay of its segment
+    void tornTail()
+    {
+        {
+            CSpool spool;
+            QString error;
+            QVERIFY(spool.open(m_sDir,SEGMENT_SIZE,&error));
+            append(&spool,"first");
+            append(&spool,"second");
+            append(&spool,"third");
+            spool.sync(1);
+        }
+
+        qint64 offset = find("third");
+        QVERIFY(offset > 0);
+        QVERIFY(patch(offset,"T"));
+        QCOMPARE(replay(),QList<quint64>() << 1 << 2);
+    }
+
+    //a segment of another version is reported and left on disk
+    void otherVersionKept()
+    {
+        {
+            CSpool spool;
+            QString error;
+            QVERIFY(spool.open(m_sDir,SEGMENT_SIZE,&error));
+            append(&spool,"old");
+            spool.sync(1);
+        }
+        QString first = segments().first();
+        quint32 version = 99;
+        QVERIFY(patch(4,QByteArray(reinterpret_cast<const char*>(&version),4)));
+
+        CSpool spool;
+        QString error;
+        QVERIFY(spool.open(m_sDir,SEGMENT_SIZE,&error));
+        QCOMPARE(spool.replayCount(),(quint64)0);
+        QCOMPARE(spool.skipped().size(),1);
+
+        append(&spool,"new");
+        spool.sync(spool.nextSeq());
+        QVERIFY(QFile::exists(m_sDir + "/" + first));
+    }
+};
+
+QTEST_APPLESS_MAIN(TestSpool)
+
+#include "tst_cspool.moc"
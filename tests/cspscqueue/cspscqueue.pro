@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# CSpscQueue claim, publish and pop
+#
+#-------------------------------------------------
+
+QT       += core testlib
+
+QT       -= gui
+
+TARGET = tst_cspscqueue
+CONFIG   += console testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += tst_cspscqueue.cpp
+
+HEADERS += \
+    ../../src/cspscqueue.h
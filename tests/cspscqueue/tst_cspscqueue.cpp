@@ -0,0 +1,135 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QtTest>
+#include "cspscqueue.h"
+
+class TestSpscQueue : public QObject
+{
+    Q_OBJECT
+
+    static bool push(CSpscQueue<quint32> &queue, quint32 value)
+    {
+        quint32 *slot = queue.claim();
+        if (!slot)
+            return false;
+        *slot = value;
+        queue.publish();
+        return true;
+    }
+
+private slots:
+    void capacityRounded()
+    {
+        CSpscQueue<quint32> queue(5);
+        QCOMPARE(queue.capacity(),8U);
+        queue.resize(0);
+        QCOMPARE(queue.capacity(),2U);
+        queue.resize(16);
+        QCOMPARE(queue.capacity(),16U);
+    }
+
+    void emptyQueue()
+    {
+        CSpscQueue<quint32> queue(4);
+        QVERIFY(queue.front() == 0);
+        QCOMPARE(queue.size(),0U);
+    }
+
+    void fifoUntilFull()
+    {
+        CSpscQueue<quint32> queue(4);
+        for (quint32 i=0;i<4;i++)
+            QVERIFY(push(queue,i));
+        QVERIFY(queue.claim() == 0);
+        QCOMPARE(queue.size(),4U);
+
+        for (quint32 i=0;i<4;i++)
+        {
+            QVERIFY(queue.front() != 0);
+            QCOMPARE(*queue.front(),i);
+            queue.pop();
+        }
+        QVERIFY(queue.front() == 0);
+        QVERIFY(queue.claim() != 0);
+    }
+
+    //claiming without publishing keeps the slot hidden from the consumer
+    void claimWithoutPublish()
+    {
+        CSpscQueue<quint32> queue(4);
+        *queue.claim() = 7;
+        QVERIFY(queue.front() == 0);
+        queue.publish();
+        QCOMPARE(*queue.front(),7U);
+    }
+
+    void wrapAround()
+    {
+        CSpscQueue<quint32> queue(4);
+        quint32 next = 0;
+        for (quint32 i=0;i<100;i++)
+        {
+            QVERIFY(push(queue,i));
+            if (queue.size() == 3)
+            {
+                QCOMPARE(*queue.front(),next++);
+                queue.pop();
+            }
+        }
+        QCOMPARE(queue.head(),100U);
+        QCOMPARE(queue.tail(),next);
+        while (queue.front())
+        {
+            QCOMPARE(*queue.front(),next++);
+            queue.pop();
+        }
+        QCOMPARE(next,100U);
+    }
+
+    //the producer can still reach what it published by position
+    void atPosition()
+    {
+        CSpscQueue<quint32> queue(4);
+        for (quint32 i=0;i<6;i++)
+        {
+            quint32 pos = queue.head();
+            QVERIFY(push(queue,i * 10));
+            QCOMPARE(*queue.at(pos),i * 10);
+            queue.pop();
+        }
+    }
+
+    void resizeEmpties()
+    {
+        CSpscQueue<quint32> queue(4);
+        push(queue,1);
+        push(queue,2);
+        queue.resize(8);
+        QCOMPARE(queue.size(),0U);
+        QCOMPARE(queue.head(),0U);
+        QVERIFY(queue.front() == 0);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestSpscQueue)
+
+#include "tst_cspscqueue.moc"
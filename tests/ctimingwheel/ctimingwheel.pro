@@ -0,0 +1,24 @@
+#-------------------------------------------------
+#
+# CTimingWheel placement and cascades
+#
+#-------------------------------------------------
+
+QT       += core testlib
+
+QT       -= gui
+
+TARGET = tst_ctimingwheel
+CONFIG   += console testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += tst_ctimingwheel.cpp \
+    ../../src/ctimingwheel.cpp
+
+HEADERS += \
+    ../../src/ctimingwheel.h \
+    ../../src/shared.h
@@ -0,0 +1,252 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QtTest>
+#include "ctimingwheel.h"
+
+//a fixed clock keeps the slot boundaries the same on every run
+#define NOW 1000000000U
+
+class TestTimingWheel : public QObject
+{
+    Q_OBJECT
+
+private:
+    static void add(CTimingWheel *wheel, quint32 sendAt, quint64 seq = 0)
+    {
+        PayloadData payload;
+        memset(&payload,0,sizeof(payload));
+        payload.sendAt = sendAt;
+        payload.length = 4;
+        payload.block = 7;
+        wheel->add(&payload,"json",seq);
+    }
+
+    //send-at times that came due, popped in order
+    static QList<quint32> popDue(CTimingWheel *wheel)
+    {
+        QList<quint32> times;
+        const char *json;
+        const PayloadData *payload;
+        while ((payload = wheel->due(&json)) != 0)
+        {
+            times.append(payload->sendAt);
+            wheel->popDue();
+        }
+        return times;
+    }
+
+    //steps one second at a time and checks nothing comes due before its time
+    static bool dueExactly(CTimingWheel *wheel, quint32 from, quint32 sendAt)
+    {
+        for (quint32 t=from;t<sendAt;t++)
+        {
+            wheel->advance(t);
+            if (wheel->dueCount())
+                return false;
+        }
+        wheel->advance(sendAt);
+        QList<quint32> due = popDue(wheel);
+        return due.size() == 1 && due[0] == sendAt;
+    }
+
+private slots:
+    void pastIsDueRightAway()
+    {
+        CTimingWheel wheel;
+        wheel.start(NOW);
+        add(&wheel,NOW - 5);
+        add(&wheel,NOW);
+        QCOMPARE(wheel.dueCount(),2U);
+        QCOMPARE(popDue(&wheel).size(),2);
+        QCOMPARE(wheel.count(),0U);
+    }
+
+    void levelZero()
+    {
+        CTimingWheel wheel;
+        wheel.start(NOW);
+        add(&wheel,NOW + 5);
+        QVERIFY(dueExactly(&wheel,NOW,NOW + 5));
+    }
+
+    //one level up, placed into level 0 when the next 64 seconds begin
+    void cascadeLevelOne()
+    {
+        CTimingWheel wheel;
+        wheel.start(NOW);
+        quint32 when = NOW + WHEEL_SLOTS * 3 + 17;
+        add(&wheel,when);
+        QVERIFY(dueExactly(&wheel,NOW,when));
+    }
+
+    void cascadeLevelTwo()
+    {
+        CTimingWheel wheel;
+        wheel.start(NOW);
+        quint32 when = NOW + WHEEL_SLOTS * WHEEL_SLOTS * 2 + WHEEL_SLOTS * 5 + 3;
+        add(&wheel,when);
+        QVERIFY(dueExactly(&wheel,NOW,when));
+    }
+
+    //entries at every level come due in time order over several cascades
+    void cascadeMixed()
+    {
+        CTimingWheel wheel;
+        wheel.start(NOW);
+        QList<quint32> times;
+        times << NOW + 1 << NOW + 63 << NOW + 64 << NOW + 65 << NOW + 4095 << NOW + 4096 << NOW + 4097 << NOW + 70000;
+        for (int i=times.size() - 1;i>=0;i--)
+            add(&wheel,times[i]);
+
+        QList<quint32> due;
+        for (quint32 t=NOW + 1;t<=NOW + 70000;t++)
+        {
+            wheel.advance(t);
+            QList<quint32> now = popDue(&wheel);
+            for (int i=0;i<now.size();i++)
+            {
+                QCOMPARE(now[i],t);
+                due.append(now[i]);
+            }
+        }
+        QCOMPARE(due,times);
+        QCOMPARE(wheel.count(),0U);
+    }
+
+    //beyond the top level the entry is parked and placed again on a cascade
+    void beyondRange()
+    {
+        CTimingWheel wheel;
+        wheel.start(NOW);
+        quint32 when = NOW + (1U << (WHEEL_BITS * WHEEL_LEVELS)) + 100;
+        add(&wheel,when);
+
+        wheel.advance(when - 1);
+        QCOMPARE(wheel.dueCount(),0U);
+        wheel.advance(when);
+        QCOMPARE(popDue(&wheel),QList<quint32>() << when);
+    }
+
+    //with nothing in the slots advance() jumps, later entries still land right
+    void jumpWhenEmpty()
+    {
+        CTimingWheel wheel;
+        wheel.start(NOW);
+        wheel.advance(NOW + 1000000);
+        add(&wheel,NOW + 1000000 + WHEEL_SLOTS + 1);
+        QVERIFY(dueExactly(&wheel,NOW + 1000000,NOW + 1000000 + WHEEL_SLOTS + 1));
+    }
+
+    void keepsSeqAndBytes()
+    {
+        CTimingWheel wheel;
+        wheel.start(NOW);
+        add(&wheel,NOW + 2,42);
+        wheel.advance(NOW + 2);
+
+        const char *json;
+        quint64 seq = 0;
+        const PayloadData *payload = wheel.due(&json,&seq);
+        QVERIFY(payload != 0);
+        QCOMPARE(seq,(quint64)42);
+        QCOMPARE(payload->block,(quint32)PAYLOAD_NO_BLOCK);
+        QCOMPARE(QByteArray(json,payload->length),QByteArray("json"));
+    }
+
+    //take() empties the wheel whether or not the entries are due
+    void takeAll()
+    {
+        CTimingWheel wheel;
+        wheel.start(NOW);
+        add(&wheel,NOW,1);
+        add(&wheel,NOW + 10,2);
+        add(&wheel,NOW + 100000,3);
+
+        PayloadData payload;
+        QByteArray json;
+        quint64 seq;
+        quint64 seqs = 0;
+        int n = 0;
+        while (wheel.take(&payload,&json,&seq))
+        {
+            seqs += seq;
+            n++;
+        }
+        QCOMPARE(n,3);
+        QCOMPARE(seqs,(quint64)6);
+        QCOMPARE(wheel.count(),0U);
+    }
+
+    //entries in the slots and due ones, without a record or with a newer one left out
+    void journaledBefore()
+    {
+        CTimingWheel wheel;
+        wheel.start(NOW);
+        add(&wheel,NOW,3);
+        add(&wheel,NOW + 10,5);
+        add(&wheel,NOW + 100000,1);
+        add(&wheel,NOW + 20);
+        add(&wheel,NOW + 30,9);
+
+        QVector<quint32> refs = wheel.journaledBefore(6);
+        QCOMPARE(refs.size(),3);
+        quint64 seqs = 0;
+        for (int i=0;i<refs.size();i++)
+        {
+            const char *json;
+            quint64 seq;
+            const PayloadData *payload = wheel.payload(refs[i],&json,&seq);
+            QCOMPARE(QByteArray(json,payload->length),QByteArray("json"));
+            seqs += seq;
+            wheel.setSeq(refs[i],100 + i);
+        }
+        QCOMPARE(seqs,(quint64)9);
+        QCOMPARE(wheel.journaledBefore(6).size(),0);
+
+        //the new records come out with the entries
+        PayloadData payload;
+        QByteArray json;
+        quint64 seq;
+        seqs = 0;
+        while (wheel.take(&payload,&json,&seq))
+            seqs += seq;
+        QCOMPARE(seqs,(quint64)(100 + 101 + 102 + 9));
+    }
+
+    //freed entries are reused, the wheel does not grow with churn
+    void reuse()
+    {
+        CTimingWheel wheel;
+        wheel.start(NOW);
+        for (quint32 t=1;t<=3 * WHEEL_CHUNK;t++)
+        {
+            add(&wheel,NOW + t);
+            wheel.advance(NOW + t);
+            QCOMPARE(popDue(&wheel).size(),1);
+        }
+        QCOMPARE(wheel.count(),0U);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestTimingWheel)
+
+#include "tst_ctimingwheel.moc"
@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# Hex device token decoding
+#
+#-------------------------------------------------
+
+QT       += core testlib
+
+QT       -= gui
+
+TARGET = tst_hexdecode
+CONFIG   += console testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += tst_hexdecode.cpp
+
+HEADERS += \
+    ../../src/hexdecode.h
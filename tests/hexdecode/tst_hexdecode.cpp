@@ -0,0 +1,90 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QtTest>
+#include "hexdecode.h"
+
+class TestHexDecode : public QObject
+{
+    Q_OBJECT
+
+    static QByteArray token(int first)
+    {
+        QByteArray bytes;
+        for (int i=0;i<32;i++)
+            bytes.append((char)(first + i));
+        return bytes;
+    }
+
+private slots:
+    //every byte value in every position, lower and upper case
+    void allBytes()
+    {
+        for (int first=0;first<256;first+=32)
+        {
+            QByteArray bytes = token(first);
+            QByteArray lower = bytes.toHex();
+            QByteArray upper = lower.toUpper();
+            uchar out[32];
+
+            QVERIFY(decodeHexToken(lower.constData(),out));
+            QVERIFY(memcmp(out,bytes.constData(),32) == 0);
+            QVERIFY(decodeHexToken(upper.constData(),out));
+            QVERIFY(memcmp(out,bytes.constData(),32) == 0);
+            QVERIFY(decodeHexTokenScalar(upper.constData(),out));
+            QVERIFY(memcmp(out,bytes.constData(),32) == 0);
+        }
+    }
+
+    //characters next to the digit and letter ranges, anywhere in the token
+    void rejectsNonHex()
+    {
+        const char bad[] = { '/', ':', '@', 'G', '`', 'g', ' ', 0, (char)0x80, (char)0xb0, (char)0xe1 };
+        QByteArray hex = token(7).toHex();
+        uchar out[32];
+
+        for (int pos=0;pos<64;pos++)
+        {
+            for (size_t i=0;i<sizeof(bad);i++)
+            {
+                QByteArray broken = hex;
+                broken[pos] = bad[i];
+                QVERIFY(!decodeHexToken(broken.constData(),out));
+                QVERIFY(!decodeHexTokenScalar(broken.constData(),out));
+            }
+        }
+    }
+
+    void mixedCase()
+    {
+        const char hex[] = "00fFaAbB09Ee7c1d00fFaAbB09Ee7c1d00fFaAbB09Ee7c1d00fFaAbB09Ee7c1d";
+        const uchar first[8] = { 0x00, 0xff, 0xaa, 0xbb, 0x09, 0xee, 0x7c, 0x1d };
+        uchar out[32];
+
+        QVERIFY(decodeHexToken(hex,out));
+        for (int i=0;i<32;i++)
+            QCOMPARE(out[i],first[i % 8]);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestHexDecode)
+
+#include "tst_hexdecode.moc"
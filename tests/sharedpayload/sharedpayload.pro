@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# SharedPayload rings and payload arena
+#
+#-------------------------------------------------
+
+QT       += core testlib
+
+QT       -= gui
+
+TARGET = tst_sharedpayload
+CONFIG   += console testcase
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+INCLUDEPATH += ../../src
+
+SOURCES += tst_sharedpayload.cpp
+
+HEADERS += \
+    ../../src/shared.h
@@ -0,0 +1,279 @@
+/****************************************************************************
+**
+** Apple Push Notification Service daemon
+**
+** Copyright (C) 2014 DreamLogics <info@dreamlogics.com>
+** Copyright (C) 2014 Stefan Ladage <sladage@gmail.com>
+**
+** This program is free software: you can redistribute it and/or modify
+** it under the terms of the GNU Lesser General Public License as published
+** by the Free Software Foundation, either version 3 of the License, or
+** (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU Lesser General Public License for more details.
+**
+** You should have received a copy of the GNU Lesser General Public License
+** along with this program.  If not, see <http://www.gnu.org/licenses/>.
+**
+****************************************************************************/
+#include <QtTest>
+#include <QVector>
+#include "shared.h"
+
+#define CAPACITY 8
+
+/*
+ * A zeroed heap block laid out like the APNSdShared segment, set up the
+ * way the daemon does it.
+ */
+class Segment
+{
+public:
+    Segment(quint32 apps, size_t arenaSize, quint64 quota = 0)
+    {
+        size_t size = SharedPayload::segmentSize(CAPACITY,apps,arenaSize);
+        m_memory.fill(0,size / sizeof(quint64) + 1);
+        m_pShared = reinterpret_cast<SharedPayload*>(m_memory.data());
+        const char *names[] = { "default", "news", "chat" };
+        for (quint32 i=0;i<apps && i<3;i++)
+            strcpy(m_pShared->appNames[i],names[i]);
+        m_pShared->init(CAPACITY,apps,arenaSize,quota);
+        m_iSize = size;
+    }
+
+    SharedPayload *operator->() { return m_pShared; }
+    SharedPayload *data() { return m_pShared; }
+    size_t size() const { return m_iSize; }
+
+private:
+    QVector<quint64> m_memory;
+    SharedPayload *m_pShared;
+    size_t m_iSize;
+};
+
+class TestSharedPayload : public QObject
+{
+    Q_OBJECT
+
+private:
+    static bool push(SharedPayload *shared, int ring, quint32 length)
+    {
+        quint32 pos;
+        PayloadData *slot = shared->claim(ring,&pos);
+        if (!slot)
+            return false;
+        slot->length = length;
+        shared->publish(slot,pos);
+        return true;
+    }
+
+private slots:
+    void valid()
+    {
+        Segment shared(2,PAYLOAD_ARENA_MIN_SIZE);
+        QVERIFY(shared->valid(shared.size()));
+        QVERIFY(!shared->valid(shared.size() / 2));
+        QCOMPARE(shared->ringCount(),2 * PAYLOAD_CLASSES);
+        QCOMPARE(SharedPayload::roundCapacity(1000),1024U);
+    }
+
+    //a claimed slot is not visible to the consumer until it is published
+    void claimPublishPop()
+    {
+        Segment shared(1,PAYLOAD_ARENA_MIN_SIZE);
+        quint32 pos;
+
+        QVERIFY(shared->front(0) == 0);
+        PayloadData *slot = shared->claim(0,&pos);
+        QVERIFY(slot != 0);
+        QCOMPARE(pos,0U);
+        QVERIFY(shared->front(0) == 0);
+
+        slot->length = 11;
+        shared->publish(slot,pos);
+        QVERIFY(shared->front(0) == slot);
+        QCOMPARE(shared->frontPos(0),0U);
+        QCOMPARE(shared->size(0),1U);
+
+        shared->pop(0);
+        QVERIFY(shared->front(0) == 0);
+        QCOMPARE(shared->size(0),0U);
+    }
+
+    //slots published out of order are consumed in claim order
+    void publishOutOfOrder()
+    {
+        Segment shared(1,PAYLOAD_ARENA_MIN_SIZE);
+        quint32 first = 0, second = 0;
+
+        PayloadData *a = shared->claim(0,&first);
+        PayloadData *b = shared->claim(0,&second);
+        b->length = 2;
+        shared->publish(b,second);
+        QVERIFY(shared->front(0) == 0);
+
+        a->length = 1;
+        shared->publish(a,first);
+        QCOMPARE((int)shared->front(0)->length,1);
+        shared->pop(0);
+        QCOMPARE((int)shared->front(0)->length,2);
+    }
+
+    //a full ring refuses claims until the consumer pops, positions wrap
+    void fullAndWrap()
+    {
+        Segment shared(1,PAYLOAD_ARENA_MIN_SIZE);
+        for (int i=0;i<CAPACITY;i++)
+            QVERIFY(push(shared.data(),0,i));
+        QVERIFY(!push(shared.data(),0,99));
+
+        for (int i=0;i<5 * CAPACITY;i++)
+        {
+            PayloadData *front = shared->front(0);
+            QVERIFY(front != 0);
+            QCOMPARE((int)front->length,i);
+            shared->pop(0);
+            QVERIFY(push(shared.data(),0,i + CAPACITY));
+            QVERIFY(!push(shared.data(),0,99));
+        }
+    }
+
+    void claimBatch()
+    {
+        Segment shared(1,PAYLOAD_ARENA_MIN_SIZE);
+        quint32 pos;
+
+        QCOMPARE(shared->claimBatch(0,5,&pos),5U);
+        QCOMPARE(pos,0U);
+        QCOMPARE(shared->claimBatch(0,5,&pos),3U);
+        QCOMPARE(pos,5U);
+        QCOMPARE(shared->claimBatch(0,5,&pos),0U);
+
+        for (quint32 i=0;i<CAPACITY;i++)
+            shared->publish(shared->slot(0,i),i);
+        shared->pop(0);
+        QCOMPARE(shared->claimBatch(0,5,&pos),1U);
+        QCOMPARE(pos,(quint32)CAPACITY);
+    }
+
+    //every app and class has its own ring, sleep() skips the flagged ones
+    void ringsAndSleep()
+    {
+        Segment shared(2,PAYLOAD_ARENA_MIN_SIZE);
+        int ring = payloadRing(1,PAYLOAD_PRIORITY_CONSERVE);
+        QCOMPARE(ring,3);
+
+        QVERIFY(shared->sleep());
+        QVERIFY(push(shared.data(),ring,1));
+        for (int r=0;r<shared->ringCount();r++)
+            QCOMPARE(shared->front(r) != 0,r == ring);
+        QVERIFY(shared->front() == shared->front(ring));
+
+        QVERIFY(!shared->sleep());
+        bool skip[PAYLOAD_RINGS_MAX] = { false };
+        skip[ring] = true;
+        QVERIFY(shared->sleep(skip));
+    }
+
+    void findApp()
+    {
+        Segment shared(3,PAYLOAD_ARENA_MIN_SIZE);
+        QCOMPARE(shared->findApp("",0),0);
+        QCOMPARE(shared->findApp("news",4),1);
+        QCOMPARE(shared->findApp("chat",4),2);
+        QCOMPARE(shared->findApp("new",3),-1);
+        QCOMPARE(shared->findApp("mail",4),-1);
+    }
+
+    //blocks of the smallest fitting class, larger ones once it ran out
+    void arenaClasses()
+    {
+        Segment shared(1,PAYLOAD_ARENA_MIN_SIZE);
+
+        quint32 block = shared->allocPayload(100,0);
+        QVERIFY(block != PAYLOAD_NO_BLOCK);
+        QCOMPARE(block >> 28,1U);
+        memset(shared->payloadBytes(block),'x',128);
+        shared->freePayload(block,0);
+
+        quint32 count = shared->classes[0].count;
+        QVector<quint32> blocks;
+        for (quint32 i=0;i<count;i++)
+            blocks.append(shared->allocPayload(64,0));
+        for (quint32 i=0;i<count;i++)
+            QCOMPARE(blocks[i] >> 28,0U);
+
+        block = shared->allocPayload(64,0);
+        QCOMPARE(block >> 28,1U);
+        shared->freePayload(block,0);
+
+        //freed blocks come back
+        for (quint32 i=0;i<count;i++)
+            shared->freePayload(blocks[i],0);
+        block = shared->allocPayload(64,0);
+        QCOMPARE(block >> 28,0U);
+        shared->freePayload(block,0);
+        QCOMPARE(shared->appArena[0].used,(quint64)0);
+    }
+
+    //a full arena returns PAYLOAD_NO_BLOCK and recovers once blocks are freed
+    void arenaFull()
+    {
+        Segment shared(1,PAYLOAD_ARENA_MIN_SIZE);
+        QVector<quint32> blocks;
+        quint32 block;
+        while ((block = shared->allocPayload(PAYLOAD_MAX_SIZE,0)) != PAYLOAD_NO_BLOCK)
+            blocks.append(block);
+        QCOMPARE((quint32)blocks.size(),shared->classes[PAYLOAD_ARENA_CLASSES - 1].count);
+        QVERIFY(shared->allocPayload(PAYLOAD_MAX_SIZE + 1,0) == PAYLOAD_NO_BLOCK);
+
+        shared->freePayload(blocks[3],0);
+        QVERIFY(shared->allocPayload(PAYLOAD_MAX_SIZE,0) == blocks[3]);
+    }
+
+    //an app stops at its quota, the other apps still get blocks
+    void appQuota()
+    {
+        Segment shared(2,PAYLOAD_ARENA_MIN_SIZE,4096);
+        QVector<quint32> blocks;
+        for (int i=0;i<64;i++)
+        {
+            quint32 block = shared->allocPayload(64,0);
+            QVERIFY(block != PAYLOAD_NO_BLOCK);
+            blocks.append(block);
+        }
+        QCOMPARE(shared->appArena[0].used,(quint64)4096);
+        QCOMPARE(shared->appArena[0].failures,(quint64)0);
+
+        QVERIFY(shared->allocPayload(64,0) == PAYLOAD_NO_BLOCK);
+        QCOMPARE(shared->appArena[0].failures,(quint64)1);
+        QCOMPARE(shared->appArena[0].used,(quint64)4096);
+
+        quint32 other = shared->allocPayload(64,1);
+        QVERIFY(other != PAYLOAD_NO_BLOCK);
+        QCOMPARE(shared->appArena[1].used,(quint64)64);
+
+        //a larger block counts with its whole size
+        shared->freePayload(blocks[0],0);
+        QVERIFY(shared->allocPayload(128,0) == PAYLOAD_NO_BLOCK);
+        QCOMPARE(shared->appArena[0].failures,(quint64)2);
+        QVERIFY(shared->allocPayload(64,0) != PAYLOAD_NO_BLOCK);
+    }
+
+    //failures without a quota count a full arena
+    void failuresWithoutQuota()
+    {
+        Segment shared(1,PAYLOAD_ARENA_MIN_SIZE);
+        while (shared->allocPayload(PAYLOAD_MAX_SIZE,0) != PAYLOAD_NO_BLOCK)
+            ;
+        QCOMPARE(shared->appArena[0].failures,(quint64)1);
+        QVERIFY(shared->appQuota == 0);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestSharedPayload)
+
+#include "tst_sharedpayload.moc"
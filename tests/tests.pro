@@ -0,0 +1,18 @@
+#-------------------------------------------------
+#
+# Unit tests, run with qmake && make check
+#
+#-------------------------------------------------
+
+TEMPLATE = subdirs
+
+SUBDIRS += \
+    ctimingwheel \
+    ccollapseindex \
+    cspool \
+    sharedpayload \
+    cinflightwindow \
+    cspscqueue \
+    hexdecode \
+    cframeencoder \
+    cingestserver